@@ -179,11 +179,22 @@ local function CopyAnimationToObject(pd, j, obj)
 	local posProp = FindAnimProp(obj, "position")
 	local rotProp = FindAnimProp(obj, "rotation")
 	
+	-- the keys are collected first, so each property is rebuilt only once
+	local posTimes, posValues = FloatArray(), FloatArray()
+	local rotTimes, rotValues = FloatArray(), FloatArray()
+	
+	local function AddKey(times, values, time, v)
+		times:push_back(time)
+		values:push_back(v.x)
+		values:push_back(v.y)
+		values:push_back(v.z)
+	end
+	
 	for f=0, pd.nFrames-1 do
 		local keys, pos = GetPropertyValue( {x="Xposition", y="Yposition", z="Zposition"}, Vector3(), f)
 		if keys and posProp then
 			TransformPosition(pos)
-			upsAnimInsertVectorKey(posProp, pd.frameTime * f, pos)
+			AddKey(posTimes, posValues, pd.frameTime * f, pos)
 		end
 		
 		local rot
@@ -192,9 +203,16 @@ local function CopyAnimationToObject(pd, j, obj)
 		if keys and rotProp then
 			rot = rot * M_PI / 180
 			TransformRotation(rot)
-			upsAnimInsertVectorKey(rotProp, pd.frameTime * f, rot)
+			AddKey(rotTimes, rotValues, pd.frameTime * f, rot)
 		end
 	end
+	
+	if posProp then
+		upsAnimInsertVectorKeys(posProp, posTimes, posValues)
+	end
+	if rotProp then
+		upsAnimInsertVectorKeys(rotProp, rotTimes, rotValues)
+	end
 end
 
 local function ConvertTree(pd, j)
@@ -17,14 +17,8 @@ local function RecalcNormals(selected)
 			objs = upsGetModel():GetObjectList();
 		end
 		
-		for i=0,#objs-1 do
-			local o = objs[i];
-			local pm = o:GetPolyMesh();
-			
-			if pm then
-				pm:CalculateNormals2(maxSmoothingAngle);
-			end
-		end
+		-- all objects at once, so their meshes are done in parallel
+		CalculateObjectNormals(objs, maxSmoothingAngle);
 	end	
 end
 
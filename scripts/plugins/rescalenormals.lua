@@ -14,6 +14,8 @@ function Rescale_Normals()
 			local pm = objects[i]:GetPolyMesh();
 			if pm then
 				RescalePolyMeshNormals(pm) 
+				-- the vertices were changed directly, so the drawing cache has to be rebuilt
+				objects[i]:InvalidateRenderData();
 			end
 		end
 	end
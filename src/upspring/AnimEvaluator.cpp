@@ -0,0 +1,285 @@
+//-----------------------------------------------------------------------
+//  Upspring model editor
+//  Copyright 2005 Jelmer Cnossen
+//  This code is released under GPL license, see LICENSE.HTML for info.
+//-----------------------------------------------------------------------
+#include "EditorIncl.h"
+#include "EditorDef.h"
+
+#include "Model.h"
+#include "AnimEvaluator.h"
+
+static void CollectTracks(MdlObject *o, vector<AnimEvaluator::Track>& tracks)
+{
+	vector<AnimProperty*>& props = o->animInfo.properties;
+	for (uint a=0;a<props.size();a++) {
+		AnimEvaluator::Track t;
+		t.obj = o;
+		t.prop = props[a];
+		t.type = AnimEvaluator::TRACK_Other;
+		t.firstLane = t.numLanes = 0;
+		t.firstValue = t.numValues = 0;
+		t.cursor = -1;
+		t.keyA = t.keyB = -1;
+		t.weight = 0.0f;
+		t.dataA = t.dataB = 0;
+		tracks.push_back(t);
+	}
+
+	for (uint a=0;a<o->childs.size();a++)
+		CollectTracks(o->childs[a], tracks);
+}
+
+static bool IsBuiltFromHelper(MdlObject *o, vector<AnimEvaluator::Track>& tracks, uint& index)
+{
+	vector<AnimProperty*>& props = o->animInfo.properties;
+	for (uint a=0;a<props.size();a++, index++)
+		if (index >= tracks.size() || tracks[index].obj != o || tracks[index].prop != props[a])
+			return false;
+
+	for (uint a=0;a<o->childs.size();a++)
+		if (!IsBuiltFromHelper(o->childs[a], tracks, index))
+			return false;
+	return true;
+}
+
+bool AnimEvaluator::IsBuiltFrom(MdlObject *root)
+{
+	uint index = 0;
+	if (root && !IsBuiltFromHelper(root, tracks, index))
+		return false;
+	return index == tracks.size();
+}
+
+void AnimEvaluator::Build(MdlObject *root)
+{
+	tracks.clear();
+	laneTrack.clear();
+	laneOffset.clear();
+	laneDst.clear();
+	quatTracks.clear();
+	otherTracks.clear();
+
+	if (root)
+		CollectTracks(root, tracks);
+
+	AnimController *quatCtl = AnimController::GetQuaternionController();
+
+	// linear lanes first, then the euler angle lanes
+	numLinear = 0;
+	for (int pass=0;pass<2;pass++) {
+		AnimController *laneCtl = pass ? AnimController::GetEulerAngleController() : AnimController::GetFloatController();
+		if (pass == 1)
+			numLinear = (int)laneTrack.size();
+
+		for (uint a=0;a<tracks.size();a++) {
+			Track& t = tracks[a];
+			AnimController *ctl = t.prop->controller;
+			char *value = (char*)t.obj + t.prop->offset;
+
+			if (ctl == quatCtl) {
+				if (pass == 0) {
+					t.type = TRACK_Quat;
+					quatTracks.push_back(a);
+				}
+				continue;
+			}
+
+			// a single float, or a struct with only floats
+			vector<float*> members;
+			if (ctl == laneCtl)
+				members.push_back((float*)value);
+			else {
+				for (int m=0;m<ctl->GetNumMembers();m++) {
+					pair<AnimController*, void*> mc = ctl->GetMemberCtl(m, value);
+					if (mc.first != laneCtl) {
+						members.clear();
+						break;
+					}
+					members.push_back((float*)mc.second);
+				}
+			}
+			if (members.empty())
+				continue;
+
+			t.type = TRACK_Lanes;
+			t.firstLane = (int)laneTrack.size();
+			t.numLanes = (int)members.size();
+			for (uint m=0;m<members.size();m++) {
+				laneTrack.push_back(a);
+				laneOffset.push_back((int)((char*)members[m] - value));
+				laneDst.push_back(members[m]);
+			}
+		}
+	}
+
+	numValues = 0;
+	for (uint a=0;a<tracks.size();a++) {
+		Track& t = tracks[a];
+		if (t.type == TRACK_Other)
+			otherTracks.push_back(a);
+		t.firstValue = numValues;
+		t.numValues = t.type == TRACK_Lanes ? t.numLanes : (t.type == TRACK_Quat ? 4 : 0);
+		numValues += t.numValues;
+	}
+
+	uint numLanes = laneTrack.size();
+	laneA.resize(numLanes);
+	laneB.resize(numLanes);
+	laneW.resize(numLanes);
+	laneResult.resize(numLanes);
+	quatResult.resize(quatTracks.size() * 4);
+}
+
+static inline float WrapAngle(float a)
+{
+	if (a > 2 * M_PI) a -= 2 * M_PI;
+	if (a < 0.0f) a += 2 * M_PI;
+	return a;
+}
+
+// Selects the keys like AnimProperty::Evaluate: before the first and after the last key, the value of that key is used.
+// The key values of the lanes are gathered into laneA, laneB and laneW.
+void AnimEvaluator::FindKeys(float time)
+{
+	for (uint a=0;a<tracks.size();a++) {
+		Track& t = tracks[a];
+		AnimProperty *p = t.prop;
+		uint size = p->keyData.size();
+		if (!size) {
+			t.keyA = t.keyB = -1;
+			t.dataA = t.dataB = 0;
+		} else {
+			// key k spans the bytes [k*elemSize, (k+1)*elemSize) of keyData
+			char *keys = &p->keyData[0];
+			uint es = p->elemSize;
+			int k = t.cursor;
+			// still between the same keys? Otherwise let GetKeyIndex search
+			if (k < 0 || (k+1)*es > size || *(float*)&keys[k*es] > time || ((k+2)*es <= size && *(float*)&keys[(k+1)*es] <= time))
+				t.cursor = k = p->GetKeyIndex(time, &t.cursor);
+
+			t.weight = 0.0f;
+			if (k < 0)
+				t.keyA = t.keyB = 0;
+			else if ((k+2)*es <= size) {
+				t.keyA = k;
+				t.keyB = k+1;
+				float timeA = *(float*)&keys[k*es];
+				float timeB = *(float*)&keys[(k+1)*es];
+				t.weight = (time - timeA) / (timeB - timeA);
+			} else
+				t.keyA = t.keyB = k;
+			t.dataA = keys + t.keyA * es + sizeof(float);
+			t.dataB = keys + t.keyB * es + sizeof(float);
+		}
+
+		if (t.type != TRACK_Lanes)
+			continue;
+
+		int end = t.firstLane + t.numLanes;
+		if (!t.dataA) {
+			// no keys, the lanes keep their current value
+			for (int l=t.firstLane;l<end;l++) {
+				laneA[l] = *laneDst[l];
+				laneB[l] = t.firstLane < numLinear ? laneA[l] : 0.0f;
+				laneW[l] = 0.0f;
+			}
+		} else if (t.firstLane < numLinear) {
+			for (int l=t.firstLane;l<end;l++) {
+				laneA[l] = *(float*)(t.dataA + laneOffset[l]);
+				laneB[l] = *(float*)(t.dataB + laneOffset[l]);
+				laneW[l] = t.weight;
+			}
+		} else if (t.keyA == t.keyB) {
+			for (int l=t.firstLane;l<end;l++) {
+				laneA[l] = *(float*)(t.dataA + laneOffset[l]);
+				laneB[l] = laneW[l] = 0.0f;
+			}
+		} else {
+			// euler angle lanes store the start angle and the shortest difference, like the EulerAngleController
+			for (int l=t.firstLane;l<end;l++) {
+				float a = WrapAngle(*(float*)(t.dataA + laneOffset[l]));
+				float v = WrapAngle(*(float*)(t.dataB + laneOffset[l])) - a;
+				if (fabsf(v) > M_PI)
+					v += v > 0 ? -2*M_PI : 2*M_PI;
+				laneA[l] = a;
+				laneB[l] = v;
+				laneW[l] = t.weight;
+			}
+		}
+	}
+}
+
+void AnimEvaluator::Interpolate()
+{
+	int numLanes = (int)laneTrack.size();
+	const float *A = numLanes ? &laneA[0] : 0, *B = numLanes ? &laneB[0] : 0, *W = numLanes ? &laneW[0] : 0;
+	float *R = numLanes ? &laneResult[0] : 0;
+
+	for (int l=0;l<numLinear;l++)
+		R[l] = A[l] * (1.0f - W[l]) + B[l] * W[l];
+	for (int l=numLinear;l<numLanes;l++)
+		R[l] = A[l] + B[l] * W[l];
+
+	for (uint q=0;q<quatTracks.size();q++) {
+		Track& t = tracks[quatTracks[q]];
+		Quaternion *r = (Quaternion*)&quatResult[q*4];
+		if (!t.dataA)
+			*r = *(Quaternion*)((char*)t.obj + t.prop->offset);
+		else if (t.keyA == t.keyB)
+			*r = *(Quaternion*)t.dataA;
+		else
+			((Quaternion*)t.dataA)->slerp((Quaternion*)t.dataB, t.weight, r, Quaternion::qshort);
+	}
+}
+
+void AnimEvaluator::Evaluate(float time)
+{
+	FindKeys(time);
+	Interpolate();
+
+	// lanes without keys get their current value back
+	for (uint l=0;l<laneDst.size();l++)
+		*laneDst[l] = laneResult[l];
+
+	for (uint q=0;q<quatTracks.size();q++) {
+		Track& t = tracks[quatTracks[q]];
+		if (t.dataA)
+			*(Quaternion*)((char*)t.obj + t.prop->offset) = *(Quaternion*)&quatResult[q*4];
+	}
+
+	// anything else goes through its controller
+	for (uint a=0;a<otherTracks.size();a++) {
+		Track& t = tracks[otherTracks[a]];
+		t.prop->Evaluate(time, (char*)t.obj + t.prop->offset, &t.cursor);
+	}
+}
+
+void AnimEvaluator::Bake(float startTime, float frameTime, int numFrames, vector<float>& out)
+{
+	// the count comes from scripts as it is
+	if (numFrames <= 0) {
+		out.clear();
+		return;
+	}
+	out.resize(numFrames * numValues);
+
+	for (int f=0;f<numFrames;f++) {
+		FindKeys(startTime + f * frameTime);
+		Interpolate();
+
+		float *frame = numValues ? &out[f * numValues] : 0;
+		for (uint a=0;a<tracks.size();a++) {
+			Track& t = tracks[a];
+			if (t.type == TRACK_Lanes) {
+				for (int l=0;l<t.numLanes;l++)
+					frame[t.firstValue + l] = laneResult[t.firstLane + l];
+			}
+		}
+		for (uint q=0;q<quatTracks.size();q++) {
+			Track& t = tracks[quatTracks[q]];
+			for (int c=0;c<4;c++)
+				frame[t.firstValue + c] = quatResult[q*4 + c];
+		}
+	}
+}
@@ -0,0 +1,78 @@
+//-----------------------------------------------------------------------
+//  Upspring model editor
+//  Copyright 2005 Jelmer Cnossen
+//  This code is released under GPL license, see LICENSE.HTML for info.
+//-----------------------------------------------------------------------
+#ifndef UPS_ANIM_EVALUATOR_H
+#define UPS_ANIM_EVALUATOR_H
+
+struct MdlObject;
+class AnimProperty;
+
+/*
+Evaluates the animation of all objects in a model in one pass, instead of recursing through the
+objects and calling a controller for every property and struct member.
+
+Build sorts the animated values into lanes: one float per lane for float and euler angle properties,
+and for every member of struct properties such as the Vector3 position. Quaternion properties are
+tracks of their own, as they need a slerp. Evaluation finds the keys of each track, gathers the two key
+values and the weight of every lane into flat arrays, interpolates all lanes in one loop per type,
+and writes the results back to the objects.
+
+Keys are read from the AnimProperty objects directly, so editing keys needs no new Build.
+Adding or removing objects does, IsBuiltFrom checks for that.
+*/
+class AnimEvaluator
+{
+public:
+	void Build(MdlObject *root);
+	bool IsBuiltFrom(MdlObject *root);
+
+	// Sets the animated properties of all objects to their value at time
+	void Evaluate(float time);
+
+	// Evaluates numFrames frames starting at startTime, without changing the objects.
+	// Frame f is stored at out[f * NumValues()]: the values of all tracks in the order of the tracks vector,
+	// 1 for a float, 3 for a Vector3 and 4 for a quaternion (x,y,z,w). Other property types are left out.
+	// out is left empty when numFrames isn't positive.
+	void Bake(float startTime, float frameTime, int numFrames, vector<float>& out);
+	int NumValues() { return numValues; }
+
+	enum { TRACK_Lanes, TRACK_Quat, TRACK_Other };
+
+	struct Track {
+		MdlObject *obj;
+		AnimProperty *prop;
+		int type;
+		int firstLane, numLanes; // TRACK_Lanes
+		int firstValue, numValues; // position in a baked frame
+		int cursor; // key hint for AnimProperty::GetKeyIndex
+
+		// keys and weight for the current time
+		int keyA, keyB;
+		float weight;
+		char *dataA, *dataB; // key data, 0 if the property has no keys
+	};
+	vector<Track> tracks;
+
+protected:
+	void FindKeys(float time);
+	void Interpolate();
+
+	// lanes, the linear ones come first and then those that wrap around like euler angles
+	int numLinear;
+	vector<int> laneTrack;
+	vector<int> laneOffset; // byte offset of the float in the property value
+	vector<float*> laneDst;
+	vector<float> laneA, laneB, laneW, laneResult;
+
+	vector<int> quatTracks;
+	vector<float> quatResult;
+
+	// tracks evaluated by their controller
+	vector<int> otherTracks;
+
+	int numValues;
+};
+
+#endif
@@ -149,10 +149,11 @@ struct StructAnimController : public AnimController
 
 AnimController *AnimController::GetStructController (AnimController *subctl, creg::Class *class_)
 {
-	static vector <StructAnimController> ctls;
-	for (unsigned int a=0;a<ctls.size();a++) {
-		if (ctls[a].class_ == class_ && ctls[a].subctl == subctl)
-			return &ctls[a];
+	// a list, so the controllers don't move when one is added
+	static list <StructAnimController> ctls;
+	for (list<StructAnimController>::iterator i=ctls.begin();i!=ctls.end();++i) {
+		if (i->class_ == class_ && i->subctl == subctl)
+			return &*i;
 	}
 	ctls.push_back (StructAnimController (subctl,class_));
 	return &ctls.back();
@@ -173,12 +174,14 @@ AnimProperty::AnimProperty(AnimController *ctl, const std::string& name, int off
 	: name (name), controller(ctl), offset (offset)
 {
 	elemSize = sizeof (float) + controller->GetSize();
+	cursor = -1;
 }
 
 AnimProperty::AnimProperty ()
 {
 	controller = 0;
 	elemSize = 0;
+	cursor = -1;
 }
 
 AnimProperty::~AnimProperty ()
@@ -187,13 +190,28 @@ AnimProperty::~AnimProperty ()
 int AnimProperty::GetKeyIndex (float time, int *lastkey)
 {
 	int nk=NumKeys ();
-	int a=0;
-	if (lastkey && *lastkey>=0) a=*lastkey;
-	for (;a<nk;a++) {
-		if (GetKeyTime(a) > time) 
-			return a-1;
+
+	// playback moves forward by at most a key per frame, so try the hint and the key after it
+	if (lastkey && *lastkey >= -1 && *lastkey < nk) {
+		int a = *lastkey;
+		if (a < 0 || GetKeyTime(a) <= time) {
+			if (a+1 >= nk || GetKeyTime(a+1) > time)
+				return a;
+			if (a+2 >= nk || GetKeyTime(a+2) > time)
+				return a+1;
+		}
 	}
-	return NumKeys()-1;
+
+	// binary search for the first key after time
+	int lo=0, hi=nk;
+	while (lo < hi) {
+		int mid = (lo+hi)/2;
+		if (GetKeyTime(mid) > time)
+			hi = mid;
+		else
+			lo = mid+1;
+	}
+	return lo-1;
 }
 
 void AnimProperty::Evaluate (float time, void *value, int* lastkey)
@@ -201,6 +219,9 @@ void AnimProperty::Evaluate (float time, void *value, int* lastkey)
 	if (keyData.empty ())
 		return;
 
+	if (!lastkey)
+		lastkey = &cursor;
+
 	int index = GetKeyIndex (time, lastkey);
 	if(lastkey) *lastkey=index;
 
@@ -223,7 +244,7 @@ void AnimProperty::InsertKey (void *data, float time)
 	int index = GetKeyIndex (time);
 
 	// create a new key or modify an existing one?
-	if (keyData.empty() || !(GetKeyTime(index) > time - EPSILON && GetKeyTime(index) < time + EPSILON))
+	if (index < 0 || !(GetKeyTime(index) > time - EPSILON && GetKeyTime(index) < time + EPSILON))
 	{
 		assert (!keyData.empty() || index==-1);
 		keyData.insert(keyData.begin() + elemSize * (index+1), elemSize, 0);
@@ -235,6 +256,47 @@ void AnimProperty::InsertKey (void *data, float time)
 		controller->Copy (data, GetKeyData (index));
 }
 
+struct KeyTimeLess
+{
+	KeyTimeLess(const float *times) : times(times) {}
+	bool operator()(int a, int b) const { return times[a] < times[b]; }
+	const float *times;
+};
+
+void AnimProperty::InsertKeys (const float *times, const void *data, int count)
+{
+	int size = controller->GetSize();
+
+	vector<int> order(count);
+	for (int a=0;a<count;a++)
+		order[a] = a;
+	stable_sort (order.begin(), order.end(), KeyTimeLess(times));
+
+	vector<char> merged;
+	merged.reserve (keyData.size() + elemSize * count);
+
+	int nk = NumKeys(), k = 0;
+	for (int a=0;a<count;a++) {
+		float time = times[order[a]];
+		char *src = (char*)data + size * order[a];
+
+		// existing keys up to the new one
+		for (;k < nk && GetKeyTime(k) <= time; k++)
+			merged.insert (merged.end(), keyData.begin() + elemSize * k, keyData.begin() + elemSize * (k+1));
+
+		// like InsertKey, the last key at or before time is modified if it's at the same time
+		if (!merged.empty() && *(float*)&merged[merged.size() - elemSize] > time - EPSILON)
+			controller->Copy (src, &merged[merged.size() - elemSize + sizeof(float)]);
+		else {
+			merged.resize (merged.size() + elemSize);
+			*(float*)&merged[merged.size() - elemSize] = time;
+			controller->Copy (src, &merged[merged.size() - elemSize + sizeof(float)]);
+		}
+	}
+	merged.insert (merged.end(), keyData.begin() + elemSize * k, keyData.end());
+	keyData.swap (merged);
+}
+
 void AnimProperty::ChopAnimation (float endTime)
 {
 	for (int k = 0; k < NumKeys (); k++) 
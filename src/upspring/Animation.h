@@ -41,9 +41,15 @@ public:
 	AnimProperty(AnimController *ctl, const std::string& name, int offset);
 	~AnimProperty();
 
+	// Returns the last key at or before time, or -1. lastkey is a hint from a previous call,
+	// when time moved at most one key further the lookup doesn't need a search.
 	int GetKeyIndex (float time, int *lastkey=0);
+	// Without lastkey, the key found by the previous Evaluate is used as hint
 	void Evaluate (float time, void *value, int *lastkey=0);
 	void InsertKey (void *data, float time);
+	// Same as InsertKey for each of the keys in order of time, but the key data is rebuilt only once.
+	// data holds 'count' values of controller->GetSize() bytes.
+	void InsertKeys (const float *times, const void *data, int count);
 	void ChopAnimation (float endTime);// chop off all animation past endTime
 
 	float* GetKeyData (int index) { return (float*)&keyData[elemSize * index + sizeof(float)]; }
@@ -60,6 +66,7 @@ public:
 	std::string name;
 	int offset, elemSize;
 	std::vector <char> keyData;
+	int cursor; // key index of the last Evaluate
 };
 
 // Contains animation data(keyframes) for a particular object
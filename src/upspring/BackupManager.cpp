@@ -17,15 +17,16 @@ BackupManager::BackupManager(IEditor *_editor)
 	backupManager=this;
 	position = backups.end();
 	numBackups = 40;
+	mergeOpen = false;
 }
 
 BackupManager::~BackupManager()
 {}
 
 BackupManager::Backup::Backup()
-{ model = 0; }
+{ delta = 0; }
 BackupManager::Backup::~Backup()
-{ delete model; }
+{ delete delta; }
 
 BackupManager::Backup* BackupManager::LastBackup()
 {
@@ -37,31 +38,52 @@ BackupManager::Backup* BackupManager::LastBackup()
 
 void BackupManager::AddBackup(const char *name, OperationType ot, ulong cmpDat)
 {
-	Model *srcmdl = editor->GetMdl();
-	Model *copy = srcmdl->Clone();
+	CloseMerge();
+
+	// only the changes are stored, the tracker keeps the full state
+	ModelDelta *delta = tracker.Diff(editor->GetMdl());
 
 	backups.push_back(Backup());
-	backups.back().model = copy;
+	backups.back().delta = delta;
 	backups.back().optype = ot;
 	backups.back().compareData = cmpDat;
 	backups.back().actionName = name;
 	position = backups.end();
 	position--;
 
+	// merged operations keep the tracker before this backup, until the next backup closes it
+	if (ot == OT_Atomic) {
+		if (delta) tracker.Commit(delta, true);
+	} else
+		mergeOpen = true;
+
 	SetNumBackups(numBackups); // enforce backup limit
 }
 
+// moves the tracker to the state of the last merged backup
+void BackupManager::CloseMerge()
+{
+	if (mergeOpen && position != backups.end() && position->delta)
+		tracker.Commit(position->delta, true);
+	mergeOpen = false;
+}
+
 void BackupManager::AddMergeableOperation (const char *name, OperationType ot, BackupManager::ApplyOperationCB cb, void *userdata)
 {
 	Backup *lbk = LastBackup();
 
 	ulong hash = editor->GetMdl()->ObjectSelectionHash ();
-	if (ot != OT_Atomic && lbk && lbk->optype == ot && lbk->compareData == hash)
+	if (ot != OT_Atomic && lbk && lbk->delta && lbk->optype == ot && lbk->compareData == hash)
 	{
-		// mergeable, so apply the operation to the editors version and to the end of the backuplist
+		// mergeable, so apply the operation to the editors version and recalculate the changes of the last backup
 		RemoveRedoBackups();
-		cb (lbk->model, userdata);
+		if (!mergeOpen) {
+			tracker.Commit(lbk->delta, false);
+			mergeOpen = true;
+		}
 		cb (editor->GetMdl(), userdata);
+		delete lbk->delta;
+		lbk->delta = tracker.Diff(editor->GetMdl());
 	}
 	else
 	{
@@ -95,27 +117,45 @@ void BackupManager::RemoveRedoBackups()
 	}
 }
 
-void BackupManager::Undo()
+// Changes made since the last backup are dropped, then the model is moved one backup back or forward in place
+void BackupManager::Step(bool forward)
 {
-	if (HasUndo()) {
+	Model *mdl = editor->GetMdl();
+
+	CloseMerge();
+	tracker.Revert(mdl);
+
+	if (forward) {
+		position++;
+		if (position->delta) tracker.Apply(mdl, position->delta, true);
+	} else {
+		if (position->delta) tracker.Apply(mdl, position->delta, false);
 		position--;
-		Model *mdl = position->model->Clone();
+	}
+}
 
-		editor->SetModel (mdl);
+void BackupManager::Undo()
+{
+	if (HasUndo()) {
+		Step(false);
+		editor->SetModel (editor->GetMdl());
 	}
 }
 
 void BackupManager::ReloadLast()
 {
-	if (position != backups.end())
-		editor->SetModel (position->model->Clone());
+	if (position != backups.end()) {
+		CloseMerge();
+		tracker.Revert(editor->GetMdl());
+		editor->SetModel (editor->GetMdl());
+	}
 }
 
 void BackupManager::Redo()
 {
 	if (HasRedo()) {
-		position ++;
-		editor->SetModel (position->model->Clone());
+		Step(true);
+		editor->SetModel (editor->GetMdl());
 	}
 }
 
@@ -131,8 +171,16 @@ void BackupManager::Goto(int n)
 		if (index == n) break;
 
 	if (i != backups.end()) {
-		position = i;
-		editor->SetModel(position->model->Clone());
+		int cur = 0;
+		for (BackupList::iterator p = backups.begin(); p != position; p++)
+			cur++;
+
+		for (; cur < index; cur++)
+			Step(true);
+		for (; cur > index; cur--)
+			Step(false);
+
+		editor->SetModel(editor->GetMdl());
 	}
 }
 
@@ -154,6 +202,9 @@ void BackupManager::SetNumBackups(int n)
 	numBackups = n;
 
 	size_t cs = backups.size();
+	if (cs > (size_t)numBackups)
+		CloseMerge();
+
 	while (cs-- > (size_t)numBackups) {
 		if (position == backups.begin())
 			position ++;
@@ -161,4 +212,10 @@ void BackupManager::SetNumBackups(int n)
 	}
 	if (backups.empty())
 		position = backups.end();
+	else if (backups.front().delta) {
+		// nothing goes back past the first backup, so its changes are never applied
+		if (position == backups.begin())
+			CloseMerge();
+		SAFE_DELETE(backups.front().delta);
+	}
 }
@@ -2,6 +2,7 @@
 #define BACKUP_MANAGER_H
 
 #include <list>
+#include "ModelDelta.h"
 
 enum OperationType
 {
@@ -26,7 +27,7 @@ public:
 
 	typedef void (*ApplyOperationCB)(Model* mdl, void *param);
 
-	// Will apply the operation on both the mergeable backup and the active model in the editor
+	// Applies the operation to the active model in the editor, and merges it with the last backup if possible
 	void AddMergeableOperation(const char *name, OperationType op, ApplyOperationCB cb, void *userdata);
 	void AddBackupPoint(const char *name);
 
@@ -47,7 +48,7 @@ public:
 		Backup(); 
 		~Backup();
 
-		Model *model;
+		ModelDelta *delta; // changes since the previous backup, 0 for the first one
 		OperationType optype;
 		ulong compareData;
 		std::string actionName;
@@ -61,6 +62,8 @@ public:
 protected:
 	void AddBackup(const char *name, OperationType ot, ulong cmpDat);
 	void RemoveRedoBackups();
+	void CloseMerge();
+	void Step(bool forward);
 
 	int numBackups;
 	IEditor *editor;
@@ -69,6 +72,10 @@ protected:
 
 	BackupList::iterator position;
 	BackupList backups;
+
+	// the model state at 'position', or at the backup before it while operations are merged into it
+	ModelTracker tracker;
+	bool mergeOpen;
 };
 
 
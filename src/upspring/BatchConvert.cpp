@@ -0,0 +1,346 @@
+//-----------------------------------------------------------------------
+//  Upspring model editor
+//  Copyright 2005 Jelmer Cnossen
+//  This code is released under GPL license, see LICENSE.HTML for info.
+//-----------------------------------------------------------------------
+#include "EditorIncl.h"
+#include "EditorDef.h"
+
+#include "Util.h"
+#include "Model.h"
+#include "FileSearch.h"
+#include "ThreadPool.h"
+#include "Texture.h"
+#include "BatchConvert.h"
+
+struct ConvertEntry
+{
+	ConvertEntry() { ok=false; loadTicks=saveTicks=0; }
+
+	string src, dst;
+	bool ok;
+	unsigned int loadTicks, saveTicks;
+};
+
+struct ConvertModel
+{
+	ConvertModel(vector<ConvertEntry> *entries, bool optimize) : entries(entries), optimize(optimize) {}
+
+	void operator()(int index)
+	{
+		ConvertEntry& e = (*entries)[index];
+		Timer timer;
+
+		Model *mdl = 0;
+		try {
+			mdl = Model::Load(e.src, optimize);
+			e.loadTicks = timer.GetTicks();
+
+			if (mdl) {
+				timer.Reset();
+				e.ok = Model::Save(mdl, e.dst);
+				e.saveTicks = timer.GetTicks();
+			}
+		} catch (std::exception& ex) {
+			logger.Trace (NL_Error, "%s: %s\n", e.src.c_str(), ex.what());
+			e.ok = false;
+		}
+		delete mdl;
+
+		if (e.ok)
+			printf ("%s -> %s: load %u ms, save %u ms\n", e.src.c_str(), e.dst.c_str(), e.loadTicks, e.saveTicks);
+		else
+			printf ("%s: FAILED\n", e.src.c_str());
+		fflush (stdout);
+	}
+
+	vector<ConvertEntry> *entries;
+	bool optimize;
+};
+
+// splits "path/to/*.3do" in the directory and the file pattern, in the form FindFiles wants them
+static void SplitGlob (const string& glob, string& dir, string& pattern)
+{
+	string::size_type slash = glob.find_last_of ("/\\");
+
+	if (slash == string::npos) {
+		pattern = glob;
+#ifdef WIN32
+		dir.clear ();
+#else
+		dir = "./";
+#endif
+		return;
+	}
+
+	pattern = glob.substr (slash+1);
+#ifdef WIN32
+	dir = glob.substr (0, slash); // FindFiles adds the backslash itself
+#else
+	dir = glob.substr (0, slash+1);
+#endif
+}
+
+int BatchConvert (const char *inGlob, const char *outExt, bool optimize, int numThreads)
+{
+	string dir, pattern;
+	SplitGlob (inGlob, dir, pattern);
+
+	if (*outExt == '.')
+		outExt ++;
+
+	vector<ConvertEntry> entries;
+	std::list<std::string>* files = FindFiles (pattern, false, dir);
+	for (std::list<std::string>::iterator fi = files->begin(); fi != files->end(); ++fi) {
+		ConvertEntry e;
+		e.src = *fi;
+		e.dst = e.src.substr (0, fltk::filename_ext (e.src.c_str()) - e.src.c_str());
+		e.dst += '.';
+		e.dst += outExt;
+
+		// never overwrite the input, for example when converting *.s3o to s3o
+		if (!STRCASECMP(e.dst.c_str(), e.src.c_str()))
+			continue;
+
+		entries.push_back (e);
+	}
+	delete files;
+
+	if (entries.empty()) {
+		printf ("No files matching %s\n", inGlob);
+		return 0;
+	}
+
+	Timer total;
+	ThreadPool pool (numThreads);
+	pool.For ((int)entries.size(), ConvertModel (&entries, optimize));
+
+	int failed = 0;
+	for (uint a=0;a<entries.size();a++)
+		if (!entries[a].ok) failed ++;
+
+	printf ("%d models converted, %d failed, %u ms total on %d threads\n",
+		(int)entries.size() - failed, failed, total.GetTicks(), pool.NumThreads());
+	return failed;
+}
+
+// ------------------------------------------------------------------------------------------------
+// 3DO to S3O conversion
+// ------------------------------------------------------------------------------------------------
+
+struct S3OConvertEntry
+{
+	S3OConvertEntry() { mdl=0; ok=false; loadTicks=convertTicks=saveTicks=0; }
+
+	string src, dst, texture;
+	Model *mdl;
+	bool ok;
+	unsigned int loadTicks, convertTicks, saveTicks;
+};
+
+struct LoadModel
+{
+	LoadModel(vector<S3OConvertEntry> *entries, bool optimize) : entries(entries), optimize(optimize) {}
+
+	void operator()(int index)
+	{
+		S3OConvertEntry& e = (*entries)[index];
+		Timer timer;
+
+		try {
+			e.mdl = Model::Load(e.src, optimize);
+		} catch (std::exception& ex) {
+			logger.Trace (NL_Error, "%s: %s\n", e.src.c_str(), ex.what());
+		}
+		e.loadTicks = timer.GetTicks();
+	}
+
+	vector<S3OConvertEntry> *entries;
+	bool optimize;
+};
+
+// Counts the finished steps, each model is converted and then saved
+struct S3OProgress
+{
+	S3OProgress(IProgressCtl *ctl, int numSteps) : ctl(ctl), done(0), numSteps(numSteps) {}
+
+	void Step()
+	{
+		fltk::Guard guard (lock);
+		done ++;
+		if (ctl)
+			ctl->Update (done / (float)numSteps);
+	}
+
+	IProgressCtl *ctl;
+	fltk::Mutex lock;
+	int done, numSteps;
+};
+
+struct ConvertModelToS3O
+{
+	ConvertModelToS3O(vector<S3OConvertEntry> *entries, int texSize, S3OProgress *progress) 
+		: entries(entries), texSize(texSize), progress(progress) {}
+
+	void operator()(int index)
+	{
+		S3OConvertEntry& e = (*entries)[index];
+
+		if (e.mdl) {
+			Timer timer;
+			try {
+				e.ok = e.mdl->ConvertToS3O(e.texture, texSize, texSize);
+				// Spring looks for the texture by name in unittextures
+				if (e.ok)
+					e.mdl->texBindings[0].name = fltk::filename_name (e.texture.c_str());
+			} catch (std::exception& ex) {
+				logger.Trace (NL_Error, "%s: %s\n", e.src.c_str(), ex.what());
+				e.ok = false;
+			}
+			e.convertTicks = timer.GetTicks();
+		}
+		progress->Step();
+	}
+
+	vector<S3OConvertEntry> *entries;
+	int texSize;
+	S3OProgress *progress;
+};
+
+struct SaveS3OModel
+{
+	SaveS3OModel(vector<S3OConvertEntry> *entries, S3OProgress *progress) : entries(entries), progress(progress) {}
+
+	void operator()(int index)
+	{
+		S3OConvertEntry& e = (*entries)[index];
+
+		if (e.ok) {
+			Timer timer;
+			try {
+				e.ok = Model::Save(e.mdl, e.dst);
+			} catch (std::exception& ex) {
+				logger.Trace (NL_Error, "%s: %s\n", e.dst.c_str(), ex.what());
+				e.ok = false;
+			}
+			e.saveTicks = timer.GetTicks();
+		}
+
+		if (e.ok)
+			printf ("%s -> %s: load %u ms, convert %u ms, save %u ms\n", e.src.c_str(), e.dst.c_str(), e.loadTicks, e.convertTicks, e.saveTicks);
+		else
+			printf ("%s: FAILED\n", e.src.c_str());
+		fflush (stdout);
+		progress->Step();
+	}
+
+	vector<S3OConvertEntry> *entries;
+	S3OProgress *progress;
+};
+
+static void CollectTextureNames (Model *mdl, vector<string>& names)
+{
+	vector<PolyMesh*> pmlist = mdl->GetSharedPolyMeshList();
+	for (uint a=0;a<pmlist.size();a++)
+		for (uint b=0;b<pmlist[a]->poly.size();b++)
+			if (!pmlist[a]->poly[b]->texname.empty())
+				names.push_back (pmlist[a]->poly[b]->texname);
+}
+
+static void ApplyTextures (Model *mdl, TextureHandler *th)
+{
+	vector<PolyMesh*> pmlist = mdl->GetSharedPolyMeshList();
+	for (uint a=0;a<pmlist.size();a++)
+		for (uint b=0;b<pmlist[a]->poly.size();b++) {
+			Poly *pl = pmlist[a]->poly[b];
+			if (pl->texname.empty())
+				continue;
+			// polygons without a texture get a color in the atlas
+			pl->texture = th->GetTexture (pl->texname.c_str());
+			if (!pl->texture)
+				pl->texname.clear();
+		}
+}
+
+// The polygons don't need the 3DO textures after ConvertToS3O
+static void ReleaseTextures (Model *mdl)
+{
+	vector<PolyMesh*> pmlist = mdl->GetSharedPolyMeshList();
+	for (uint a=0;a<pmlist.size();a++)
+		for (uint b=0;b<pmlist[a]->poly.size();b++)
+			pmlist[a]->poly[b]->texture = 0;
+}
+
+int BatchConvertToS3O (const char *inGlob, const vector<string>& textureArchives, int texSize, bool optimize, int numThreads, IProgressCtl *progctl)
+{
+	string dir, pattern;
+	SplitGlob (inGlob, dir, pattern);
+
+	vector<S3OConvertEntry> entries;
+	std::list<std::string>* files = FindFiles (pattern, false, dir);
+	for (std::list<std::string>::iterator fi = files->begin(); fi != files->end(); ++fi) {
+		if (STRCASECMP(fltk::filename_ext (fi->c_str()), ".3do"))
+			continue;
+
+		S3OConvertEntry e;
+		e.src = *fi;
+		string base = e.src.substr (0, fltk::filename_ext (e.src.c_str()) - e.src.c_str());
+		e.dst = base + ".s3o";
+		e.texture = base + "_tex.bmp";
+		entries.push_back (e);
+	}
+	delete files;
+
+	if (entries.empty()) {
+		printf ("No 3DO files matching %s\n", inGlob);
+		return 0;
+	}
+
+	Timer total, phase;
+	// all textures stay decoded until every model has been converted
+	TextureHandler textureHandler;
+	textureHandler.SetMemoryLimit (0xffffffff);
+	for (uint a=0;a<textureArchives.size();a++)
+		textureHandler.Load (textureArchives[a].c_str());
+
+	ThreadPool pool (numThreads);
+	pool.For ((int)entries.size(), LoadModel (&entries, optimize));
+	unsigned int loadTicks = phase.GetTicks();
+
+	// every texture is decoded once for all models, the images are only read after this
+	phase.Reset();
+	vector<string> names;
+	for (uint a=0;a<entries.size();a++)
+		if (entries[a].mdl)
+			CollectTextureNames (entries[a].mdl, names);
+	sort (names.begin(), names.end());
+	names.erase (unique (names.begin(), names.end()), names.end());
+	textureHandler.DecodeTextures (names, false);
+
+	for (uint a=0;a<entries.size();a++)
+		if (entries[a].mdl)
+			ApplyTextures (entries[a].mdl, &textureHandler);
+	unsigned int textureTicks = phase.GetTicks();
+
+	// The models share the textures, and their reference counts can't be changed by several threads at once.
+	// So the workers only read them, and they are released here.
+	phase.Reset();
+	S3OProgress progress (progctl, (int)entries.size() * 2);
+	pool.For ((int)entries.size(), ConvertModelToS3O (&entries, texSize, &progress));
+	for (uint a=0;a<entries.size();a++)
+		if (entries[a].mdl)
+			ReleaseTextures (entries[a].mdl);
+	pool.For ((int)entries.size(), SaveS3OModel (&entries, &progress));
+	unsigned int convertTicks = phase.GetTicks();
+
+	int failed = 0;
+	for (uint a=0;a<entries.size();a++) {
+		delete entries[a].mdl;
+		if (!entries[a].ok) failed ++;
+	}
+
+	printf ("%d models converted to S3O, %d failed, %d different texture names\n", (int)entries.size() - failed, failed, (int)names.size());
+	printf ("load %u ms, textures %u ms, convert and save %u ms, %u ms total on %d threads\n",
+		loadTicks, textureTicks, convertTicks, total.GetTicks(), pool.NumThreads());
+	return failed;
+}
@@ -0,0 +1,31 @@
+//-----------------------------------------------------------------------
+//  Upspring model editor
+//  Copyright 2005 Jelmer Cnossen
+//  This code is released under GPL license, see LICENSE.HTML for info.
+//-----------------------------------------------------------------------
+#ifndef UPS_BATCH_CONVERT_H
+#define UPS_BATCH_CONVERT_H
+
+/*
+Headless model conversion, used by the -convert command line option.
+inGlob is a directory with a file pattern, like "*.3do" in the units directory. Every matching file
+is loaded with Model::Load and saved next to the original with the outExt extension,
+one model per worker thread.
+Results and timings are printed to stdout. Returns the number of files that failed.
+*/
+int BatchConvert (const char *inGlob, const char *outExt, bool optimize=true, int numThreads=0);
+
+struct IProgressCtl;
+
+/*
+Headless 3DO to S3O conversion, used by the -tos3o command line option.
+All 3DO files matching inGlob are loaded on a thread pool, then every texture they use is decoded once
+from the texture archives (the ones TextureHandler loads), and shared by all models. Each model is then
+converted with Model::ConvertToS3O and saved as name.s3o, with its texture atlas in name_tex.bmp.
+The atlas is at least texSize x texSize. progctl->Update is called from the worker threads.
+Returns the number of files that failed.
+*/
+int BatchConvertToS3O (const char *inGlob, const vector<string>& textureArchives, int texSize=256, bool optimize=true, 
+	int numThreads=0, IProgressCtl *progctl=0);
+
+#endif
@@ -39,7 +39,7 @@ void d_puts (const char *buf)
 #ifdef WIN32
 	OutputDebugString(buf);
 #else
-	fprintf(stderr, buf);
+	fputs(buf, stderr);
 #endif
 
 	if(g_logfile[0])
@@ -52,7 +52,7 @@ void d_puts (const char *buf)
 	}
 
 #ifdef WIN32
-	printf (buf);
+	fputs (buf, stdout);
 #endif
 }
 
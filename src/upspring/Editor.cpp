@@ -26,6 +26,7 @@
 #include "CurvedSurface.h"
 #include "ObjectView.h"
 #include "Texture.h"
+#include "TextureCache.h"
 #include "CfgParser.h"
 #include "BackupManager.h"
 
@@ -35,6 +36,7 @@
 #include "AnimationUI.h"
 #include "FileSearch.h"
 #include "MeshIterators.h"
+#include "BatchConvert.h"
 
 extern "C"{
 #include "lualib.h"
@@ -46,6 +48,7 @@ extern "C"{
 const char* ViewSettingsFile="data/views.cfg";
 const char* ArchiveListFile="data/archives.cfg";
 const char* TextureGroupConfig="data/texgroups.cfg";
+const char* TextureCacheDir="texcache/";
 
 string applicationPath;
 
@@ -195,6 +198,7 @@ void EditorUI::Initialize ()
 	SetModel (new Model);
 	UpdateTitle();
 
+	TextureCache::SetDirectory (applicationPath + TextureCacheDir);
 	textureHandler = new TextureHandler ();
 
 	for (set<string>::iterator arch=archives.archives.begin();arch!=archives.archives.end();++arch)
@@ -290,11 +294,11 @@ void EditorUI::uiSetRenderMethod(RenderMethod rm)
 	viewsGroup->redraw();
 }
 
-static void CollectTextures(MdlObject *o, set<Texture*>& textures) {
+static void CollectTextures(MdlObject *o, set<RefPtr<Texture> >& textures) {
 	PolyMesh* pm = o->GetPolyMesh();
 	if (pm) {
 		for (unsigned int a=0;a<pm->poly.size();a++) {
-			if (pm->poly[a]->texture) textures.insert(pm->poly[a]->texture.Get());
+			if (pm->poly[a]->texture) textures.insert(pm->poly[a]->texture);
 		}
 	}
 	for (unsigned int a=0;a<o->childs.size();a++)
@@ -381,6 +385,7 @@ void EditorUI::uiDeleteSelection()
 					else delete pl;
 				}
 				pm->poly = polygons;
+				pm->InvalidateRenderData();
 			}
 		}
 		BACKUP_POINT("Deleted selected polygons");
@@ -667,7 +672,9 @@ void EditorUI::SetMapping (int mapping)
 
 void EditorUI::SetModel (Model *mdl)
 {
-	SAFE_DELETE(model);
+	// the undo system changes the model in place and passes the same one
+	if (mdl != model)
+		SAFE_DELETE(model);
 	model = mdl;
 
 	objectViewer->Update();
@@ -757,7 +764,7 @@ void EditorUI::ConvertToS3O()
 		SetModelTexture (0, model->texBindings[0].texture.Get());
 		SetMapping (MAPPING_S3O);
 		BACKUP_POINT("Converted to S3O texturing");
-	} else
+	} else // Model::ConvertToS3O logs the reason as an error, which the log callback shows
 		BackupManager::Get().ReloadLast ();
 	Update();
 }
@@ -809,8 +816,8 @@ void EditorUI::InitTexBrowser()
 
 	TextureGroup *tg = GetCurrentTexGroup();
 	if(!tg) return;
-	for (set<Texture*>::iterator t=tg->textures.begin();t!=tg->textures.end();++t)
-		texBrowser->AddTexture(*t);
+	for (set<RefPtr<Texture> >::iterator t=tg->textures.begin();t!=tg->textures.end();++t)
+		texBrowser->AddTexture(t->Get());
 	texBrowser->UpdatePositions();
 	texBrowser->redraw();
 }
@@ -916,12 +923,7 @@ void EditorUI::menuObjectFlipPolygons()
 void EditorUI::menuObjectRecalcNormals()
 {
 	vector <MdlObject*> sel=model->GetSelectedObjects();
-	for (unsigned int a=0;a<sel.size();a++) {
-		PolyMesh *pm = sel[a]->GetPolyMesh();
-		if (pm) pm->CalculateNormals();
-
-		sel[a]->InvalidateRenderData ();
-	}
+	CalculateObjectNormals (sel, -1.0f);
 	BACKUP_POINT("Normal recalculation");
 	Update();
 }
@@ -1326,6 +1328,15 @@ void PrintCmdLine ()
 	printf (
 		"Upspring command line:\n"
 		"-run luafile\t\tRuns given lua script and exits.\n"
+		"-convert \"in-glob\" ext\tConverts all matching models to the given format without GUI, like:\n"
+		"\t\t\t-convert \"units/*.3do\" s3o\n"
+		"-tos3o \"in-glob\"\tConverts all matching 3DO models to S3O models with packed textures, like:\n"
+		"\t\t\t-tos3o \"units/*.3do\"\n"
+		"-archive file\t\tTexture archive used by -tos3o, can be repeated (default: the archives in archives.cfg)\n"
+		"-texsize n\t\tSmallest texture size made by -tos3o (default: 256)\n"
+		"-threads n\t\tNumber of worker threads used by -convert and -tos3o (default: one per processor)\n"
+		"-nooptimize\t\tDon't optimize the vertices of models loaded by -convert and -tos3o\n"
+		"-selftest\t\tRuns the pixel conversion, vertex welding and texture atlas checks and exits, with 1 if one fails\n"
 		);
 }
 
@@ -1348,8 +1359,18 @@ string ReadTextFile (const char *name)
 	return r;
 }
 
+extern void math_test();
+extern bool image_convert_test();
+extern bool unique_vectors_test();
+extern bool texture_atlas_test();
+
 bool ParseCmdLine(int argc, char *argv[], int& r)
 {
+	const char *convertGlob = 0, *convertExt = 0, *s3oGlob = 0;
+	vector<string> textureArchives;
+	int numThreads = 0, texSize = 256;
+	bool optimize = true, selfTest = false;
+
 	for (int a=1;a<argc;a++) {
 		if (!STRCASECMP(argv[a], "-run")) {
 			if (a == argc-1)  {
@@ -1361,13 +1382,69 @@ bool ParseCmdLine(int argc, char *argv[], int& r)
 			//r = RunScript (binder, scriptFile);
 			return false;
 		}
+		else if (!STRCASECMP(argv[a], "-convert")) {
+			if (a >= argc-2) {
+				PrintCmdLine ();
+				r = -1;
+				return false;
+			}
+			convertGlob = argv[++a];
+			convertExt = argv[++a];
+		}
+		else if (!STRCASECMP(argv[a], "-tos3o") || !STRCASECMP(argv[a], "-archive") || !STRCASECMP(argv[a], "-texsize")) {
+			if (a == argc-1) {
+				PrintCmdLine ();
+				r = -1;
+				return false;
+			}
+			if (!STRCASECMP(argv[a], "-tos3o"))
+				s3oGlob = argv[++a];
+			else if (!STRCASECMP(argv[a], "-archive"))
+				textureArchives.push_back (argv[++a]);
+			else
+				texSize = atoi(argv[++a]);
+		}
+		else if (!STRCASECMP(argv[a], "-threads")) {
+			if (a == argc-1) {
+				PrintCmdLine ();
+				r = -1;
+				return false;
+			}
+			numThreads = atoi(argv[++a]);
+		}
+		else if (!STRCASECMP(argv[a], "-nooptimize"))
+			optimize = false;
+		else if (!STRCASECMP(argv[a], "-selftest"))
+			selfTest = true;
+	}
+
+	if (selfTest) {
+		bool ok = image_convert_test ();
+		ok = unique_vectors_test () && ok;
+		ok = texture_atlas_test () && ok;
+		r = ok ? 0 : 1;
+		return false;
+	}
+
+	if (convertGlob) {
+		// No GUI, GL or ILUT is initialized here, errors go to the console
+		r = BatchConvert (convertGlob, convertExt, optimize, numThreads) ? 1 : 0;
+		return false;
+	}
+
+	if (s3oGlob) {
+		if (textureArchives.empty()) {
+			ArchiveList archives;
+			archives.Load ();
+			textureArchives.assign (archives.archives.begin(), archives.archives.end());
+		}
+		r = BatchConvertToS3O (s3oGlob, textureArchives, texSize, optimize, numThreads) ? 1 : 0;
+		return false;
 	}
 
 	return true;
 }
 
-extern void math_test();
-
 extern "C" int luaopen_upspring(lua_State *L);
 
 int main (int argc, char *argv[])
@@ -1384,14 +1461,11 @@ int main (int argc, char *argv[])
 	}
 #endif
 
-	// Setup logger callback, so error messages are reported with fltk::message
-	logger.AddCallback (LogCallbackProc, 0);
 #ifdef _DEBUG
 	logger.SetDebugMode (true);
 #endif
 
 //	math_test();
-	fltk::message( "path: %s", applicationPath.c_str() );
 
 	// Initialize the class system
 	creg::System::InitializeClasses ();
@@ -1399,6 +1473,10 @@ int main (int argc, char *argv[])
 	int r = 0;
 	if (ParseCmdLine(argc, argv, r))
 	{
+		// Setup logger callback, so error messages are reported with fltk::message
+		logger.AddCallback (LogCallbackProc, 0);
+		fltk::message( "path: %s", applicationPath.c_str() );
+
 		// Bring up the main editor dialog
 		EditorUI editor;
 		editorUI = &editor;
@@ -113,6 +113,7 @@ class TimelineUI;
 class ScriptedMenuItem;
 class AnimTrackEditorUI;
 class Timer;
+class AnimEvaluator;
 class BackupViewerUI;
 
 #include "IEditor.h"
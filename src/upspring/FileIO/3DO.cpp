@@ -8,15 +8,35 @@
 #include "Util.h"
 #include "Model.h"
 
+#include <fltk/Threads.h>
 
+
+/*
+FindIndex returns the palette entry with the smallest sum of absolute differences,
+the lowest index if several are equally close. Instead of comparing every entry for every color,
+the color space is split in 32x32x32 cells, and each cell lists the entries that can be the nearest
+to a color in it: those that are not further away from the whole cell than some entry
+is from its furthest corner. Only these are compared, in the same order, so the result is the same.
+*/
 class CTAPalette  
 {
 public:
+	enum { CellBits = 3, CellsPerAxis = 256 >> CellBits };
+
 	CTAPalette() {
 		loaded=false;
 		error=false;
 	}
 
+	// GetColor and FindIndex can be called by the model loaders on several threads
+	void Load(bool needCells) {
+		fltk::Guard guard(lock);
+		if (!loaded)
+			Init();
+		if (needCells && cellStart.empty())
+			BuildCells();
+	}
+
 	void Init() {
 		string fn=applicationPath + "data/palette.pal";
 		FILE *f = fopen (fn.c_str(), "rb");
@@ -31,14 +51,61 @@ public:
 			}
 			fclose (f);
 		}
+		loaded=true;
+	}
+
+	void BuildCells() {
+		cellStart.resize(CellsPerAxis*CellsPerAxis*CellsPerAxis+1);
+		cellEntries.clear();
+
+		int lo[3], hi[3];
+		for (int cell=0;cell<CellsPerAxis*CellsPerAxis*CellsPerAxis;cell++) {
+			cellStart[cell] = cellEntries.size();
+			for (int c=0;c<3;c++) {
+				lo[c] = ((cell >> ((2-c) * (8-CellBits))) & (CellsPerAxis-1)) << CellBits;
+				hi[c] = lo[c] + (1 << CellBits) - 1;
+			}
+
+			int minDist[256], bound=-1;
+			for (int a=0;a<256;a++) {
+				int mn=0, mx=0;
+				for (int c=0;c<3;c++) {
+					int v=p[a][c];
+					mn += v < lo[c] ? lo[c]-v : (v > hi[c] ? v-hi[c] : 0);
+					mx += max(abs(v-lo[c]), abs(v-hi[c]));
+				}
+				minDist[a] = mn;
+				if (bound<0 || mx<bound)
+					bound = mx;
+			}
+			for (int a=0;a<256;a++)
+				if (minDist[a] <= bound)
+					cellEntries.push_back(a);
+		}
+		cellStart.back() = cellEntries.size();
 	}
 
 	int FindIndex(Vector3 color)
 	{
-		if (!loaded) Init();
+		Load(true);
 		int r=color.x*255,g=color.y*255,b=color.z*255;
 		int best=-1, bestdif;
-		for (int a=0;a<256;a++) {
+
+		// colors outside 0-1 compare all entries
+		if (r<0 || g<0 || b<0 || r>255 || g>255 || b>255) {
+			for (int a=0;a<256;a++) {
+				int dif=abs(r-p[a][0])+abs(g-p[a][1])+abs(b-p[a][2]);
+				if (best<0 || bestdif>dif) {
+					bestdif = dif;
+					best = a;
+				}
+			}
+			return best;
+		}
+
+		int cell = (((r >> CellBits) * CellsPerAxis) + (g >> CellBits)) * CellsPerAxis + (b >> CellBits);
+		for (uint i=cellStart[cell];i<cellStart[cell+1];i++) {
+			int a=cellEntries[i];
 			int dif=abs(r-p[a][0])+abs(g-p[a][1])+abs(b-p[a][2]);
 			if (best<0 || bestdif>dif) {
 				bestdif = dif;
@@ -49,7 +116,7 @@ public:
 	}
 
 	Vector3 GetColor(int index) {
-		if (!loaded) Init();
+		Load(false);
 		if (index<0 || index>=256)
 			return Vector3();
 		return Vector3(p[index][0]/255, p[index][1]/255, p[index][2]/255);
@@ -60,6 +127,11 @@ public:
 	}
 	unsigned char p[256][4];
 	bool loaded,error;
+
+	// cell c has the entries cellEntries[cellStart[c]] up to cellEntries[cellStart[c+1]]
+	vector<uint> cellStart;
+	vector<uchar> cellEntries;
+	fltk::Mutex lock;
 };
 CTAPalette palette;
 
@@ -72,153 +144,202 @@ const float scaleFactor=1/(65536.0f);
 // 3DO support
 // ------------------------------------------------------------------------------------------------
 
+// The fields are 32 bit in the file
 typedef struct
 {
-	long VersionSignature;
-	long NumberOfVertexes;
-	long NumberOfPrimitives;
-	long NoSelectionRect;
-	long XFromParent;
-	long YFromParent;
-	long ZFromParent;
-	long OffsetToObjectName;        // 28
-	long Always_0;                  // 32
-	long OffsetToVertexArray;       // 36
-	long OffsetToPrimitiveArray;    // 40
-	long OffsetToSiblingObject;     // 44
-	long OffsetToChildObject;       // 48
+	int VersionSignature;
+	int NumberOfVertexes;
+	int NumberOfPrimitives;
+	int NoSelectionRect;
+	int XFromParent;
+	int YFromParent;
+	int ZFromParent;
+	int OffsetToObjectName;        // 28
+	int Always_0;                  // 32
+	int OffsetToVertexArray;       // 36
+	int OffsetToPrimitiveArray;    // 40
+	int OffsetToSiblingObject;     // 44
+	int OffsetToChildObject;       // 48
 } TA_Object;
 
 typedef struct
 {
-	long PaletteIndex;
-	long VertNum;
-	long Always_0;
-	long VertOfs;
-	long TexnameOfs;
-	long Unknown_1; 
-	long Unknown_2;
-	long Unknown_3; 
+	int PaletteIndex;
+	int VertNum;
+	int Always_0;
+	int VertOfs;
+	int TexnameOfs;
+	int Unknown_1; 
+	int Unknown_2;
+	int Unknown_3; 
 } TA_Polygon;
 
-
-static MdlObject* load_object(int ofs, FILE *f, MdlObject *parent, int r=0)
+/*
+Like the S3O loader, the file is read with a single fread and the objects are decoded from that buffer,
+with every offset and count checked against the file size. The objects are loaded in a loop with a
+list of the ones still to do, instead of recursing for every child and sibling.
+*/
+class TAReader
 {
-	MdlObject *n = new MdlObject;
-	TA_Object obj;
-	size_t read_result;
-	int org=ftell(f);
+public:
+	TAReader (const vector<char>& data) : data(data) {}
+
+	// returns a pointer to 'count' items of 'size' bytes at 'offset', or throws if they don't fit in the file
+	const char* Get (uint offset, uint count, uint size, const char *what)
+	{
+		if (!count)
+			return 0;
+		if (offset > data.size() || count > (data.size() - offset) / size)
+			throw std::runtime_error (SPrintf ("3DO file has an invalid %s offset (%u).", what, offset));
+		return &data[offset];
+	}
+
+	// Polygons often share their texture name, so the names are kept by offset
+	const string& ReadString (uint offset, const char *what)
+	{
+		map<uint, string>::iterator i = strings.find (offset);
+		if (i != strings.end())
+			return i->second;
+
+		const char *str = Get (offset, 1, 1, what);
+		const char *end = (const char*)memchr (str, 0, data.size() - offset);
+		if (!end)
+			throw std::runtime_error (SPrintf ("3DO file has an unterminated %s.", what));
+		return strings[offset] = string (str, end);
+	}
+
+	MdlObject* Load ();
+
+protected:
+	bool LoadObject (uint offset, MdlObject *obj, TA_Object& hdr);
+
+	const vector<char>& data;
+	map<uint, string> strings;
+	set<uint> objects; // offsets of the objects loaded so far, an object that shows up twice would make it loop forever
+};
 
-	fseek(f,ofs,SEEK_SET);
-	read_result = fread(&obj, sizeof(TA_Object),1,f);
-	if (read_result != (size_t)1) throw std::runtime_error ("Couldn't read 3DO header.");
+// Returns false if the object has the wrong version
+bool TAReader::LoadObject (uint offset, MdlObject *n, TA_Object& obj)
+{
+	if (!objects.insert (offset).second)
+		throw std::runtime_error (SPrintf ("3DO file uses the object at offset %u more than once.", offset));
 
+	memcpy (&obj, Get (offset, 1, sizeof(TA_Object), "object"), sizeof(TA_Object));
 	if(obj.VersionSignature != 1)
 	{
 		logger.Trace (NL_Error,"Wrong version. Only version 1 is supported");
-		return 0;
+		return false;
 	}
 
-	long ipos[3];
 	PolyMesh *pm = new PolyMesh;
 	n->geometry = pm;
-	pm->verts.resize (obj.NumberOfVertexes);
-	
-	fseek (f,obj.OffsetToVertexArray, SEEK_SET);
-	for(int a=0;a<obj.NumberOfVertexes;a++)
+
+	uint numVerts = obj.NumberOfVertexes;
+	const char *vertData = Get (obj.OffsetToVertexArray, numVerts, 12, "vertex array");
+	pm->verts.resize (numVerts);
+	for (uint a=0;a<numVerts;a++)
 	{
-		read_result = fread(ipos, sizeof(long),3,f);
-		if (read_result != (size_t)3) throw std::runtime_error ("Couldn't read vertexes.");
+		int ipos[3];
+		memcpy (ipos, vertData + a * 12, 12);
 		for (int b=0;b<3;b++)
 			pm->verts[a].pos.v[b] = FROM_TA(ipos[b]);
 	}
 
-	std::vector<TA_Polygon> tapl;
-	tapl.resize (obj.NumberOfPrimitives);
-
-	fseek (f, obj.OffsetToPrimitiveArray, SEEK_SET);
-	if (obj.NumberOfPrimitives > 0)
-		read_result = fread (&tapl[0], sizeof(TA_Polygon), obj.NumberOfPrimitives, f);
-		if (read_result != (size_t)(obj.NumberOfPrimitives)) throw std::runtime_error ("Couldn't read primitives.");
-	for (int a=0;a<obj.NumberOfPrimitives;a++)
+	uint numPrims = obj.NumberOfPrimitives;
+	const char *primData = Get (obj.OffsetToPrimitiveArray, numPrims, sizeof(TA_Polygon), "primitive array");
+	pm->poly.reserve (numPrims);
+	for (uint a=0;a<numPrims;a++)
 	{
-		fseek (f, tapl[a].VertOfs,SEEK_SET);
+		TA_Polygon tapl;
+		memcpy (&tapl, primData + a * sizeof(TA_Polygon), sizeof(TA_Polygon));
 
 		Poly *p = new Poly;
-		p->verts.resize (tapl[a].VertNum);
+		pm->poly.push_back (p);
 
-		for (int b=0;b<tapl[a].VertNum;b++)
+		uint vertNum = tapl.VertNum;
+		const char *indices = Get (tapl.VertOfs, vertNum, 2, "polygon vertex");
+		p->verts.resize (vertNum);
+		for (uint b=0;b<vertNum;b++)
 		{
-			short vindex;
-			read_result = fread (&vindex, sizeof(short), 1, f);
-			if (read_result != (size_t)1) throw std::runtime_error ("Couldn't read vertex.");
+			unsigned short vindex;
+			memcpy (&vindex, indices + b * 2, 2);
+			if (vindex >= numVerts)
+				throw std::runtime_error (SPrintf ("3DO file has an invalid vertex index (%d) in an object with %d vertices.", vindex, numVerts));
 			p->verts[b] = vindex;
 		}
 
-		p->taColor = tapl[a].PaletteIndex;
-		p->color = palette.GetColor(tapl[a].PaletteIndex);
-
-		fseek (f, tapl[a].TexnameOfs, SEEK_SET);
-		p->texname = ReadZStr(f);
-
-		pm->poly.push_back (p);
+		p->taColor = tapl.PaletteIndex;
+		p->color = palette.GetColor(tapl.PaletteIndex);
+		p->texname = ReadString (tapl.TexnameOfs, "texture name");
 	}
 
-	fseek (f, obj.OffsetToObjectName, SEEK_SET);
-	n->name = ReadZStr (f);
+	n->name = ReadString (obj.OffsetToObjectName, "object name");
 
 	n->position.v[0] = FROM_TA(obj.XFromParent);
 	n->position.v[1] = FROM_TA(obj.YFromParent);
 	n->position.v[2] = FROM_TA(obj.ZFromParent);
+	return true;
+}
 
-	if (obj.OffsetToSiblingObject)
-	{
-		if (!parent)
-		{
-			logger.Trace (NL_Error,"Error: Root object can not have sibling nodes.\n");
+MdlObject* TAReader::Load ()
+{
+	MdlObject *root = new MdlObject;
+	try {
+		TA_Object hdr;
+		if (!LoadObject (0, root, hdr)) {
+			delete root;
+			return 0;
 		}
-		else {
-			MdlObject *sibling = load_object (obj.OffsetToSiblingObject,f, parent);
+		if (hdr.OffsetToSiblingObject)
+			logger.Trace (NL_Error,"Error: Root object can not have sibling nodes.\n");
 
-			if (sibling) {
-				parent->childs.push_back (sibling);
-				sibling->parent = parent;
+		// objects whose childs are still to be loaded, and the offset of their first child
+		vector<pair<MdlObject*, uint> > todo;
+		if (hdr.OffsetToChildObject)
+			todo.push_back (make_pair (root, (uint)hdr.OffsetToChildObject));
+
+		while (!todo.empty()) {
+			MdlObject *parent = todo.back().first;
+			uint offset = todo.back().second;
+			todo.pop_back ();
+
+			// follow the sibling list, stopping at an object with the wrong version
+			while (offset) {
+				MdlObject *n = new MdlObject;
+				n->parent = parent;
+				parent->childs.push_back (n);
+				if (!LoadObject (offset, n, hdr)) {
+					parent->childs.pop_back ();
+					delete n;
+					break;
+				}
+				if (hdr.OffsetToChildObject)
+					todo.push_back (make_pair (n, (uint)hdr.OffsetToChildObject));
+				offset = hdr.OffsetToSiblingObject;
 			}
+			// the recursive loader added the last sibling first, the objects keep that order
+			reverse (parent->childs.begin(), parent->childs.end());
 		}
+	} catch (...) {
+		delete root;
+		throw;
 	}
-
-	if (obj.OffsetToChildObject)
-	{
-		MdlObject *ch = load_object (obj.OffsetToChildObject, f, n, r+1);
-		if (ch) {
-			n->childs.push_back (ch);
-			ch->parent = n;
-		}
-	}
-
-	fseek(f,org,SEEK_SET);
-	return n;
+	return root;
 }
 
 
 bool Model::Load3DO(const char *filename, IProgressCtl& /*progctl*/)
 {
-	FILE *f=0;
-
-	f = fopen( filename, "rb" );
-	if( !f )
+	vector<char> data;
+	if (!LoadFileContents (filename, data))
 		return false;
 
-	root = load_object( 0, f, 0 );
+	TAReader reader (data);
+	root = reader.Load ();
 	if(!root)
-	{
-		fclose(f);
 		return false;
-	}
 
 	mapping = MAPPING_3DO;
-
-	fclose(f);
 	return true;
 }
 
@@ -249,10 +370,10 @@ static void save_object(FILE *f, MdlObject *parent, std::vector<MdlObject*>::ite
 	n.OffsetToVertexArray = ftell(f);
 	for (unsigned int a=0;a<pm->verts.size();a++)
 	{
-		long v[3];
+		int v[3];
 		Vector3 *p = &pm->verts[a].pos;
 		for (int i=0;i<3;i++) v[i] = TO_TA(p->v[i]);
-		write_result = fwrite (v, sizeof(long), 3, f);
+		write_result = fwrite (v, sizeof(int), 3, f);
 		if (write_result != (size_t)3) throw std::runtime_error ("Couldn't write vertex.");
 	}
 
@@ -325,7 +446,6 @@ bool Model::Save3DO(const char *fn, IProgressCtl& /*progctl*/) {
 
 	if (!f)
 		throw std::runtime_error ("Couldn't open 3DO file for writing.");
-		return false;
 
 	MdlObject *cl = root->Clone();
 	IterateObjects (cl, ApplyOrientationAndScaling);
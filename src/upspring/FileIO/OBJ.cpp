@@ -9,6 +9,7 @@
 
 #include "Model.h"
 #include "Util.h"
+#include "ThreadPool.h"
 
 /* Values for wfPart.parttype */
 #define WF_FACE		1
@@ -23,198 +24,255 @@ struct wf_face_vert
 	int vert,tex,norm;
 };
 
-struct wf_face
-{
-	vector<wf_face_vert> verts;
-};
-
 struct wf_object
 {
-	~wf_object() { 
-		for (unsigned int a=0;a<faces.size();a++)
-			delete faces[a];
-		faces.clear();
-	}
 	vector<Vector3> vert;
 	vector<Vector3> norm;
 	vector<Vector2> texc;
-	vector<wf_face*> faces;
+	vector<wf_face_vert> faceVerts; // the vertices of all faces, one face after the other
+	vector<int> faces; // index in faceVerts of the first vertex of each face
+
+	// Negative indices refer to the vertices read before the face, so while parsing a chunk they are
+	// only known relative to the start of the chunk. These are the faceVerts entries to fix when merging,
+	// as faceVerts index*3 + 0 for vert, 1 for tex or 2 for norm.
+	vector<int> relative;
 };
 
-#define whitespace " \t"
-
-/* Types of lines that may be read from object file */
-#define VERTEX 1
-#define NORMAL 2
-#define TEXTURE 3
-#define FACE 4
-#define MTLLIB 5
-#define USEMTL 6
-#define MAPLIB 7
-#define USEMAP 8
-#define LINE 9
-#define COMMENT 99
-#define UNSUPPORTED 999
-
-char * wfReadLine(char *buf,int bufsize,FILE *fp)
+#define whitespace(c) ((c) == ' ' || (c) == '\t')
+
+static const double powersOf10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// For everything ParseFloat doesn't handle exactly, like inf/nan, hex floats and very long numbers
+static double SlowParseFloat (const char *s, const char *end)
 {
- int len;
- if (!fgets(buf,bufsize,fp)) return NULL;
- len = strlen(buf)-1;
- if (len <= 0)
-	return buf;
- while ((len<bufsize) && (buf[len-1] == '\\'))
-	{
-	if (!fgets(buf+len-1,bufsize-len,fp)) break;
-	len = strlen(buf)-1;
+	char buf[64];
+	int len = std::min ((int)(end - s), (int)sizeof(buf) - 1);
+	memcpy (buf, s, len);
+	buf[len] = 0;
+	return strtod (buf, 0);
+}
+
+/*
+Parses the number at the start of [s,end) like atof, but without depending on the C locale.
+Numbers with up to 18 digits and a small exponent are converted with a single rounding step,
+so the result is the same as strtod would give.
+*/
+static double ParseFloat (const char *s, const char *end)
+{
+	const char *p = s;
+	bool neg = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		neg = *p++ == '-';
+
+	unsigned long long mant = 0;
+	int exp = 0, numDigits = 0;
+	bool anyDigit = false;
+	for (; p < end && *p >= '0' && *p <= '9'; p++) {
+		anyDigit = true;
+		if ((mant || *p != '0') && ++numDigits > 18)
+			return SlowParseFloat (s, end);
+		mant = mant * 10 + (*p - '0');
+	}
+	if (p < end && *p == '.') {
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+			anyDigit = true;
+			if ((mant || *p != '0') && ++numDigits > 18)
+				return SlowParseFloat (s, end);
+			mant = mant * 10 + (*p - '0');
+			exp --;
+		}
 	}
- return buf;
+	if (!anyDigit || (p < end && (*p == 'x' || *p == 'X')))
+		return SlowParseFloat (s, end);
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		const char *q = p + 1;
+		bool expNeg = false;
+		if (q < end && (*q == '-' || *q == '+'))
+			expNeg = *q++ == '-';
+		// an 'e' without digits after it is not part of the number
+		if (q < end && *q >= '0' && *q <= '9') {
+			int e = 0;
+			for (; q < end && *q >= '0' && *q <= '9'; q++)
+				if (e < 10000) e = e * 10 + (*q - '0');
+			exp += expNeg ? -e : e;
+		}
+	}
+
+	if (mant > (1ULL << 53) || exp < -22 || exp > 22)
+		return SlowParseFloat (s, end);
+
+	double v = (double)mant;
+	v = exp < 0 ? v / powersOf10[-exp] : v * powersOf10[exp];
+	return neg ? -v : v;
 }
 
+// atoi without the locale and the need for a terminating zero
+static int ParseInt (const char *p, const char *end)
+{
+	bool neg = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		neg = *p++ == '-';
+	int v = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; p++)
+		v = v * 10 + (*p - '0');
+	return neg ? -v : v;
+}
 
-static void get_vertex(wf_object *obj)
+// Finds the next token separated by spaces or tabs, and moves p past it
+static bool NextToken (const char*& p, const char *end, const char*& tok, const char*& tokEnd)
 {
-	char *v;
-	Vector3 pos;
-	v = strtok(NULL,whitespace);
-	if (v) pos.x = atof(v);
-	else pos.x = 0;
-	v = strtok(NULL,whitespace);
-	if (v) pos.y = atof(v);
-	else pos.y = 0;
-	v = strtok(NULL,whitespace);
-	if (v) pos.z = atof(v);
-	else pos.z = 0;
-	obj->vert.push_back (pos);
+	while (p < end && whitespace(*p)) p++;
+	if (p == end)
+		return false;
+	tok = p;
+	while (p < end && !whitespace(*p)) p++;
+	tokEnd = p;
+	return true;
 }
 
-/* get_normal - processes a 'vn' line; gets the next vertex normal */
-static void get_normal(wf_object *obj)
+static Vector3 ParseVector (const char *p, const char *end)
 {
-	char *v;
-	Vector3 n;
-	v = strtok(NULL,whitespace);
-	if (v) n.x = atof(v);
-	else n.x = 0;
-	v = strtok(NULL,whitespace);
-	if (v)n.y = atof(v);
-	else n.y = 0;
-	v = strtok(NULL,whitespace);
-	if (v)n.z = atof(v);
-	else n.z = 0;
-	obj->norm.push_back (n);
+	Vector3 v;
+	const char *tok, *tokEnd;
+	for (int a=0;a<3;a++)
+		v[a] = NextToken (p, end, tok, tokEnd) ? (float)ParseFloat (tok, tokEnd) : 0.0f;
+	return v;
 }
 
-/* get_texcoord - processes a 'vt' line; gets the next texture vertex */
-static void get_texcoord(wf_object *obj)
+// Negative indices are relative to the number of items read so far
+static int ResolveIndex (wf_object *obj, int index, int count, int component)
 {
-	char *v;
-	Vector3 tc;
-	v = strtok(NULL,whitespace);
-	if (v) tc.x = atof(v);
-	else tc.x = 0;
-	v = strtok(NULL,whitespace);
-	if (v) tc.y = atof(v);
-	else tc.y = 0;
-	v = strtok(NULL,whitespace);
-	if (v)tc.z = atof(v);
-	else tc.z = 0;
-	obj->texc.push_back (Vector2(tc.x,tc.y));
+	if (index >= 0)
+		return index;
+	obj->relative.push_back ((int)obj->faceVerts.size() * 3 + component);
+	return count + 1 + index;
 }
 
-static void get_face(char *line, wf_object *obj)
+static void get_face (const char *p, const char *end, wf_object *obj)
 {
-	int nverts=0,i=0,v,vt,vn;
-	char *s,*r;
-	/* Count the number of vertices on the line */
-	while (strtok(NULL,whitespace)) nverts++;
-	/* Create the struct */
-	wf_face *f = new wf_face;
-	s = strtok(line,whitespace);
-
-	while ((s = strtok(NULL,whitespace)))
-	{
-		v = atoi(s);
+	const char *s, *tokEnd;
 
+	obj->faces.push_back ((int)obj->faceVerts.size());
+	while (NextToken (p, end, s, tokEnd))
+	{
 		wf_face_vert fv;
-		if (v>=0) fv.vert = v;
-		else fv.vert = obj->vert.size()+1 + v;
+		fv.vert = ResolveIndex (obj, ParseInt (s, tokEnd), (int)obj->vert.size(), 0);
+
 	/* Find the vertex texture after the first '/' */
-		r = s;
-		while ((*r) && (*r != '/')) r++;
-		if (*r)
+		const char *r = s;
+		while (r < tokEnd && *r != '/') r++;
+		if (r < tokEnd)
 		{
 			r++;
-			vt = atoi(r);
-			if (vt>=0) fv.tex = vt;
-			else fv.tex = obj->texc.size()+1 + vt;
+			fv.tex = ResolveIndex (obj, ParseInt (r, tokEnd), (int)obj->texc.size(), 1);
 		}
 		else fv.tex = 0;
 	/* Find the vertex normal after the second '/' */
-		while ((*r) && (*r != '/')) r++;
-		if (*r)
+		while (r < tokEnd && *r != '/') r++;
+		if (r < tokEnd)
 		{
 			r++;
-			vn = atoi(r);
-			if (vn>=0) fv.norm = vn;
-			else fv.tex = obj->norm.size()+1 + vn;
+			fv.norm = ResolveIndex (obj, ParseInt (r, tokEnd), (int)obj->norm.size(), 2);
 		}
 		else fv.norm = 0;
 
-		f->verts.push_back (fv);
+		obj->faceVerts.push_back (fv);
+	}
+}
 
-		i++;
+/* process_line - Determines what 'command' a line contains and adds
+	the info to the object */
+static void process_line(const char *p, const char *end, wf_object *obj)
+{
+	const char *cmd, *cmdEnd;
+	if (!NextToken (p, end, cmd, cmdEnd))
+		return;
+
+	int len = (int)(cmdEnd - cmd);
+	if (len == 1 && cmd[0] == 'v')
+		obj->vert.push_back (ParseVector (p, end));
+	else if (len == 2 && cmd[0] == 'v' && cmd[1] == 'n')
+		obj->norm.push_back (ParseVector (p, end));
+	else if (len == 2 && cmd[0] == 'v' && cmd[1] == 't') {
+		Vector3 tc = ParseVector (p, end);
+		obj->texc.push_back (Vector2 (tc.x, tc.y));
 	}
-	obj->faces.push_back(f);
+	else if ((len == 1 && cmd[0] == 'f') || (len == 2 && cmd[0] == 'f' && cmd[1] == 'o'))
+		get_face (p, end, obj);
+	// everything else (lines, materials, comments) is ignored
 }
 
+// A line ending with a backslash continues on the next line.
+// The search starts at p, 'begin' is the first character that can be checked for a backslash.
+static const char* FindLineEnd (const char *p, const char *begin, const char *end, bool& continued)
+{
+	continued = false;
+	for (;;) {
+		p = (const char *)memchr (p, '\n', end - p);
+		if (!p)
+			return end;
+		if (p == begin || p[-1] != '\\')
+			return p;
+		continued = true;
+		p ++;
+	}
+}
 
-/* line_type - determines the type of 'command' a line contains. Calls
-	strtok() to get the first string on the line, and to prepare it
-	for parsing by other routines. */
-static int line_type(char *line)
+static void ParseLines (const char *p, const char *end, wf_object *obj)
 {
- char *cmd;
- cmd = strtok(line,whitespace);
- if (!cmd) return(COMMENT);
- if (!strcmp(cmd,"v")) return(VERTEX);
- else if (!strcmp(cmd,"vn")) return(NORMAL);
- else if (!strcmp(cmd,"vt")) return(TEXTURE);
- else if (!strcmp(cmd,"l")) return(LINE);
- else if (!strcmp(cmd,"f")) return(FACE);
- else if (!strcmp(cmd,"fo")) return(FACE);
- else if (!strcmp(cmd,"mtllib")) return(MTLLIB);
- else if (!strcmp(cmd,"usemtl")) return(USEMTL);
- else if (!strcmp(cmd,"maplib")) return(MAPLIB);
- else if (!strcmp(cmd,"usemap")) return(USEMAP);
- else if (!strcmp(cmd,"#")) return(COMMENT);
- return(UNSUPPORTED);
+	string joined;
+	while (p < end) {
+		bool continued;
+		const char *lineEnd = FindLineEnd (p, p, end, continued);
+
+		if (continued) {
+			// remove the backslash-newline pairs
+			joined.clear ();
+			for (const char *c = p; c < lineEnd; c++) {
+				if (*c == '\\' && c + 1 < lineEnd && c[1] == '\n') c++;
+				else joined += *c;
+			}
+			process_line (joined.c_str(), joined.c_str() + joined.size(), obj);
+		} else
+			process_line (p, lineEnd, obj);
+
+		p = lineEnd + 1;
+	}
 }
 
-/* process_line - Determines what 'command' a line contains and adds
-	the info to the object */
-static void process_line(char *line,wf_object *obj)
+struct ParseChunk
 {
- int t;
- char linecopy[1024];
-/* Save a copy of the line for get_face et al, before line_type() strtok's it */
- strcpy(linecopy,line);
- t = line_type(line);
- switch (t) {
-	case VERTEX: 
-		get_vertex(obj);
-		break;
-	case NORMAL: 
-		get_normal(obj); 
-		break;
-	case TEXTURE: 
-		get_texcoord(obj);
-		break;
-	case FACE: 
-		get_face(linecopy,obj); 
-		break;
+	ParseChunk (const vector<const char*>& bounds, vector<wf_object*>& chunks) : bounds(bounds), chunks(chunks) {}
+	void operator()(int i) { ParseLines (bounds[i], bounds[i+1], chunks[i]); }
+
+	const vector<const char*>& bounds;
+	vector<wf_object*>& chunks;
+};
+
+// Appends a chunk parsed by another thread, making its relative indices absolute
+static void MergeChunk (wf_object *dst, wf_object *src)
+{
+	int base[3] = { (int)dst->vert.size(), (int)dst->texc.size(), (int)dst->norm.size() };
+	for (uint a=0;a<src->relative.size();a++) {
+		wf_face_vert& fv = src->faceVerts [src->relative[a] / 3];
+		int *index[3] = { &fv.vert, &fv.tex, &fv.norm };
+		*index [src->relative[a] % 3] += base [src->relative[a] % 3];
 	}
+
+	int faceBase = (int)dst->faceVerts.size();
+	for (uint a=0;a<src->faces.size();a++)
+		dst->faces.push_back (src->faces[a] + faceBase);
+
+	dst->faceVerts.insert (dst->faceVerts.end(), src->faceVerts.begin(), src->faceVerts.end());
+	dst->vert.insert (dst->vert.end(), src->vert.begin(), src->vert.end());
+	dst->norm.insert (dst->norm.end(), src->norm.begin(), src->norm.end());
+	dst->texc.insert (dst->texc.end(), src->texc.begin(), src->texc.end());
 }
+
 /*
 
 static int countFaces(wfObject *obj);
@@ -333,27 +391,53 @@ static void addNormalToVertNorms(wfFace *face,wfObject *obj,wfNormal norm)
 }
 
 */
-wf_object *ReadWFObject (char *fname, IProgressCtl& progctl)
+/*
+The file is read in one go and split in chunks at line boundaries, which are parsed on
+all processors. The chunks are merged in file order afterwards.
+*/
+wf_object *ReadWFObject (const char *fname, IProgressCtl& progctl)
 {
-	FILE *fp;
-	char line[1024];
-	if ((fp = fopen(fname,"r")) == 0)
-		return(NULL);
-	int len = 0;
-	fseek (fp,0,SEEK_END);
-	len=ftell(fp);
-	fseek (fp,0,SEEK_SET);
-
-	wf_object *obj = new wf_object;
-	while (wfReadLine(line,1024,fp))
-	{
-		line[strlen(line)-1] = '\0'; /* get rid of newline */
-		process_line(line,obj);
-
-		int pos = ftell(fp);
-		progctl.Update (pos / (float)len);
+	const int minChunkSize = 1024 * 1024;
+
+	vector<char> data;
+	if (!LoadFileContents (fname, data))
+		return NULL;
+
+	const char *start = data.empty() ? 0 : &data[0];
+	const char *end = start + data.size();
+
+	int numChunks = 1;
+	if ((int)data.size() > minChunkSize * 2)
+		numChunks = std::min ((int)data.size() / minChunkSize, ThreadPool::GetProcessorCount() * 4);
+
+	// move every chunk boundary to the start of a line
+	vector<const char*> bounds;
+	bounds.push_back (start);
+	for (int a=1;a<numChunks;a++) {
+		const char *p = std::max (bounds.back(), start + data.size() * a / numChunks);
+		bool continued;
+		p = FindLineEnd (p - 1, start, end, continued); // p-1, in case p is a newline after a backslash
+		bounds.push_back (p < end ? p + 1 : end);
+	}
+	bounds.push_back (end);
+
+	vector<wf_object*> chunks (numChunks);
+	for (int a=0;a<numChunks;a++)
+		chunks[a] = new wf_object;
+
+	if (numChunks > 1) {
+		ThreadPool pool;
+		pool.For (numChunks, ParseChunk (bounds, chunks));
+	} else
+		ParseLines (start, end, chunks[0]);
+	progctl.Update (0.5f);
+
+	wf_object *obj = chunks[0];
+	for (int a=1;a<numChunks;a++) {
+		MergeChunk (obj, chunks[a]);
+		delete chunks[a];
+		progctl.Update (0.5f + 0.5f * a / numChunks);
 	}
-	fclose(fp);
 	return obj;
 }
 
@@ -405,7 +489,7 @@ bool SaveWavefrontObject (const char *fn, MdlObject *src, IProgressCtl& progctl)
 
 MdlObject *LoadWavefrontObject (const char *fn, IProgressCtl& progctl)
 {
-	wf_object *wfobj = ReadWFObject( (char*)fn, progctl);
+	wf_object *wfobj = ReadWFObject(fn, progctl);
 
 	if (!wfobj)
 		return 0;
@@ -414,18 +498,20 @@ MdlObject *LoadWavefrontObject (const char *fn, IProgressCtl& progctl)
 	PolyMesh *pm = new PolyMesh;
 	o->geometry = pm;
 
+	pm->verts.resize (wfobj->faceVerts.size());
+	pm->poly.reserve (wfobj->faces.size());
+
 	for (unsigned int fi=0;fi<wfobj->faces.size();fi++)
 	{
 		Poly *pl = new Poly;
-		wf_face *face = wfobj->faces [fi];
-		pl->verts.resize (face->verts.size());
+		int first = wfobj->faces [fi];
+		int last = fi+1 < wfobj->faces.size() ? wfobj->faces [fi+1] : (int)wfobj->faceVerts.size();
+		pl->verts.resize (last - first);
 
-		for (unsigned int a=0;a<pl->verts.size();a++)
+		for (int a=first;a<last;a++)
 		{
-			pm->verts.push_back (Vertex());
-			Vertex& v=pm->verts.back();
-			
-			wf_face_vert& fv=face->verts[a];
+			Vertex& v=pm->verts[a];
+			wf_face_vert& fv=wfobj->faceVerts[a];
 
 			if (!wfobj->norm.empty() && fv.norm-1 < wfobj->norm.size())
 				v.normal = wfobj->norm [fv.norm-1];
@@ -434,7 +520,7 @@ MdlObject *LoadWavefrontObject (const char *fn, IProgressCtl& progctl)
 			if (!wfobj->vert.empty() && fv.vert-1 < wfobj->vert.size())
 				v.pos = wfobj->vert [fv.vert-1];
 
-			pl->verts [a] = pm->verts.size()-1;
+			pl->verts [a-first] = a;
 		}
 
 		pm->poly.push_back (pl);
@@ -18,7 +18,7 @@
 
 static void MirrorX(MdlObject *o)
 {
-	PolyMesh* pm = o->GetPolyMesh();
+	CompactPolyMesh* pm = dynamic_cast<CompactPolyMesh*>(o->geometry);
 	if (pm)
 	{
 		for (unsigned int a=0;a<pm->verts.size();a++) {
@@ -26,8 +26,7 @@ static void MirrorX(MdlObject *o)
 			pm->verts[a].normal.x *= -1.0f;
 		}
 
-		for (unsigned int a=0;a<pm->poly.size();a++)
-			pm->poly[a]->Flip();
+		pm->FlipPolygons();
 	}
 
 	o->position.x *= -1.0f;
@@ -35,128 +34,161 @@ static void MirrorX(MdlObject *o)
 		MirrorX(o->childs[a]);
 }
 
-static MdlObject *S3O_LoadObject (FILE *f, ulong offset)
+/*
+The loader reads the whole file with a single fread and decodes the pieces straight from that buffer.
+Every offset and count read from the file is checked against the buffer size before it is used,
+so a damaged file gives an error instead of reading past the end.
+*/
+class S3OReader
 {
-	size_t read_result;
-	int oldofs = ftell(f);
-	MdlObject *obj = new MdlObject;
-	PolyMesh* pm;
-	obj->geometry = pm = new PolyMesh;
+public:
+	S3OReader (const vector<char>& data) : data(data) {}
+
+	// returns a pointer to 'count' items of 'size' bytes at 'offset', or throws if they don't fit in the file
+	const char* Get (uint offset, uint count, uint size, const char *what)
+	{
+		if (!count)
+			return 0;
+		if (offset > data.size() || count > (data.size() - offset) / size)
+			throw std::runtime_error (SPrintf ("S3O file has an invalid %s offset (%u).", what, offset));
+		return &data[offset];
+	}
+
+	string ReadString (uint offset, const char *what)
+	{
+		const char *str = Get (offset, 1, 1, what);
+		const char *end = (const char*)memchr (str, 0, data.size() - offset);
+		if (!end)
+			throw std::runtime_error (SPrintf ("S3O file has an unterminated %s.", what));
+		return string (str, end);
+	}
+
+	MdlObject* LoadObject (uint offset);
+
+protected:
+	void LoadPrimitives (S3OPiece& piece, CompactPolyMesh *pm);
+
+	const vector<char>& data;
+	set<uint> pieces; // offsets of the pieces loaded so far, a piece that shows up twice would make it recurse forever
+};
+
+MdlObject* S3OReader::LoadObject (uint offset)
+{
+	if (!pieces.insert (offset).second)
+		throw std::runtime_error (SPrintf ("S3O file uses the piece at offset %u more than once.", offset));
 
-	// Read piece header
 	S3OPiece piece;
-	fseek (f, offset, SEEK_SET);
-	read_result = fread (&piece, sizeof(S3OPiece), 1, f);
-	if (read_result != 1) throw std::runtime_error ("Couldn't read piece header.");
-
-	// Read name
-	obj->name = ReadString (piece.name, f);
-	obj->position.set(piece.xoffset,piece.yoffset,piece.zoffset);
-
-	// Read child objects
-	fseek (f, piece.childs, SEEK_SET);
-	for (unsigned int a=0;a<piece.numChilds;a++) {
-		ulong chOffset;
-		read_result = fread (&chOffset, sizeof(ulong), 1, f);
-		if (read_result != 1) throw std::runtime_error ("Couldn't read child object.");
-		MdlObject *child = S3O_LoadObject (f, chOffset);
-		if (child) {
+	memcpy (&piece, Get (offset, 1, sizeof(S3OPiece), "piece"), sizeof(S3OPiece));
+
+	MdlObject *obj = new MdlObject;
+	CompactPolyMesh* pm;
+	obj->geometry = pm = new CompactPolyMesh;
+
+	try {
+		obj->name = ReadString (piece.name, "piece name");
+		obj->position.set(piece.xoffset,piece.yoffset,piece.zoffset);
+
+		// Read child objects, the child table is an array of 32 bit offsets
+		const char *childTable = Get (piece.childs, piece.numChilds, 4, "child table");
+		for (unsigned int a=0;a<piece.numChilds;a++) {
+			uint chOffset;
+			memcpy (&chOffset, childTable + a * 4, 4);
+			MdlObject *child = LoadObject (chOffset);
 			child->parent = obj;
 			obj->childs.push_back (child);
 		}
-	}
 
-	// Read vertices
-	pm->verts.resize (piece.numVertices);
-	fseek (f, piece.vertices, SEEK_SET);
-	for (unsigned int a=0;a<piece.numVertices;a++) {
-		S3OVertex sv;
-		read_result = fread (&sv, sizeof(S3OVertex), 1, f);
-		if (read_result != 1) throw std::runtime_error ("Couldn't read vertex.");
-		pm->verts [a].normal.set (sv.xnormal, sv.ynormal, sv.znormal);
-		pm->verts [a].pos.set (sv.xpos, sv.ypos, sv.zpos);
-		pm->verts [a].tc[0] = Vector2(sv.texu, sv.texv);
+		// Read vertices
+		const char *vertData = Get (piece.vertices, piece.numVertices, sizeof(S3OVertex), "vertex table");
+		pm->verts.resize (piece.numVertices);
+		for (unsigned int a=0;a<piece.numVertices;a++) {
+			S3OVertex sv;
+			memcpy (&sv, vertData + a * sizeof(S3OVertex), sizeof(S3OVertex));
+			pm->verts [a].normal.set (sv.xnormal, sv.ynormal, sv.znormal);
+			pm->verts [a].pos.set (sv.xpos, sv.ypos, sv.zpos);
+			pm->verts [a].tc[0] = Vector2(sv.texu, sv.texv);
+		}
+
+		LoadPrimitives (piece, pm);
+	} catch (...) {
+		delete obj;
+		throw;
 	}
 
-	// Read primitives - 0=triangles,1 triangle strips,2=quads
-	fseek (f, piece.vertexTable, SEEK_SET);
+	return obj;
+}
+
+void S3OReader::LoadPrimitives (S3OPiece& piece, CompactPolyMesh *pm)
+{
+	const uint stripEnd = 0xffffffff;
+
+	// checked first, so a corrupt size throws a runtime_error instead of a bad_alloc
+	const char *src = Get (piece.vertexTable, piece.vertexTableSize, 4, "primitive table");
+	vector<uint> data (piece.vertexTableSize);
+	if (src)
+		memcpy (&data[0], src, data.size() * 4);
+
+	for (unsigned int i=0;i<data.size();i++)
+		if (data[i] >= piece.numVertices && !(piece.primitiveType == 1 && data[i] == stripEnd))
+			throw std::runtime_error (SPrintf ("S3O file has an invalid vertex index (%u) in a piece with %u vertices.", data[i], piece.numVertices));
+
+	// 0=triangles,1 triangle strips,2=quads
 	switch (piece.primitiveType) { 
-		case 0: { // triangles
-			for (unsigned int i=0;i<piece.vertexTableSize;i+=3) {
-				ulong index;
-                Poly *pl = new Poly;
-				pl->verts.resize(3);
-				for (int a=0;a<3;a++) {
-					read_result = fread (&index,4,1,f);
-					if (read_result != 1) throw std::runtime_error ("Couldn't read primitive.");
-					pl->verts [a] = index;
-				}
-				pm->poly.push_back (pl);
-			}
+		case 0:   // triangles
+		case 2: { // quads
+			unsigned int n = piece.primitiveType ? 4 : 3;
+			unsigned int numPolys = (unsigned int)data.size() / n;
+			// the index table is used as it is
+			pm->indices.assign (data.begin(), data.begin() + numPolys * n);
+			pm->polyStart.resize (numPolys + 1);
+			for (unsigned int i=0;i<=numPolys;i++)
+				pm->polyStart[i] = i * n;
+			pm->polyColor.assign (numPolys, Vector3(1,1,1));
+			pm->polyTAColor.assign (numPolys, -1);
+			pm->polyTexture.assign (numPolys, -1);
+			pm->polyFlags.assign (numPolys, 0);
 			break;}
 		case 1: { // tristrips
-			ulong *data=new ulong[piece.vertexTableSize];
-			read_result = fread (data,4,piece.vertexTableSize, f);
-			if (read_result != piece.vertexTableSize) throw std::runtime_error ("Couldn't read tristrip.");
-			for (unsigned int i=0;i<piece.vertexTableSize;) {
+			for (unsigned int i=0;i<data.size();i++) {
 				// find out how long this strip is
 				unsigned int first=i;
-				while (i<piece.vertexTableSize && data[i]!=-1) 
+				while (i<data.size() && data[i]!=stripEnd) 
 					i++;
 				// create triangles from it
 				for (unsigned int a=2;a<i-first;a++) {
-					Poly *pl = new Poly;
-					pl->verts.resize(3);
+					int tri[3];
 					for (int x=0;x<3;x++)
-						pl->verts[(a&1)?x:2-x]=data[first+a+x-2];
-					pm->poly.push_back(pl);
-				}
-			}
-			delete[] data;
-			break;}
-		case 2: { // quads
-			for (unsigned int i=0;i<piece.vertexTableSize;i+=4) {
-				ulong index;
-                Poly *pl = new Poly;
-				pl->verts.resize(4);
-				for (int a=0;a<4;a++) {
-					read_result = fread (&index,4,1,f);
-					if (read_result != 1) throw std::runtime_error ("Couldn't read quad.");
-					pl->verts [a] = index;
+						tri[(a&1)?x:2-x]=data[first+a+x-2];
+					pm->AddPoly (tri, 3);
 				}
-				pm->poly.push_back (pl);
 			}
 			break;}
+		default:
+			throw std::runtime_error (SPrintf ("S3O file has an unknown primitive type (%u).", piece.primitiveType));
 	}
-
-//	fltk::message("object %s has %d polygon and %d vertices", obj->name.c_str(), obj->poly.size(),pm->verts.size());
-
-	fseek (f, oldofs, SEEK_SET);
-	return obj;
 }
 
 
 bool Model::LoadS3O(const char *filename, IProgressCtl& /*progctl*/) {
-	S3OHeader header;
-	size_t read_result;
-	FILE *file = fopen (filename, "rb");
-	if (!file)
+	vector<char> data;
+	if (!LoadFileContents (filename, data))
 		return false;
 
-	read_result = fread (&header, sizeof(S3OHeader), 1, file);
-	if (read_result != (size_t)1) throw std::runtime_error ("Couldn't read S3O header.");
+	if (data.size() < sizeof(S3OHeader)) {
+		logger.Trace (NL_Error, "S3O model %s is too small to contain a header", filename);
+		return false;
+	}
 
-	logger.Trace (NL_Error,"Wrong version. Only version 1 is supported");
+	S3OHeader header;
+	memcpy (&header, &data[0], sizeof(S3OHeader));
 
 	if (memcmp (header.magic, S3O_ID, 12)) {
 		logger.Trace (NL_Error, "S3O model %s has wrong identification", filename);
-		fclose (file);
 		return false;
 	}
 
 	if (header.version != 0) {
 		logger.Trace (NL_Error, "S3O model %s has wrong version (%d, wanted: %d)", filename, header.version, 0);
-		fclose (file);
 		return false;
 	}
 
@@ -164,7 +196,8 @@ bool Model::LoadS3O(const char *filename, IProgressCtl& /*progctl*/) {
 	mid.set (-header.midx, header.midy, header.midz);
 	height = header.height;
 
-	root = S3O_LoadObject (file, header.rootPiece);
+	S3OReader reader (data);
+	root = reader.LoadObject (header.rootPiece);
 	MirrorX(root);
 
 	string mdlPath = GetFilePath (filename);
@@ -177,173 +210,249 @@ bool Model::LoadS3O(const char *filename, IProgressCtl& /*progctl*/) {
 		texBindings.push_back(TextureBinding());
 		TextureBinding &tb = texBindings.back ();
 
-		tb.name = ReadString (tex ? header.texture2 : header.texture1, file);
+		tb.name = reader.ReadString (tex ? header.texture2 : header.texture1, "texture name");
 		tb.texture = new Texture (tb.name, mdlPath);
 		if (!tb.texture->IsLoaded ())
 			tb.texture = 0;
 	}
 
 	mapping = MAPPING_S3O;
-
-	fclose (file);
 	return true;
 }
 
-static void S3O_WritePrimitives(S3OPiece *p, FILE *f, PolyMesh* pm)
+/*
+The writer doesn't clone the model. Rotation and scaling of the pieces are baked into the vertices
+while writing, like IterateObjects(root, ApplyTransform(true,true,false)) would do on a copy,
+and the model is mirrored on the x axis like MirrorX.
+The file size is computed first, so the whole file is built in one buffer and written with a single fwrite.
+Pieces are written from CompactPolyMesh arrays; other geometry is converted to a temporary one by CalcSize.
+*/
+class S3OWriter
+{
+public:
+	~S3OWriter ();
+	bool Write (Model *mdl, const char *filename);
+
+protected:
+	CompactPolyMesh* GetMesh (MdlObject *obj);
+	uint CalcSize (MdlObject *obj);
+	void WriteObject (MdlObject *obj, const Matrix *parentTransform);
+	void WritePrimitives (S3OPiece& piece, CompactPolyMesh *pm, bool flip);
+
+	uint Alloc (uint size) { uint ofs = (uint)buf.size(); buf.resize (ofs + size); return ofs; }
+	void Put (uint ofs, const void *src, uint size) { memcpy (&buf[ofs], src, size); }
+	uint PutString (const string& str) { uint ofs = Alloc ((uint)str.size() + 1); Put (ofs, str.c_str(), (uint)str.size() + 1); return ofs; }
+
+	vector<char> buf;
+	map<MdlObject*, CompactPolyMesh*> converted;
+};
+
+S3OWriter::~S3OWriter ()
+{
+	for (map<MdlObject*, CompactPolyMesh*>::iterator i=converted.begin();i!=converted.end();++i)
+		delete i->second;
+}
+
+// returns the mesh of the object, without modifying the object
+CompactPolyMesh* S3OWriter::GetMesh (MdlObject *obj)
 {
-	bool allQuads=true;
-	size_t write_result;
-	unsigned int a=0;
-	for (;a<pm->poly.size();a++) {
-		if (pm->poly[a]->verts.size()!=4)
-			allQuads=false;
+	CompactPolyMesh *cpm = dynamic_cast<CompactPolyMesh*>(obj->geometry);
+	if (cpm || !obj->geometry)
+		return cpm;
+
+	map<MdlObject*, CompactPolyMesh*>::iterator i = converted.find (obj);
+	if (i != converted.end())
+		return i->second;
+
+	PolyMesh *pm = dynamic_cast<PolyMesh*>(obj->geometry);
+	if (pm)
+		cpm = CompactPolyMesh::FromPolyMesh (pm);
+	else {
+		pm = obj->geometry->ToPolyMesh();
+		cpm = CompactPolyMesh::FromPolyMesh (pm);
+		delete pm;
 	}
+	converted[obj] = cpm;
+	return cpm;
+}
 
-	p->vertexTable = ftell(f);
-	if (allQuads) {
-		for (unsigned int a=0;a<pm->poly.size();a++) {
-			Poly *pl = pm->poly[a];
-			for (int b=0;b<4;b++) {
-				uint i=pl->verts[b];
-				write_result = fwrite (&i, 4,1,f);
-				if (write_result != (size_t)1) throw std::runtime_error ("Couldn't write poly.");
-			}
+static bool S3O_AllQuads (CompactPolyMesh *pm)
+{
+	for (int a=0;a<pm->NumPolys();a++)
+		if (pm->PolySize(a)!=4)
+			return false;
+	return true;
+}
+
+uint S3OWriter::CalcSize (MdlObject *obj)
+{
+	uint size = sizeof(S3OPiece) + (uint)obj->name.size() + 1 + 4 * (uint)obj->childs.size();
+
+	CompactPolyMesh *pm = GetMesh (obj);
+	if (pm) {
+		size += (uint)pm->verts.size() * sizeof(S3OVertex);
+		if (S3O_AllQuads (pm))
+			size += 4 * 4 * (uint)pm->NumPolys();
+		else {
+			for (int a=0;a<pm->NumPolys();a++)
+				if (pm->PolySize(a) > 2)
+					size += 3 * 4 * ((uint)pm->PolySize(a) - 2);
 		}
-		p->vertexTableSize = 4 * (uint)pm->poly.size();
-		p->primitiveType=2;
-	} else {
-		vector<Triangle> tris = pm->MakeTris ();
-		for (unsigned int a=0;a<tris.size();a++)
-		{
-			for (int b=0;b<3;b++) {
-				uint i=tris[a].vrt[b];
-				write_result = fwrite (&i,4,1,f);
-				if (write_result != (size_t)1) throw std::runtime_error ("Couldn't write tri.");
+	}
+
+	for (uint a=0;a<obj->childs.size();a++)
+		size += CalcSize (obj->childs[a]);
+	return size;
+}
 
+// Writes the vertex table, with the polygons flipped like Poly::Flip if needed. Non-quad meshes are triangulated like PolyMesh::MakeTris.
+void S3OWriter::WritePrimitives (S3OPiece& piece, CompactPolyMesh *pm, bool flip)
+{
+	bool allQuads = S3O_AllQuads (pm);
+
+	piece.vertexTable = (uint)buf.size();
+	piece.vertexTableSize = 0;
+
+	vector<uint> pv;
+	for (int a=0;a<pm->NumPolys();a++) {
+		const int *vi = &pm->indices[pm->polyStart[a]];
+		uint n = (uint)pm->PolySize(a);
+
+		pv.resize (n);
+		for (uint b=0;b<n;b++)
+			pv[b] = flip ? vi[(n+1-b)%n] : vi[b];
+
+		if (allQuads) {
+			Put (Alloc (4 * 4), &pv[0], 4 * 4);
+			piece.vertexTableSize += 4;
+		} else {
+			for (uint b=2;b<n;b++) {
+				uint tri[3] = { pv[0], pv[b-1], pv[b] };
+				Put (Alloc (3 * 4), tri, 3 * 4);
+				piece.vertexTableSize += 3;
 			}
 		}
-		p->vertexTableSize = 3 * (uint)tris.size();
-		p->primitiveType=0;
 	}
+	piece.primitiveType = allQuads ? 2 : 0;
 }
 
-static void S3O_SaveObject (FILE *f, MdlObject *obj)
+// parentTransform is the rotation and scaling of all parent pieces combined, 0 for the root piece
+void S3OWriter::WriteObject (MdlObject *obj, const Matrix *parentTransform)
 {
-	int startpos = ftell(f);
 	S3OPiece piece;
-	size_t write_result;
 	memset(&piece, 0, sizeof(piece));
 
-	fseek (f, sizeof(S3OPiece), SEEK_CUR);
-	piece.name = ftell(f);
-	WriteZStr(f, obj->name);
-	
-	piece.xoffset = obj->position.x;
-	piece.yoffset = obj->position.y;
-	piece.zoffset = obj->position.z;
+	uint start = Alloc (sizeof(S3OPiece));
+	piece.name = PutString (obj->name);
+
+	Matrix transform;
+	obj->GetTransform (transform);
+	transform.t(0) = transform.t(1) = transform.t(2) = 0.0f;
+
+	Vector3 pos = obj->position;
+	if (parentTransform) {
+		parentTransform->apply (&obj->position, &pos);
+		transform *= *parentTransform;
+	}
+
+	piece.xoffset = -pos.x;
+	piece.yoffset = pos.y;
+	piece.zoffset = pos.z;
 	piece.collisionData = 0;
 	piece.vertexType = 0;
 
-	PolyMesh* pm = obj->geometry ? obj->geometry->ToPolyMesh() : 0;
+	CompactPolyMesh *pm = GetMesh (obj);
 	if (pm) 
 	{
-		S3O_WritePrimitives (&piece, f, pm);
+		Matrix normalTransform, invTransform;
+		transform.inverse(invTransform);
+		invTransform.transpose(&normalTransform);
+
+		// MirrorX flips all polygons, a mirroring transform flips them back again
+		WritePrimitives (piece, pm, transform.determinant() >= 0.0f);
 
 		piece.numVertices = (uint) pm->verts.size();
-		piece.vertices = ftell(f);
+		piece.vertices = Alloc (piece.numVertices * sizeof(S3OVertex));
 		for (unsigned int a=0;a<pm->verts.size();a++)
 		{
 			Vertex *myVert=&pm->verts[a];
+			Vector3 tpos, tnormal;
+			transform.apply (&myVert->pos, &tpos);
+			normalTransform.apply (&myVert->normal, &tnormal);
+
 			S3OVertex v;
 			v.texu=myVert->tc[0].x;
 			v.texv=myVert->tc[0].y;
-			v.xnormal=myVert->normal.x;
-			v.ynormal=myVert->normal.y;
-			v.znormal=myVert->normal.z;
-			v.xpos=myVert->pos.x;
-			v.ypos=myVert->pos.y;
-			v.zpos=myVert->pos.z;
-			write_result = fwrite(&v,sizeof(S3OVertex),1,f);
-			if (write_result != (size_t)1) throw std::runtime_error ("Couldn't write vertex.");
+			v.xnormal=-tnormal.x;
+			v.ynormal=tnormal.y;
+			v.znormal=tnormal.z;
+			v.xpos=-tpos.x;
+			v.ypos=tpos.y;
+			v.zpos=tpos.z;
+			Put (piece.vertices + a * sizeof(S3OVertex), &v, sizeof(S3OVertex));
 		}
-		delete pm;
 	}
 
 	piece.numChilds = (uint)obj->childs.size();
-	ulong *childpos=new ulong[piece.numChilds];
+	vector<uint> childpos (piece.numChilds);
 	for (unsigned int a=0;a<obj->childs.size();a++)
 	{
-		childpos[a] = ftell(f);
-		S3O_SaveObject (f,obj->childs[a]);
+		childpos[a] = (uint)buf.size();
+		WriteObject (obj->childs[a], &transform);
 	}
-	piece.childs=ftell(f);
-	write_result = fwrite (childpos,4,piece.numChilds,f);
-	if (write_result != (size_t)(piece.numChilds)) throw std::runtime_error ("Couldn't write child.");
-	delete[] childpos;
-
-	int endpos=ftell(f);
-	fseek (f,startpos,SEEK_SET);
-	write_result = fwrite (&piece,sizeof(S3OPiece),1,f);
-	if (write_result != (size_t)1) throw std::runtime_error ("Couldn't write piece.");
-	fseek (f,endpos,SEEK_SET);
-}
+	piece.childs = Alloc (4 * piece.numChilds);
+	if (piece.numChilds)
+		Put (piece.childs, &childpos[0], 4 * piece.numChilds);
 
-
-// S3O supports position saving, but no rotation or scaling
-static inline void ApplyOrientationAndScaling (MdlObject *o) 
-{
-	o->ApplyTransform(true,true,false);
+	Put (start, &piece, sizeof(S3OPiece));
 }
 
-
-bool Model::SaveS3O(const char *filename, IProgressCtl& /*progctl*/) {
+bool S3OWriter::Write (Model *mdl, const char *filename)
+{
 	S3OHeader header;
-	size_t write_result;
 	memset (&header,0,sizeof(S3OHeader));
 	memcpy (header.magic, S3O_ID, 12);
 
-	if (!root)
-		return false;
-	
-	FILE *f = fopen (filename, "wb");
-	if (!f) 
-		return false;
-
-	fseek (f, sizeof(S3OHeader), SEEK_SET);
-	header.rootPiece = ftell(f);
+	uint size = sizeof(S3OHeader) + CalcSize (mdl->root);
+	for (uint tex=0;tex<mdl->texBindings.size() && tex<2;tex++)
+		size += (uint)mdl->texBindings[tex].name.size() + 1;
+	buf.reserve (size);
 
-	if (root) {
-		MdlObject *cloned = root->Clone();
-		IterateObjects (cloned, ApplyOrientationAndScaling);
-		MirrorX(cloned);
-		S3O_SaveObject (f, cloned);
-		delete cloned;
-	}
+	Alloc (sizeof(S3OHeader));
+	header.rootPiece = (uint)buf.size();
+	WriteObject (mdl->root, 0);
 
-	for (uint tex=0;tex<texBindings.size();tex++) {
-		if (tex >= texBindings.size ())
-			break;
-
-		TextureBinding &tb = texBindings[tex];
+	for (uint tex=0;tex<mdl->texBindings.size();tex++) {
+		TextureBinding &tb = mdl->texBindings[tex];
 		if (!tb.name.empty()) {
-			if (tex==0) header.texture1 = ftell(f);
-			if (tex==1) header.texture2 = ftell(f);
-			WriteZStr (f, tb.name);
+			if (tex==0) header.texture1 = (uint)buf.size();
+			if (tex==1) header.texture2 = (uint)buf.size();
+			PutString (tb.name);
 		}
 	}
 
-	header.radius = radius;
-	header.height = height;
-	header.midx = -mid.x;
-	header.midy = mid.y;
-	header.midz = mid.z;
+	header.radius = mdl->radius;
+	header.height = mdl->height;
+	header.midx = -mdl->mid.x;
+	header.midy = mdl->mid.y;
+	header.midz = mdl->mid.z;
+	Put (0, &header, sizeof(S3OHeader));
 
-	fseek (f, 0, SEEK_SET);
-	write_result = fwrite (&header, sizeof(S3OHeader), 1, f);
-	if (write_result != (size_t)1) throw std::runtime_error ("Couldn't write S3O header.");
-	fclose (f);
+	FILE *f = fopen (filename, "wb");
+	if (!f) 
+		return false;
 
+	size_t write_result = fwrite (&buf[0], buf.size(), 1, f);
+	fclose (f);
+	if (write_result != (size_t)1) throw std::runtime_error ("Couldn't write S3O file.");
 	return true;
 }
 
 
+bool Model::SaveS3O(const char *filename, IProgressCtl& /*progctl*/) {
+	if (!root)
+		return false;
+
+	S3OWriter writer;
+	return writer.Write (this, filename);
+}
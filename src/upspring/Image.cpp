@@ -4,6 +4,12 @@
 #include "Image.h"
 #include "Util.h"
 
+// SSE2 versions of the pixel format conversion, SSE2 is always there on x86-64
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IMAGE_USE_SSE2
+#include <emmintrin.h>
+#endif
+
 // If defined, use SDL_image, otherwise use DevIL/OpenIL
 //#define USE_SDL_IMAGE 
 
@@ -12,6 +18,10 @@
 #else
 #include <IL/il.h>
 #include <IL/ilu.h>
+#include <fltk/Threads.h>
+
+// DevIL keeps a global bound image, so calls into it from worker threads have to be serialized
+static fltk::Mutex devilLock;
 
 struct DevILInitializer
 {
@@ -197,6 +207,143 @@ void Image::SetPixel(int x, int y, uint src)
 	}
 }
 
+/*
+Decoders for the uncompressed BMP and TGA files that most texture archives consist of.
+Unlike DevIL they don't use global state, so textures can be decoded on several threads at once.
+The result is the same as DevIL gives with IL_CONV_PAL and IL_ORIGIN_LOWER_LEFT: RGB or RGBA,
+with the bottom row first. They return false for anything they don't handle, which is then left to DevIL.
+*/
+static inline uint ReadLE16 (const uchar *p) { return p[0] | (p[1] << 8); }
+static inline uint ReadLE32 (const uchar *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint)p[3] << 24); }
+
+static bool LoadBMP (Image *img, const uchar *buf, uint len)
+{
+	if (len < 54 || buf[0] != 'B' || buf[1] != 'M')
+		return false;
+
+	uint dataOfs = ReadLE32 (buf + 10);
+	uint infoSize = ReadLE32 (buf + 14);
+	int width = (int)ReadLE32 (buf + 18);
+	int height = (int)ReadLE32 (buf + 22);
+	uint bits = ReadLE16 (buf + 28);
+	uint compression = ReadLE32 (buf + 30);
+	uint numColors = ReadLE32 (buf + 46);
+
+	if (infoSize < 40 || compression != 0 || (bits != 8 && bits != 24))
+		return false;
+
+	bool topDown = height < 0;
+	if (topDown) height = -height;
+	if (width <= 0 || height <= 0 || width > 16384 || height > 16384)
+		return false;
+
+	uint stride = ((width * bits + 31) / 32) * 4;
+	if (dataOfs > len || (len - dataOfs) / stride < (uint)height)
+		return false;
+
+	const uchar *palette = buf + 14 + infoSize;
+	if (bits == 8) {
+		if (!numColors || numColors > 256) numColors = 256;
+		if (14 + infoSize + numColors * 4 > len)
+			return false;
+	}
+
+	img->Alloc (width, height, ImgFormat(ImgFormat::RGB));
+	for (int y=0;y<height;y++) {
+		const uchar *src = buf + dataOfs + stride * (topDown ? height-1-y : y);
+		uchar *dst = &img->data [y * width * 3];
+
+		for (int x=0;x<width;x++, dst+=3) {
+			const uchar *bgr = src + x * 3;
+			if (bits == 8) {
+				uint index = src[x] < numColors ? src[x] : 0;
+				bgr = palette + index * 4;
+			}
+			dst[0] = bgr[2];
+			dst[1] = bgr[1];
+			dst[2] = bgr[0];
+		}
+	}
+	return true;
+}
+
+static bool LoadTGA (Image *img, const uchar *buf, uint len)
+{
+	if (len < 18)
+		return false;
+
+	uint idLength = buf[0];
+	uint colorMapType = buf[1];
+	uint imageType = buf[2];
+	int width = ReadLE16 (buf + 12);
+	int height = ReadLE16 (buf + 14);
+	uint bits = buf[16];
+	uint descriptor = buf[17];
+
+	// truecolor, possibly RLE compressed, with the pixels from left to right
+	if (colorMapType != 0 || (imageType != 2 && imageType != 10) || (bits != 24 && bits != 32) || (descriptor & 0x10))
+		return false;
+	if (width <= 0 || height <= 0 || width > 16384 || height > 16384)
+		return false;
+
+	uint bpp = bits / 8;
+	uint numPixels = width * height;
+	size_t size = (size_t)numPixels * bpp;
+	const uchar *src = buf + 18 + idLength;
+	const uchar *end = buf + len;
+	if (src > end)
+		return false;
+
+	vector<uchar> pixels;
+	if (imageType == 2) {
+		if ((uint)(end - src) / bpp < numPixels)
+			return false;
+		pixels.assign (src, src + size);
+	} else {
+		// a packet holds at most 128 pixels, so a file that is too short is rejected before allocating
+		if ((size_t)(end - src) / (1 + bpp) < (numPixels + 127) / 128)
+			return false;
+		pixels.resize (size);
+		uint n = 0;
+		while (n < numPixels) {
+			if (src >= end)
+				return false;
+			uint packet = *src++;
+			uint count = (packet & 0x7f) + 1;
+			if (count > numPixels - n)
+				return false;
+
+			if (packet & 0x80) {
+				if ((uint)(end - src) < bpp)
+					return false;
+				for (uint a=0;a<count;a++)
+					memcpy (&pixels[(size_t)(n+a) * bpp], src, bpp);
+				src += bpp;
+			} else {
+				if ((uint)(end - src) / bpp < count)
+					return false;
+				memcpy (&pixels[(size_t)n * bpp], src, count * bpp);
+				src += count * bpp;
+			}
+			n += count;
+		}
+	}
+
+	bool topDown = (descriptor & 0x20) != 0;
+	img->Alloc (width, height, ImgFormat(bpp == 4 ? ImgFormat::RGBA : ImgFormat::RGB));
+	for (int y=0;y<height;y++) {
+		const uchar *s = &pixels [(topDown ? height-1-y : y) * width * bpp];
+		uchar *dst = &img->data [y * width * bpp];
+		for (int x=0;x<width;x++, s+=bpp, dst+=bpp) {
+			dst[0] = s[2];
+			dst[1] = s[1];
+			dst[2] = s[0];
+			if (bpp == 4) dst[3] = s[3];
+		}
+	}
+	return true;
+}
+
 #ifdef USE_SDL_IMAGE
 
 
@@ -274,6 +421,7 @@ void Image::LoadGrayscale (void *buf, int len)
 	uint id;
 	int bpp;
 
+	fltk::Guard guard(devilLock);
 	ilGenImages (1, &id);
 	ilBindImage (id);
 
@@ -305,6 +453,11 @@ void Image::LoadFromMemory (void *buf, int len)
 {
 	uint id;
 
+	Free();
+	if (LoadBMP (this, (const uchar*)buf, len) || LoadTGA (this, (const uchar*)buf, len))
+		return;
+
+	fltk::Guard guard(devilLock);
 	ilGenImages (1, &id);
 	ilBindImage (id);
 
@@ -370,6 +523,7 @@ void Image::FromIL(uint id)
 uint Image::ToIL()
 {
 	uint id;
+	fltk::Guard guard(devilLock);
 	ilGenImages(1,&id);
 	ilBindImage(id);
 
@@ -400,6 +554,7 @@ bool Image::Save(const char *file)
 {
 	uint id = ToIL();
 
+	fltk::Guard guard(devilLock);
 	ilEnable(IL_FILE_OVERWRITE);
 	ilBindImage(id);
 	bool r= ilSaveImage((const ILstring) file);
@@ -500,16 +655,214 @@ void Image::SaveTGA (const char *file)
 }
 
 
+// ------------------------------ Pixel conversion -------------------------------
+
 /*
-Convert an image to another format
-dst->format contains the destination format, to which the image is converted.
+Convert moves every color channel with a mask and a few shifts. PixelConversion holds those for the
+channels present in both formats, so the conversion loops don't have to look at the formats.
+Pixels are read and written as little endian values of bytesPerPixel bytes, the same as the
+generic loop in Convert does through a uint pointer, but without touching the bytes after the last pixel.
 */
-void Image::Convert(Image *dst)
+struct ChannelMove
+{
+	uint srcMask, dstMask;
+	uint rshift, lshift;
+};
+
+struct PixelConversion
+{
+	ChannelMove channels[4];
+	int numChannels;
+
+	bool Init (const ImgFormat& src, const ImgFormat& dst);
+
+	uint Apply (uint p) const
+	{
+		uint r = 0;
+		for (int c=0;c<numChannels;c++) {
+			const ChannelMove& m = channels[c];
+			r |= (((p & m.srcMask) >> m.rshift) << m.lshift) & m.dstMask;
+		}
+		return r;
+	}
+};
+
+bool PixelConversion::Init (const ImgFormat& src, const ImgFormat& dst)
+{
+	numChannels = 0;
+	for (int c=0;c<4;c++) {
+		if (!src.mask[c] || !dst.mask[c])
+			continue;
+
+		// ((v >> shift << loss) >> dstLoss) << dstShift, with the loss shifts folded into the others
+		ChannelMove& m = channels[numChannels++];
+		m.srcMask = src.mask[c];
+		m.dstMask = dst.mask[c];
+		m.rshift = src.shift[c] + (dst.loss[c] > src.loss[c] ? dst.loss[c] - src.loss[c] : 0);
+		m.lshift = dst.shift[c] + (src.loss[c] > dst.loss[c] ? src.loss[c] - dst.loss[c] : 0);
+		if (m.rshift > 31 || m.lshift > 31)
+			return false;
+	}
+	return true;
+}
+
+template<int Bpp> static inline uint LoadPixel (const uchar *p)
+{
+	switch (Bpp) {
+		case 1: return p[0];
+		case 2: return p[0] | (p[1] << 8);
+		case 3: return p[0] | (p[1] << 8) | (p[2] << 16);
+		default: return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint)p[3] << 24);
+	}
+}
+
+template<int Bpp> static inline void StorePixel (uchar *p, uint v)
+{
+	p[0] = (uchar)v;
+	if (Bpp > 1) p[1] = (uchar)(v >> 8);
+	if (Bpp > 2) p[2] = (uchar)(v >> 16);
+	if (Bpp > 3) p[3] = (uchar)(v >> 24);
+}
+
+#ifdef IMAGE_USE_SSE2
+
+// Four pixels in the 32 bit lanes. The loads read up to 16 bytes, so the caller keeps them away from the end.
+template<int Bpp> static inline __m128i LoadPixels4 (const uchar *p)
+{
+	__m128i zero = _mm_setzero_si128();
+	switch (Bpp) {
+		case 1: return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(*(const int*)p), zero), zero);
+		case 2: return _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)p), zero);
+		case 3: {
+			__m128i v = _mm_loadu_si128((const __m128i*)p);
+			__m128i ab = _mm_unpacklo_epi32(v, _mm_srli_si128(v, 3));
+			__m128i cd = _mm_unpacklo_epi32(_mm_srli_si128(v, 6), _mm_srli_si128(v, 9));
+			return _mm_and_si128(_mm_unpacklo_epi64(ab, cd), _mm_set1_epi32(0xffffff));
+		}
+		default: return _mm_loadu_si128((const __m128i*)p);
+	}
+}
+
+// Stores the low Bpp bytes of each lane, the other bytes have to be zero
+template<int Bpp> static inline void StorePixels4 (uchar *p, __m128i v)
+{
+	switch (Bpp) {
+		case 1:
+			v = _mm_packs_epi32(v, v);
+			*(int*)p = _mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+			break;
+		case 2:
+			// sign extend, so packs doesn't saturate
+			v = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+			_mm_storel_epi64((__m128i*)p, _mm_packs_epi32(v, v));
+			break;
+		case 3: {
+			// pixel 0 and 1 in bytes 0-5 of the low half, 2 and 3 in bytes 8-13, then close the gap
+			v = _mm_or_si128(_mm_and_si128(v, _mm_set_epi32(0, -1, 0, -1)), _mm_srli_epi64(_mm_and_si128(v, _mm_set_epi32(-1, 0, -1, 0)), 8));
+			v = _mm_or_si128(_mm_and_si128(v, _mm_set_epi32(0, 0, 0xffff, -1)),
+				_mm_and_si128(_mm_srli_si128(v, 2), _mm_set_epi32(0, -1, 0xffff0000, 0)));
+			_mm_storel_epi64((__m128i*)p, v);
+			*(int*)(p + 8) = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+			break; }
+		default:
+			_mm_storeu_si128((__m128i*)p, v);
+			break;
+	}
+}
+
+// Converts pixels four at a time, and returns how many it did
+template<int SrcBpp, int DstBpp> static uint ConvertPixelsSSE2 (const PixelConversion& pc, const uchar *src, uchar *dst, uint count)
+{
+	__m128i srcMask[4], dstMask[4], rshift[4], lshift[4];
+	for (int c=0;c<pc.numChannels;c++) {
+		srcMask[c] = _mm_set1_epi32(pc.channels[c].srcMask);
+		dstMask[c] = _mm_set1_epi32(pc.channels[c].dstMask);
+		rshift[c] = _mm_cvtsi32_si128(pc.channels[c].rshift);
+		lshift[c] = _mm_cvtsi32_si128(pc.channels[c].lshift);
+	}
+
+	// stay 4 pixels away from the end, the loads can read beyond the 4 pixels
+	uint a = 0;
+	for (;a+8<=count;a+=4) {
+		__m128i p = LoadPixels4<SrcBpp> (src + a*SrcBpp);
+		__m128i r = _mm_setzero_si128();
+		for (int c=0;c<pc.numChannels;c++) {
+			__m128i v = _mm_srl_epi32(_mm_and_si128(p, srcMask[c]), rshift[c]);
+			r = _mm_or_si128(r, _mm_and_si128(_mm_sll_epi32(v, lshift[c]), dstMask[c]));
+		}
+		StorePixels4<DstBpp> (dst + a*DstBpp, r);
+	}
+	return a;
+}
+
+#endif
+
+template<int SrcBpp, int DstBpp> static void ConvertPixels (const PixelConversion& pc, const uchar *src, uchar *dst, uint count)
+{
+	uint a = 0;
+#ifdef IMAGE_USE_SSE2
+	a = ConvertPixelsSSE2<SrcBpp, DstBpp> (pc, src, dst, count);
+#endif
+	for (;a<count;a++)
+		StorePixel<DstBpp> (dst + a*DstBpp, pc.Apply (LoadPixel<SrcBpp> (src + a*SrcBpp)));
+}
+
+typedef void (*ConvertPixelsFunc)(const PixelConversion& pc, const uchar *src, uchar *dst, uint count);
+
+// indexed by source and destination bytes per pixel - 1
+static ConvertPixelsFunc convertPixelsFuncs[4][4] = {
+	{ ConvertPixels<1,1>, ConvertPixels<1,2>, ConvertPixels<1,3>, ConvertPixels<1,4> },
+	{ ConvertPixels<2,1>, ConvertPixels<2,2>, ConvertPixels<2,3>, ConvertPixels<2,4> },
+	{ ConvertPixels<3,1>, ConvertPixels<3,2>, ConvertPixels<3,3>, ConvertPixels<3,4> },
+	{ ConvertPixels<4,1>, ConvertPixels<4,2>, ConvertPixels<4,3>, ConvertPixels<4,4> }
+};
+
+/*
+The generic conversion, for formats the loops above can't handle. Pixels are read and written
+through a uint pointer, so up to 3 bytes after the last source and destination pixel are accessed.
+*/
+static void ConvertPixelsGeneric (const ImgFormat& sf, const uchar *src, const ImgFormat& df, uchar *dst, uint count)
 {
 	uchar **dstBytePos, **srcBytePos;
 	uint *ps, *pd;
-	int x,y,r,g,b,a;
+	int r,g,b,a;
 
+	ps = (uint*)src;
+	pd = (uint*)dst;
+	dstBytePos = (uchar**)&pd;
+	srcBytePos = (uchar**)&ps;
+
+	for(uint x=0;x<count;x++)
+	{
+		for(a=0;a<int(df.bytesPerPixel);a++)
+			(*dstBytePos)[a] = 0;
+
+		r = ((*ps)&sf.mask[0]) >> sf.shift[0];
+		r <<= sf.loss[0];
+		g = ((*ps)&sf.mask[1]) >> sf.shift[1];
+		g <<= sf.loss[1];
+		b = ((*ps)&sf.mask[2]) >> sf.shift[2];
+		b <<= sf.loss[2];
+		a = ((*ps)&sf.mask[3]) >> sf.shift[3];
+		a <<= sf.loss[3];
+
+		*pd |= ((r >> df.loss[0]) << df.shift[0]) & df.mask[0];
+		*pd |= ((g >> df.loss[1]) << df.shift[1]) & df.mask[1];
+		*pd |= ((b >> df.loss[2]) << df.shift[2]) & df.mask[2];
+		*pd |= ((a >> df.loss[3]) << df.shift[3]) & df.mask[3];
+
+		// go to next pixel
+		*dstBytePos += df.bytesPerPixel;
+		*srcBytePos += sf.bytesPerPixel;
+	}
+}
+
+/*
+Convert an image to another format
+dst->format contains the destination format, to which the image is converted.
+*/
+void Image::Convert(Image *dst)
+{
 	if(dst->w != w || dst->h != h)
 	{
 		dst->Free ();
@@ -525,38 +878,68 @@ void Image::Convert(Image *dst)
 	if(!dst->data) 
 		dst->Alloc (w,h,dst->format);
 
-	ps = (uint*)data;
-	pd = (uint*)dst->data;
-	dstBytePos = (uchar**)&pd;
-	srcBytePos = (uchar**)&ps;
+	// the conversion loop for these pixel sizes is chosen once for the image
+	PixelConversion pc;
+	uint srcBpp = format.bytesPerPixel, dstBpp = dst->format.bytesPerPixel;
+	if (srcBpp >= 1 && srcBpp <= 4 && dstBpp >= 1 && dstBpp <= 4 && pc.Init (format, dst->format)) {
+		convertPixelsFuncs[srcBpp-1][dstBpp-1] (pc, data, dst->data, w*h);
+		return;
+	}
 
-	ImgFormat *df = &dst->format;
-	for(y=0;y<h;y++)
-	{
-		for(x=0;x<w;x++)
-		{
-			for(a=0;a<int(df->bytesPerPixel);a++)
-				(*dstBytePos)[a] = 0;
-
-			r = ((*ps)&format.mask[0]) >> format.shift[0];
-			r <<= format.loss[0];
-			g = ((*ps)&format.mask[1]) >> format.shift[1];
-			g <<= format.loss[1];
-			b = ((*ps)&format.mask[2]) >> format.shift[2];
-			b <<= format.loss[2];
-			a = ((*ps)&format.mask[3]) >> format.shift[3];
-			a <<= format.loss[3];
-
-			*pd |= ((r >> df->loss[0]) << df->shift[0]) & df->mask[0];
-			*pd |= ((g >> df->loss[1]) << df->shift[1]) & df->mask[1];
-			*pd |= ((b >> df->loss[2]) << df->shift[2]) & df->mask[2];
-			*pd |= ((a >> df->loss[3]) << df->shift[3]) & df->mask[3];
-
-			// go to next pixel
-			*dstBytePos += dst->format.bytesPerPixel;
-			*srcBytePos += format.bytesPerPixel;
+	// generic version for anything else
+	ConvertPixelsGeneric (format, data, dst->format, dst->data, w*h);
+}
+
+/*
+Self-check of the conversion loops: for every pair of formats, the result has to be byte for byte
+the same as that of the generic loop, and the bytes after the last pixel must be left alone.
+The pixel counts cover every tail the SSE2 loop can leave. Like math_test, it isn't called by default.
+*/
+bool image_convert_test()
+{
+	const uint counts[] = { 1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,31,64,67 };
+	const int numCounts = sizeof(counts) / sizeof(uint);
+	const uchar guard = 0xcd;
+
+	uint seed = 12345, numTested = 0, numFailed = 0;
+	for (int s=ImgFormat::RGB;s<=ImgFormat::ARGB;s++)
+		for (int d=ImgFormat::RGB;d<=ImgFormat::ARGB;d++) {
+			ImgFormat sf ((ImgFormat::Type)s), df ((ImgFormat::Type)d);
+			PixelConversion pc;
+			if (!pc.Init (sf, df)) {
+				logger.Print ("Formats %d -> %d: generic conversion only\n", s, d);
+				continue;
+			}
+
+			for (int c=0;c<numCounts;c++) {
+				uint count = counts[c];
+				// 3 extra bytes for the uint accesses of the generic loop
+				vector<uchar> src (count * sf.bytesPerPixel + 3);
+				vector<uchar> expected (count * df.bytesPerPixel + 3, 0);
+				vector<uchar> result (count * df.bytesPerPixel + 16, guard);
+				for (uint a=0;a<src.size();a++) {
+					seed = seed * 1664525 + 1013904223;
+					src[a] = (uchar)(seed >> 24);
+				}
+
+				ConvertPixelsGeneric (sf, &src[0], df, &expected[0], count);
+				convertPixelsFuncs[sf.bytesPerPixel-1][df.bytesPerPixel-1] (pc, &src[0], &result[0], count);
+
+				uint size = count * df.bytesPerPixel;
+				bool ok = !memcmp (&expected[0], &result[0], size);
+				for (uint a=size;a<result.size();a++)
+					if (result[a] != guard) ok = false;
+
+				numTested++;
+				if (!ok) {
+					logger.Print ("Formats %d -> %d, %d pixels: result differs from the generic conversion\n", s, d, count);
+					numFailed++;
+				}
+			}
 		}
-	}
+
+	logger.Print ("Pixel conversion test: %d of %d conversions equal\n", numTested - numFailed, numTested);
+	return numFailed == 0;
 }
 
 void Image::FillAlpha ()
@@ -639,6 +1022,191 @@ bool Image::GenMipmap (Image *dst)
 	return true;
 }
 
+// ------------------------------ Mipmap chain -------------------------------
+
+/*
+GenMipmaps and ScaleToPow2 filter with 4 floats per pixel, one for each byte of the pixel.
+Colors are converted to linear space with a gamma of 2.2, alpha stays linear.
+With alphaWeighted the colors are premultiplied by alpha while filtering.
+*/
+static const float MipGamma = 2.2f;
+static const int GammaTableSize = 65536;
+
+struct GammaTables
+{
+	GammaTables()
+	{
+		for (int a=0;a<256;a++)
+			toLinear[a] = powf(a / 255.0f, MipGamma);
+		for (int a=0;a<GammaTableSize;a++)
+			toGamma[a] = (uchar)(powf(a / float(GammaTableSize-1), 1.0f / MipGamma) * 255.0f + 0.5f);
+	}
+	float toLinear[256];
+	uchar toGamma[GammaTableSize];
+} static gammaTables;
+
+// 24 or 32 bit with a byte per channel. alphaByte is -1 if there is no alpha.
+static bool GetMipLayout (const ImgFormat& f, int& alphaByte)
+{
+	if (f.bytesPerPixel != 3 && f.bytesPerPixel != 4)
+		return false;
+
+	alphaByte = -1;
+	for (int c=0;c<4;c++) {
+		if (!f.mask[c]) {
+			if (c < 3) return false;
+			continue;
+		}
+		if (f.loss[c] || f.shift[c] % 8 || f.shift[c] / 8 >= f.bytesPerPixel)
+			return false;
+		if (c == 3)
+			alphaByte = f.shift[3] / 8;
+	}
+	return true;
+}
+
+static void ToLinear (Image *img, int alphaByte, bool alphaWeighted, vector<float>& out)
+{
+	uint bpp = img->format.bytesPerPixel;
+	uint n = img->w * img->h;
+	out.resize (n * 4);
+
+	const uchar *src = img->data;
+	float *dst = &out[0];
+	for (uint a=0;a<n;a++, src+=bpp, dst+=4) {
+		float alpha = alphaByte >= 0 ? src[alphaByte] / 255.0f : 1.0f;
+		float scale = alphaWeighted ? alpha : 1.0f;
+		for (int b=0;b<4;b++) {
+			if (b == alphaByte)
+				dst[b] = alpha;
+			else
+				dst[b] = b < (int)bpp ? gammaTables.toLinear[src[b]] * scale : 0.0f;
+		}
+	}
+}
+
+static void FromLinear (const float *src, Image *img, int alphaByte, bool alphaWeighted)
+{
+	uint bpp = img->format.bytesPerPixel;
+	uint n = img->w * img->h;
+
+	uchar *dst = img->data;
+	for (uint a=0;a<n;a++, src+=4, dst+=bpp) {
+		float alpha = alphaByte >= 0 ? src[alphaByte] : 1.0f;
+		float scale = alphaWeighted && alpha > 0.0f ? 1.0f / alpha : 1.0f;
+		for (int b=0;b<(int)bpp;b++) {
+			if (b == alphaByte)
+				dst[b] = (uchar)(alpha * 255.0f + 0.5f);
+			else {
+				float v = min(src[b] * scale, 1.0f);
+				dst[b] = gammaTables.toGamma[(int)(v * (GammaTableSize-1) + 0.5f)];
+			}
+		}
+	}
+}
+
+static inline void Average4 (const float *a, const float *b, const float *c, const float *d, float *out)
+{
+#ifdef IMAGE_USE_SSE2
+	__m128 s = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(a), _mm_loadu_ps(b)), _mm_add_ps(_mm_loadu_ps(c), _mm_loadu_ps(d)));
+	_mm_storeu_ps(out, _mm_mul_ps(s, _mm_set1_ps(0.25f)));
+#else
+	for (int i=0;i<4;i++)
+		out[i] = (a[i] + b[i] + c[i] + d[i]) * 0.25f;
+#endif
+}
+
+// 2x2 box filter, a side of 1 pixel stays 1
+static void HalveLinear (const float *src, int sw, int sh, float *dst)
+{
+	int dw = max(sw/2, 1), dh = max(sh/2, 1);
+	int dx = sw > 1 ? 4 : 0, dy = sh > 1 ? sw*4 : 0;
+
+	for (int y=0;y<dh;y++) {
+		const float *row = src + (sh > 1 ? y*2 : 0) * sw * 4;
+		for (int x=0;x<dw;x++, dst+=4) {
+			const float *p = row + (sw > 1 ? x*2 : 0) * 4;
+			Average4 (p, p + dx, p + dy, p + dx + dy, dst);
+		}
+	}
+}
+
+// Scales one axis with a box filter: every destination pixel is the average of the source area it covers.
+// The pixels of a line are 'step' floats apart, and the lines 'lineStep' floats.
+static void ScaleAxisLinear (const float *src, int srcCount, float *dst, int dstCount, int step, int lines, int srcLineStep, int dstLineStep)
+{
+	float scale = srcCount / float(dstCount);
+	for (int i=0;i<dstCount;i++) {
+		float start = i * scale, end = (i+1) * scale;
+		int first = (int)start, last = min((int)ceilf(end), srcCount);
+
+		for (int l=0;l<lines;l++) {
+			const float *s = src + l * srcLineStep;
+			float *d = dst + l * dstLineStep + i * step;
+			float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+			for (int j=first;j<last;j++) {
+				float weight = min(end, float(j+1)) - max(start, float(j));
+				for (int c=0;c<4;c++)
+					sum[c] += s[j * step + c] * weight;
+			}
+			for (int c=0;c<4;c++)
+				d[c] = sum[c] / scale;
+		}
+	}
+}
+
+static int NearestPow2 (int v)
+{
+	int p = 1;
+	while (p*2 <= v)
+		p *= 2;
+	return v - p > p*2 - v ? p*2 : p;
+}
+
+Image* Image::ScaleToPow2 (bool alphaWeighted)
+{
+	int pw = NearestPow2 (w), ph = NearestPow2 (h);
+	int alphaByte;
+	if ((pw == w && ph == h) || !GetMipLayout (format, alphaByte))
+		return 0;
+
+	vector<float> src, tmp (pw * h * 4), dst (pw * ph * 4);
+	ToLinear (this, alphaByte, alphaWeighted, src);
+	ScaleAxisLinear (&src[0], w, &tmp[0], pw, 4, h, w*4, pw*4);
+	ScaleAxisLinear (&tmp[0], h, &dst[0], ph, pw*4, pw, 4, 4);
+
+	Image *img = new Image (pw, ph, format);
+	FromLinear (&dst[0], img, alphaByte, alphaWeighted);
+	return img;
+}
+
+bool Image::GenMipmaps (vector<Image*>& levels, bool alphaWeighted)
+{
+	int alphaByte;
+	if (w < 1 || h < 1 || (w & (w-1)) || (h & (h-1)) || !GetMipLayout (format, alphaByte))
+		return false;
+
+	// every level is filtered from the linear version of the previous one
+	vector<float> cur, next;
+	ToLinear (this, alphaByte, alphaWeighted, cur);
+
+	int lw = w, lh = h;
+	while (lw > 1 || lh > 1) {
+		int nw = max(lw/2, 1), nh = max(lh/2, 1);
+		next.resize (nw * nh * 4);
+		HalveLinear (&cur[0], lw, lh, &next[0]);
+
+		Image *level = new Image (nw, nh, format);
+		FromLinear (&next[0], level, alphaByte, alphaWeighted);
+		levels.push_back (level);
+
+		cur.swap (next);
+		lw = nw;
+		lh = nh;
+	}
+	return true;
+}
+
 /*
 This function is not intended to actually draw things (it doesn't do any clipping), 
 it is just a way to copy certain parts of an image.
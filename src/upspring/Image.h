@@ -118,6 +118,16 @@ public:
 	// format can be 16 bit (565) or 32 bit (8888)
 	// the image must have proper dimensions (like 256x128 or 64x64)
 	bool GenMipmap (Image *dst); 
+
+	// Creates all mipmap levels below this image, each half the size of the previous one, down to 1x1.
+	// Works for 24 and 32 bit images with power of two sizes, otherwise it returns false.
+	// The colors are averaged in linear space, assuming a gamma of 2.2. alphaWeighted premultiplies them 
+	// by alpha, which is right if alpha is opacity but not for masks like the team color of S3O textures.
+	// The caller deletes the levels.
+	bool GenMipmaps (vector<Image*>& levels, bool alphaWeighted=false);
+	// Returns a copy scaled to the nearest power of two sizes like gluBuild2DMipmaps does, 
+	// or 0 if the sizes already are a power of two or the format isn't supported by GenMipmaps
+	Image* ScaleToPow2 (bool alphaWeighted=false);
 	
 	/* ------------- Inlines ------------- */
 	inline int MemoryUse () 
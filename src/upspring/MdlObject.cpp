@@ -106,7 +106,7 @@ float MdlObject::Selector::Score (Vector3 &pos, float camdis)
 	transform.apply(&Vector3(), &center);
 	float best=(pos-center).length();
 	// it it close to a polygon?
-	for (PolyIterator pi(obj);!pi.End();pi.Next()) {
+	for (ConstPolyIterator pi(obj);!pi.End();pi.Next()) {
 		pi->selector->mesh = pi.Mesh();
 		float polyscore=pi->selector->Score(pos, camdis);
 		if (polyscore < best) best=polyscore;
@@ -138,7 +138,8 @@ MdlObject::MdlObject ()
 
 MdlObject::~MdlObject()
 { 
-	delete geometry;
+	if (geometry)
+		geometry->Release();
 
 	for(uint a=0;a<childs.size();a++)
 		if (childs[a]) delete childs[a];
@@ -148,16 +149,41 @@ MdlObject::~MdlObject()
 	delete csurfobj;
 }
 
+// A CompactPolyMesh is replaced by the equivalent PolyMesh here, so code working with Poly objects can use it.
+// The caller can change the mesh, so it is also copied if it's shared with a clone.
 PolyMesh* MdlObject::GetPolyMesh()
 {
+	CompactPolyMesh *cpm = dynamic_cast<CompactPolyMesh*> (geometry);
+	if (cpm) {
+		geometry = cpm->ToPolyMesh();
+		cpm->Release();
+	} else
+		UnshareGeometry();
+	return dynamic_cast<PolyMesh*> (geometry);
+}
+
+PolyMesh* MdlObject::GetSharedPolyMesh()
+{
+	if (dynamic_cast<CompactPolyMesh*> (geometry))
+		return GetPolyMesh();
 	return dynamic_cast<PolyMesh*> (geometry);
 }
 
+// Clone shares the geometry, the first object that changes it gets its own copy here
+void MdlObject::UnshareGeometry()
+{
+	if (geometry && geometry->IsShared()) {
+		Geometry *cp = geometry->Clone();
+		geometry->Release();
+		geometry = cp;
+	}
+}
+
 PolyMesh* MdlObject::GetOrCreatePolyMesh()
 {
-	if (!dynamic_cast<PolyMesh*>(geometry)) 
+	if (!GetPolyMesh()) 
 	{
-		delete geometry;
+		if (geometry) geometry->Release();
 		geometry = new PolyMesh;
 	}
 	return (PolyMesh*)geometry;
@@ -190,7 +216,7 @@ bool MdlObject::IsEmpty ()
 		if (!childs[a]->IsEmpty())
 			return false;
 
-	PolyMesh *pm = GetPolyMesh();
+	PolyMesh *pm = GetSharedPolyMesh();
 	return pm ? pm->poly.empty() : true;
 }
 
@@ -227,7 +253,8 @@ void MdlObject::GetFullTransform(Matrix& tr)
 		Matrix parentTransform;
 		parent->GetFullTransform(parentTransform);
 
-		tr = parentTransform * tr;
+		// the parent transform is applied after the one of this object, like in ModelDrawer::RenderObject
+		tr *= parentTransform;
 	}
 }
 
@@ -255,29 +282,88 @@ void MdlObject::SetPropertiesFromMatrix(Matrix& transform)
 	rotation.FromMatrix(rotationMatrix);
 }
 
-void MdlObject::Load3DOTextures (TextureHandler *th)
-{
-	if (!bTexturesLoaded) {
-		for (PolyIterator p(this); !p.End(); p.Next())
-		{
-			if (!p->texture && !p->texname.empty()) {
-				p->texture = th->GetTexture (p->texname.c_str());
-				if (p->texture) 
-					p->texture->VideoInit();
-				else
-					p->texname.clear();
+// A CompactPolyMesh keeps its textures in a table, which is filled in without converting the mesh.
+// The textures follow from the names, so a mesh shared with clones can be updated in place.
+static void CollectMissing3DOTextures (MdlObject *o, vector<string>& names)
+{
+	if (!o->bTexturesLoaded) {
+		CompactPolyMesh *cpm = dynamic_cast<CompactPolyMesh*>(o->geometry);
+		if (cpm) {
+			for (uint t=0;t<cpm->texNames.size();t++)
+				if ((t >= cpm->textures.size() || !cpm->textures[t]) && !cpm->texNames[t].empty())
+					names.push_back (cpm->texNames[t]);
+		} else {
+			for (ConstPolyIterator p(o); !p.End(); p.Next())
+				if (!p->texture && !p->texname.empty())
+					names.push_back (p->texname);
+		}
+	}
+
+	for (uint a=0;a<o->childs.size();a++)
+		CollectMissing3DOTextures (o->childs[a], names);
+}
+
+static void Apply3DOTextures (MdlObject *o, TextureHandler *th)
+{
+	if (!o->bTexturesLoaded) {
+		CompactPolyMesh *cpm = dynamic_cast<CompactPolyMesh*>(o->geometry);
+		if (cpm) {
+			cpm->textures.resize (cpm->texNames.size());
+			for (uint t=0;t<cpm->texNames.size();t++)
+			{
+				RefPtr<Texture>& tex = cpm->textures[t];
+				if (!tex && !cpm->texNames[t].empty()) {
+					tex = th->GetTexture (cpm->texNames[t].c_str());
+					if (!tex)
+						cpm->texNames[t].clear();
+					else if (!tex->glIdent)
+						tex->VideoInit();
+				}
+			}
+		} else {
+			for (ConstPolyIterator p(o); !p.End(); p.Next())
+			{
+				if (!p->texture && !p->texname.empty()) {
+					p->texture = th->GetTexture (p->texname.c_str());
+					if (!p->texture) 
+						p->texname.clear();
+					else if (!p->texture->glIdent)
+						p->texture->VideoInit();
+				}
 			}
 		}
-		bTexturesLoaded=true;
+		o->bTexturesLoaded=true;
+		o->InvalidateRenderData();
 	}
 
-	for (uint a=0;a<childs.size();a++)
-		childs[a]->Load3DOTextures (th);
+	for (uint a=0;a<o->childs.size();a++)
+		Apply3DOTextures (o->childs[a], th);
+}
+
+void MdlObject::Load3DOTextures (TextureHandler *th)
+{
+	// decode the missing textures in parallel, the GL uploads happen here on the GL thread
+	vector<string> names;
+	CollectMissing3DOTextures (this, names);
+	if (!names.empty())
+		th->DecodeTextures (names);
+
+	Apply3DOTextures (this, th);
 }
 
 void MdlObject::FlipPolygons()
 {
-	ApplyPolyMeshOperationR(&PolyMesh::FlipPolygons);
+	UnshareGeometry();
+	CompactPolyMesh *cpm = dynamic_cast<CompactPolyMesh*>(geometry);
+	if (cpm) 
+		cpm->FlipPolygons();
+	else {
+		PolyMesh *pm = GetPolyMesh();
+		if (pm) pm->FlipPolygons();
+	}
+
+	for (uint a=0;a<childs.size();a++)
+		childs[a]->FlipPolygons();
 }
 
 
@@ -373,6 +459,7 @@ void MdlObject::NormalizeNormals ()
 
 void MdlObject::TransformVertices (const Matrix& transform)
 {
+	UnshareGeometry();
 	if (geometry)
 		geometry->Transform(transform);
 	InvalidateRenderData();
@@ -393,12 +480,26 @@ void MdlObject::Transform (const Matrix& transform)
 	}
 }
 
+static bool HasSelectedPolygons(Geometry *g)
+{
+	PolyMesh *pm = dynamic_cast<PolyMesh*>(g);
+	if (pm) {
+		for (uint a=0;a<pm->poly.size();a++)
+			if (pm->poly[a]->isSelected) return true;
+	}
+	CompactPolyMesh *cpm = dynamic_cast<CompactPolyMesh*>(g);
+	if (cpm)
+		return cpm->HasSelectedPolys();
+	return false;
+}
+
 MdlObject* MdlObject::Clone()
 {
 	MdlObject *cp = new MdlObject;
 
+	// selection isn't cloned, so only geometry without selected polygons can be shared
 	if (geometry)
-		cp->geometry = geometry->Clone();
+		cp->geometry = HasSelectedPolygons(geometry) ? geometry->Clone() : geometry->Share();
 
 	for (uint a=0;a<childs.size();a++) {
 		MdlObject *ch = childs[a]->Clone();
@@ -433,7 +534,7 @@ void MdlObject::ApproximateOffset()
 {
 	Vector3 mid;
 	int c=0;
-	for (VertexIterator v(this);!v.End();v.Next()) 
+	for (ConstVertexIterator v(this);!v.End();v.Next()) 
 	{
 		mid += v->pos;
 		c++;
@@ -444,6 +545,7 @@ void MdlObject::ApproximateOffset()
 	position += mid;
 	for (VertexIterator v(this);!v.End();v.Next())
 		v->pos -= mid;
+	InvalidateRenderData();
 }
 
 void MdlObject::UnlinkFromParent ()
@@ -489,9 +591,23 @@ void MdlObject::FullMerge ()
 void MdlObject::MergeChild (MdlObject *ch)
 {
 	ch->ApplyTransform(true,true,true);
-	PolyMesh* pm = ch->GetPolyMesh();
-	if (pm)
-		pm->MoveGeometry(GetOrCreatePolyMesh());
+
+	CompactPolyMesh *src = dynamic_cast<CompactPolyMesh*>(ch->geometry);
+	CompactPolyMesh *dst = dynamic_cast<CompactPolyMesh*>(geometry);
+	if (src && (dst || !geometry)) {
+		// both are compact, so the arrays can simply be appended
+		if (dst) {
+			UnshareGeometry();
+			((CompactPolyMesh*)geometry)->Append(src);
+			src->Release();
+		} else
+			geometry = src;
+		ch->geometry = 0;
+	} else {
+		PolyMesh* pm = ch->GetPolyMesh();
+		if (pm)
+			pm->MoveGeometry(GetOrCreatePolyMesh());
+	}
 
 	// move the childs
 	for (uint a=0;a<ch->childs.size();a++) ch->childs[a]->parent = this;
@@ -0,0 +1,221 @@
+//-----------------------------------------------------------------------
+//  Upspring model editor
+//  Copyright 2005 Jelmer Cnossen
+//  This code is released under GPL license, see LICENSE.HTML for info.
+//-----------------------------------------------------------------------
+#include "EditorIncl.h"
+#include "EditorDef.h"
+
+#include "Model.h"
+#include "MeshBatch.h"
+
+// the texture and color state that polygons in one batch share
+struct BatchKey
+{
+	Texture *texture;
+	bool useColor;
+	Vector3 color;
+
+	bool operator<(const BatchKey& k) const {
+		if (texture != k.texture) return texture < k.texture;
+		if (useColor != k.useColor) return useColor < k.useColor;
+		if (color.x != k.color.x) return color.x < k.color.x;
+		if (color.y != k.color.y) return color.y < k.color.y;
+		return color.z < k.color.z;
+	}
+};
+
+// The batches are built through these readers, so PolyMesh and CompactPolyMesh share the code
+struct PolyMeshReader
+{
+	PolyMeshReader(PolyMesh *pm) : pm(pm) {}
+
+	const vector<Vertex>& Verts() { return pm->verts; }
+	uint NumPolys() { return pm->poly.size(); }
+	uint PolySize(uint i) { return pm->poly[i]->verts.size(); }
+	const int* PolyVerts(uint i) { return &pm->poly[i]->verts[0]; }
+	bool HasTexName(uint i) { return !pm->poly[i]->texname.empty(); }
+	Texture* GetTexture(uint i) { return pm->poly[i]->texture.Get(); }
+	const Vector3& Color(uint i) { return pm->poly[i]->color; }
+
+	PolyMesh *pm;
+};
+
+struct CompactPolyMeshReader
+{
+	CompactPolyMeshReader(CompactPolyMesh *cpm) : cpm(cpm) {}
+
+	const vector<Vertex>& Verts() { return cpm->verts; }
+	uint NumPolys() { return cpm->NumPolys(); }
+	uint PolySize(uint i) { return cpm->PolySize(i); }
+	const int* PolyVerts(uint i) { return &cpm->indices[cpm->polyStart[i]]; }
+	bool HasTexName(uint i) {
+		int t = cpm->polyTexture[i];
+		return t >= 0 && !cpm->texNames[t].empty();
+	}
+	Texture* GetTexture(uint i) {
+		int t = cpm->polyTexture[i];
+		return (t >= 0 && t < (int)cpm->textures.size()) ? cpm->textures[t].Get() : 0;
+	}
+	const Vector3& Color(uint i) { return cpm->polyColor[i]; }
+
+	CompactPolyMesh *cpm;
+};
+
+// triangulates a convex polygon as a fan, like GL_POLYGON would draw it.
+// vi can be 0 for a polygon that uses the vertices base...base+count-1
+static uint* AddFan(uint *dst, const int *vi, uint count, uint base)
+{
+	for (uint a=2;a<count;a++) {
+		*dst++ = base + (vi ? vi[0] : 0);
+		*dst++ = base + (vi ? vi[a-1] : a-1);
+		*dst++ = base + (vi ? vi[a] : a);
+	}
+	return dst;
+}
+
+void MeshBatch::Clear()
+{
+	vertices.clear();
+	indices.clear();
+	batches.clear();
+	mapping = -1;
+	numVerts = numPolys = 0;
+}
+
+bool MeshBatch::IsBuiltFrom(PolyMesh *pm, int mapping)
+{
+	return this->mapping == mapping && numVerts == pm->verts.size() && numPolys == pm->poly.size();
+}
+
+bool MeshBatch::IsBuiltFrom(CompactPolyMesh *cpm, int mapping)
+{
+	return this->mapping == mapping && numVerts == cpm->verts.size() && numPolys == (uint)cpm->NumPolys();
+}
+
+void MeshBatch::Build(PolyMesh *pm, int mapping)
+{
+	PolyMeshReader mesh(pm);
+	BuildMesh(mesh, mapping);
+}
+
+void MeshBatch::Build(CompactPolyMesh *cpm, int mapping)
+{
+	CompactPolyMeshReader mesh(cpm);
+	BuildMesh(mesh, mapping);
+}
+
+template<typename Mesh> void MeshBatch::BuildMesh(Mesh& mesh, int mapping)
+{
+	Clear();
+
+	this->mapping = mapping;
+	numVerts = mesh.Verts().size();
+	numPolys = mesh.NumPolys();
+
+	if (mapping == MAPPING_3DO)
+		Build3DO(mesh);
+	else
+		BuildS3O(mesh);
+}
+
+template<typename Mesh> void MeshBatch::BuildS3O(Mesh& mesh)
+{
+	const vector<Vertex>& verts = mesh.Verts();
+	vertices.resize(verts.size());
+	for (uint a=0;a<verts.size();a++) {
+		const Vertex& v = verts[a];
+		vertices[a].pos = v.pos;
+		vertices[a].normal = v.normal;
+		vertices[a].tc = v.tc[0];
+	}
+
+	uint numIndices = 0;
+	for (uint a=0;a<mesh.NumPolys();a++) {
+		uint n = mesh.PolySize(a);
+		if (n >= 3) numIndices += (n-2)*3;
+	}
+
+	indices.resize(numIndices);
+	uint *dst = numIndices ? &indices[0] : 0;
+	for (uint a=0;a<mesh.NumPolys();a++) {
+		uint n = mesh.PolySize(a);
+		if (n >= 3)
+			dst = AddFan(dst, mesh.PolyVerts(a), n, 0);
+	}
+
+	Batch b;
+	b.texture = 0;
+	b.useColor = false;
+	b.firstIndex = 0;
+	b.numIndices = numIndices;
+	batches.push_back(b);
+}
+
+template<typename Mesh> void MeshBatch::Build3DO(Mesh& mesh)
+{
+	// assign every polygon to a batch, batches are numbered in the order they are first used
+	map<BatchKey, int> keys;
+	vector<int> polyBatch(mesh.NumPolys(), -1);
+	uint numVertices = 0;
+
+	for (uint a=0;a<mesh.NumPolys();a++) {
+		uint n = mesh.PolySize(a);
+		if (n < 3) continue;
+
+		// same rules as ModelDrawer::RenderPolygon: only triangles and quads are textured,
+		// and the polygon color is only used when there is no texture name
+		BatchKey k;
+		k.useColor = !mesh.HasTexName(a);
+		k.texture = (!k.useColor && (n==3 || n==4)) ? mesh.GetTexture(a) : 0;
+		k.color = k.useColor ? mesh.Color(a) : Vector3(1.0f,1.0f,1.0f);
+
+		map<BatchKey, int>::iterator ki = keys.find(k);
+		if (ki == keys.end()) {
+			Batch b;
+			b.texture = k.texture;
+			b.useColor = k.useColor;
+			b.color = k.color;
+			b.firstIndex = b.numIndices = 0;
+			ki = keys.insert(make_pair(k, (int)batches.size())).first;
+			batches.push_back(b);
+		}
+		polyBatch[a] = ki->second;
+		batches[ki->second].numIndices += (n-2)*3;
+		numVertices += n;
+	}
+
+	uint numIndices = 0;
+	vector<uint*> cursor(batches.size());
+	for (uint a=0;a<batches.size();a++) {
+		batches[a].firstIndex = numIndices;
+		numIndices += batches[a].numIndices;
+	}
+	indices.resize(numIndices);
+	for (uint a=0;a<batches.size();a++)
+		cursor[a] = numIndices ? &indices[0] + batches[a].firstIndex : 0;
+
+	// every polygon corner gets its own vertex, since 3DO texture coordinates are per polygon
+	static const float tc[] = {  0.0f,1.0f,  1.0f, 1.0f,   1.0f,0.0f, 0.0f,0.0f};
+	const vector<Vertex>& verts = mesh.Verts();
+	vertices.resize(numVertices);
+	uint first = 0;
+	for (uint a=0;a<mesh.NumPolys();a++) {
+		if (polyBatch[a] < 0) continue;
+
+		const int *vi = mesh.PolyVerts(a);
+		uint n = mesh.PolySize(a);
+		bool quadTC = (n==3 || n==4);
+		for (uint b=0;b<n;b++) {
+			const Vertex& v = verts[vi[b]];
+			BatchVertex& bv = vertices[first+b];
+			bv.pos = v.pos;
+			bv.normal = v.normal;
+			if (quadTC) bv.tc = Vector2(tc[b*2], tc[b*2+1]);
+			else bv.tc = Vector2(0.0f, 0.0f);
+		}
+
+		cursor[polyBatch[a]] = AddFan(cursor[polyBatch[a]], 0, n, first);
+		first += n;
+	}
+}
@@ -0,0 +1,60 @@
+//-----------------------------------------------------------------------
+//  Upspring model editor
+//  Copyright 2005 Jelmer Cnossen
+//  This code is released under GPL license, see LICENSE.HTML for info.
+//-----------------------------------------------------------------------
+#ifndef UPS_MESH_BATCH_H
+#define UPS_MESH_BATCH_H
+
+class PolyMesh;
+class CompactPolyMesh;
+class Texture;
+
+struct BatchVertex
+{
+	Vector3 pos, normal;
+	Vector2 tc;
+};
+
+/*
+Triangulated copy of a PolyMesh or CompactPolyMesh, laid out the way glDrawElements wants it: one interleaved
+vertex array and triangle indices grouped in batches that share the same texture and color.
+Building it makes no GL calls, so it can be done and checked without a window.
+
+With S3O mapping everything ends up in a single batch that uses the mesh vertices as they are.
+With 3DO mapping every polygon corner gets its own vertex, as the texture coordinates
+are defined per polygon, and polygons are grouped by their texture or color.
+*/
+struct MeshBatch
+{
+	struct Batch {
+		Texture *texture; // 3DO mapping only: texture to bind, 0 for none
+		bool useColor; // 3DO mapping only: polygon has no texture name, so it is drawn with 'color'
+		Vector3 color;
+		uint firstIndex, numIndices;
+	};
+
+	MeshBatch() { Clear(); }
+
+	void Build(PolyMesh *pm, int mapping);
+	void Build(CompactPolyMesh *cpm, int mapping);
+	void Clear();
+	// false if the mesh changed in size or mapping since the last Build
+	bool IsBuiltFrom(PolyMesh *pm, int mapping);
+	bool IsBuiltFrom(CompactPolyMesh *cpm, int mapping);
+
+	vector<BatchVertex> vertices;
+	vector<uint> indices;
+	vector<Batch> batches;
+
+	int mapping;
+	uint numVerts, numPolys; // size of the mesh at the time of Build
+
+protected:
+	// Mesh is one of the polygon readers in MeshBatch.cpp
+	template<typename Mesh> void BuildMesh(Mesh& mesh, int mapping);
+	template<typename Mesh> void BuildS3O(Mesh& mesh);
+	template<typename Mesh> void Build3DO(Mesh& mesh);
+};
+
+#endif
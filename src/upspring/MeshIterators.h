@@ -1,3 +1,5 @@
+// PolyIterator and VertexIterator allow changes, so a mesh shared with clones is copied first (see MdlObject::GetPolyMesh).
+// Loops that only read use ConstPolyIterator and ConstVertexIterator, which don't copy it.
 class PolyIterator
 {
 public:
@@ -9,6 +11,7 @@ public:
 	PolyIterator(PolyMesh *m)
 	{
 		mesh = m;
+		pos=0;
 	}
 
 	Poly* Get() { return mesh ? mesh->poly [pos] : 0; }
@@ -31,7 +34,7 @@ class ConstPolyIterator : public PolyIterator
 {
 	bool own;
 public:
-	ConstPolyIterator(MdlObject *o) : PolyIterator(o)
+	ConstPolyIterator(MdlObject *o) : PolyIterator(o->GetSharedPolyMesh())
 	{ 
 		own = false;
 		if(!mesh && o->geometry) {
@@ -55,6 +58,11 @@ public:
 		mesh = o->GetPolyMesh();
 		pos = 0;
 	}
+	VertexIterator(PolyMesh *m)
+	{
+		mesh = m;
+		pos = 0;
+	}
 
 	bool End() { return !mesh || (uint)pos >= mesh->verts.size(); }
 	void Next() { pos ++; }
@@ -68,6 +76,12 @@ protected:
 	PolyMesh *mesh;
 };
 
+class ConstVertexIterator : public VertexIterator
+{
+public:
+	ConstVertexIterator(MdlObject *o) : VertexIterator(o->GetSharedPolyMesh()) {}
+};
+
 
 
 #define TEMPLATE template<typename ObjIterator, typename ObjT, typename MemberContainerT>
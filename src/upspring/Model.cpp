@@ -20,6 +20,8 @@
 #include "CurvedSurface.h"
 
 #include "MeshIterators.h"
+#include "ThreadPool.h"
+#include "VertexHashGrid.h"
 
 // ------------------------------------------------------------------------------------------------
 // Register model types
@@ -78,6 +80,21 @@ CR_REG_METADATA(PolyMesh,
 	CR_MEMBER(verts))
 );
 
+CR_BIND_DERIVED(CompactPolyMesh, Geometry, ())
+CR_REG_METADATA(CompactPolyMesh,
+(
+	CR_MEMBER(verts),
+	CR_MEMBER(polyStart),
+	CR_MEMBER(indices),
+	CR_MEMBER(polyColor),
+	CR_MEMBER(polyTAColor),
+	CR_MEMBER(polyTexture),
+	CR_MEMBER(polyFlags),
+	CR_MEMBER(texNames),
+	CR_MEMBER(textures),
+	CR_MEMBER_SETFLAG(textures, CM_NoSerialize))
+);
+
 
 // MdlObject
 CR_BIND(MdlObject, ());
@@ -186,24 +203,35 @@ Model* Model::Load(const string& _fn, bool Optimize, IProgressCtl& progctl) {
 		else if (!STRCASECMP(ext, ".obj"))
 			r = (mdl->root = LoadWavefrontObject(fn, progctl)) != 0;
 		else {
-			fltk::message ("Unknown extension %s\n", fltk::filename_ext(fn));
+			logger.Trace (NL_Error, "Unknown extension %s\n", fltk::filename_ext(fn));
 			delete mdl;
-			return false;
+			return 0;
 		}
 		if (!r) {
 			delete mdl;
 			mdl = 0;
 		}
+		else if (Optimize) {
+			vector<MdlObject*> objlist = mdl->GetObjectList();
+			for (uint a=0;a<objlist.size();a++) {
+				CompactPolyMesh *cpm = dynamic_cast<CompactPolyMesh*>(objlist[a]->geometry);
+				if (cpm)
+					cpm->Optimize(&PolyMesh::IsEqualVertexTCNormal);
+				else if (objlist[a]->GetPolyMesh())
+					objlist[a]->GetPolyMesh()->Optimize(&PolyMesh::IsEqualVertexTCNormal);
+			}
+		}
 	}
 	catch (std::runtime_error err)
 	{
-		fltk::message (err.what());
-		return false;
+		logger.Trace (NL_Error, "%s\n", err.what());
+		delete mdl;
+		return 0;
 	}
 	if (mdl)
 		return mdl;
 	else {
-		fltk::message ("Failed to read file %s:\n",fn);
+		logger.Trace (NL_Error, "Failed to read file %s\n",fn);
 		return 0;
 	}
 }
@@ -215,7 +243,7 @@ bool Model::Save(Model* mdl, const string& _fn, IProgressCtl& progctl)
 	const char *ext=fltk::filename_ext(fn);
 
 	if (!mdl->root) {
-		fltk::message ("No objects");
+		logger.Trace (NL_Error, "No objects\n");
 		return false;
 	}
 
@@ -229,9 +257,9 @@ bool Model::Save(Model* mdl, const string& _fn, IProgressCtl& progctl)
 	else if( !STRCASECMP(ext, ".obj"))
 		r = SaveWavefrontObject(fn, mdl->root, progctl);
 	else
-		fltk::message ("Unknown extension %s\n", fltk::filename_ext(fn));
+		logger.Trace (NL_Error, "Unknown extension %s\n", fltk::filename_ext(fn));
 	if (!r) {
-		fltk::message ("Failed to save file %s\n", fn);
+		logger.Trace (NL_Error, "Failed to save file %s\n", fn);
 	}
 	return r;
 }
@@ -317,7 +345,7 @@ static void AddPositions (MdlObject *o, Vector3& p,int &count) {
 	Matrix transform;
 	o->GetTransform(transform);
 
-	for (VertexIterator v(o);!v.End();v.Next()) {
+	for (ConstVertexIterator v(o);!v.End();v.Next()) {
 		Vector3 temp;
 		transform.apply (&v->pos, &temp);
 		p += temp;
@@ -346,7 +374,6 @@ void Model::CalculateRadius ()
 	radius=0.0f;
 	for (uint o=0;o<objs.size();o++) {
 		MdlObject *obj = objs[o];
-		PolyMesh *pm = obj->GetPolyMesh();
 		Matrix objTransform;
 		obj->GetFullTransform(objTransform);
 		if (obj->geometry)
@@ -377,6 +404,7 @@ bool Model::ExportUVMesh (const char *fn)
 bool Model::ImportUVMesh(const char *fn, IProgressCtl& progctl) {
 	Model *mdl;
 	mdl = Model::Load(fn, false);// an unoptimized mesh so the vertices are not merged
+	if (!mdl)
 		return false;
 
 	if (!ImportUVCoords(mdl, progctl)) {
@@ -388,103 +416,201 @@ bool Model::ImportUVMesh(const char *fn, IProgressCtl& progctl) {
 }
 
 
-int MatchPolygon (MdlObject *root, vector<Vector3>& pverts, int& startVertex)
+/*
+The polygons of the UV mesh are kept in a hash grid by their center, together with their plane.
+All vertices of a matching polygon are within EPSILON of the vertices of the polygon it matches, 
+so the centers are within EPSILON as well, and only the polygons around the center have to be compared.
+The vertices are transformed like those of the model, so the root of the UV mesh doesn't have to be at the origin.
+*/
+struct UVSource
+{
+	UVSource (MdlObject *root) : pm(root ? root->GetSharedPolyMesh() : 0), grid (pm ? (uint)pm->poly.size() : 0, EPSILON)
+	{
+		if (!pm)
+			return;
+
+		Matrix transform;
+		root->GetFullTransform (transform);
+		pos.resize (pm->verts.size());
+		for (uint a=0;a<pm->verts.size();a++)
+			transform.apply (&pm->verts[a].pos, &pos[a]);
+
+		planes.resize (pm->poly.size());
+		for (uint a=0;a<pm->poly.size();a++) {
+			Poly *pl = pm->poly[a];
+			Vector3 center;
+			for (uint v=0;v<pl->verts.size();v++)
+				center += pos[pl->verts[v]];
+			if (pl->verts.size() >= 3) {
+				center *= 1.0f / pl->verts.size();
+				planes[a].MakePlane (pos[pl->verts[0]], pos[pl->verts[1]], pos[pl->verts[2]]);
+			}
+			grid.Add (center, a);
+		}
+	}
+
+	PolyMesh *pm;
+	vector<Vector3> pos; // transformed vertex positions
+	vector<Plane> planes;
+	VertexHashGrid grid;
+};
+
+struct UVPolyMatch
 {
-	int index = 0;
-	for (PolyIterator pi(root); !pi.End();pi.Next(),index++) {
-		Poly *pl = *pi;
+	UVPolyMatch (UVSource& src, vector<Vector3>& pverts, Plane& plane) : src(src), pverts(pverts), plane(plane), startVertex(0) {}
 
-		if (pl->verts.size() != pverts.size() || !pi.verts())
-			continue;
+	bool operator()(int index)
+	{
+		Poly *pl = src.pm->poly[index];
+		vector<Vector3>& pos = src.pos;
 
 		// An early out plane comparision, will also make sure that "double-sided" polgyon pairs
 		// are handled correctly
-		Plane plane = pl->CalcPlane (*pi.verts());
-		Plane tplane;
-		tplane.MakePlane (pverts[0],pverts[1],pverts[2]);
-		
-		if (!plane.EpsilonCompare(tplane, EPSILON))
-			continue;
+		if (pl->verts.size() != pverts.size() || !src.planes[index].EpsilonCompare (plane, EPSILON))
+			return false;
 
 		// in case the polygon vertices have been reordered, 
 		// this takes care of finding "the first" vertex again
 		uint startv = 0;
 		for (;startv < pverts.size();startv++) {
-			if (( (*pi.verts())[pl->verts [0]].pos-pverts[startv]).length () < EPSILON)
+			if ((pos[pl->verts[0]] - pverts[startv]).length () < EPSILON)
 				break;
 		}
 		// no start vertex has been found
 		if (startv == pverts.size())
-			continue;
+			return false;
 
 		// compare the polygon vertices with eachother... 
-		uint v = 0;
-		for (;v<pverts.size();v++) {
-			if (( (*pi.verts())[pl->verts[v]].pos - pverts[(v+startv)%pverts.size()]).length () >= EPSILON)
-				break;
-		}
-		if (v==pverts.size()) {
-			startVertex = (int)startv;
-			return index;
+		for (uint v=0;v<pverts.size();v++) {
+			if ((pos[pl->verts[v]] - pverts[(v+startv)%pverts.size()]).length () >= EPSILON)
+				return false;
 		}
+		// FindFirst only tries lower indices after a match, so the last match is the one it returns
+		startVertex = (int)startv;
+		return true;
 	}
-	return -1;
-}
 
-bool Model::ImportUVCoords(Model* other, IProgressCtl &progctl) {
-	vector <MdlObject*> objects=GetObjectList ();
-	MdlObject *srcobj = other->root;
+	UVSource& src;
+	vector<Vector3>& pverts;
+	Plane& plane;
+	int startVertex;
+};
 
-	vector <Vector3> pverts;
+// Copies the texture coordinates of the matching UV mesh polygons to the polygons of an object
+struct ImportObjectUVs
+{
+	ImportObjectUVs (vector<MdlObject*> *objects, vector<PolyMesh*> *meshes, UVSource *src, vector<int> *unmatched) 
+		: objects(objects), meshes(meshes), src(src), unmatched(unmatched), first(0) {}
 
-	int numPl = 0, curPl=0;
-	for (uint a=0;a<objects.size();a++) {
-		PolyMesh *pm = objects[a]->GetPolyMesh();
-		if (pm)
-			numPl += pm->poly.size();
-	}
-	
-	for (uint a=0;a<objects.size();a++) {
-		MdlObject *obj = objects[a];
+	void operator()(int index)
+	{
+		index += first;
+		PolyMesh *pm = (*meshes)[index];
 		Matrix objTransform;
-		obj->GetFullTransform(objTransform);
-		PolyMesh *pm = obj->GetPolyMesh();
+		(*objects)[index]->GetFullTransform(objTransform);
 
 		// give each polygon an independent set of vertices, this will be optimized back to normal later
 		vector <Vertex> nverts;
-		for (PolyIterator pi(obj);!pi.End();pi.Next()) {
-			for (uint v=0;v<pi->verts.size();v++) {
-				nverts.push_back (pm->verts[pi->verts[v]]);
-				pi->verts[v]=nverts.size()-1;
+		for (uint a=0;a<pm->poly.size();a++) {
+			Poly *pl = pm->poly[a];
+			for (uint v=0;v<pl->verts.size();v++) {
+				nverts.push_back (pm->verts[pl->verts[v]]);
+				pl->verts[v]=nverts.size()-1;
 			}
 		}
-		pm->verts=nverts;
+		pm->verts.swap (nverts);
 
 		// match our polygons with the ones of the other model
-		for (PolyIterator pi(obj);!pi.End();pi.Next()) {
+		vector <Vector3> pverts;
+		int count = 0;
+		for (uint a=0;a<pm->poly.size();a++) {
+			Poly *pl = pm->poly[a];
+			Vector3 center;
 			pverts.clear();
-			for (uint pv=0;pv<pi->verts.size();pv++) {
+			for (uint pv=0;pv<pl->verts.size();pv++) {
 				Vector3 tpos;
-				objTransform.apply (&pm->verts [pi->verts[pv]].pos, &tpos);
+				objTransform.apply (&pm->verts [pl->verts[pv]].pos, &tpos);
 				pverts.push_back (tpos);
+				center += tpos;
+			}
+			if (pverts.size() < 3) {
+				count ++;
+				continue;
+			}
+			center *= 1.0f / pverts.size();
+
+			Plane plane;
+			plane.MakePlane (pverts[0],pverts[1],pverts[2]);
+			UVPolyMatch match (*src, pverts, plane);
+			int bestpl = src->grid.FindFirst (center, match);
+			if (bestpl < 0) {
+				count ++;
+				continue;
 			}
 
-			int startVertex;
-			int bestpl = MatchPolygon (srcobj,pverts,startVertex);
-			PolyMesh *srcpm = srcobj->GetPolyMesh();
-			if (bestpl >= 0) {
-				// copy texture coordinates from rt->poly[bestpl] to pl
-				Poly *src = srcpm->poly [bestpl];
-				for (uint v=0;v<src->verts.size();v++) {
-					Vertex &dstvrt = pm->verts[pi->verts[(v + startVertex)%pi->verts.size()]];
-					dstvrt.tc[0] = srcpm->verts[src->verts[v]].tc[0];
-				}
+			// copy texture coordinates from the matching polygon to pl
+			Poly *srcpl = src->pm->poly [bestpl];
+			for (uint v=0;v<srcpl->verts.size();v++) {
+				Vertex &dstvrt = pm->verts[pl->verts[(v + match.startVertex)%pl->verts.size()]];
+				dstvrt.tc[0] = src->pm->verts[srcpl->verts[v]].tc[0];
 			}
+		}
+		(*unmatched)[index] = count;
+	}
+
+	vector<MdlObject*> *objects;
+	vector<PolyMesh*> *meshes;
+	UVSource *src;
+	vector<int> *unmatched;
+	int first; // the objects are done in batches, index is relative to the batch
+};
+
+bool Model::ImportUVCoords(Model* other, IProgressCtl &progctl) {
+	vector <MdlObject*> objects=GetObjectList ();
+
+	// GetPolyMesh can replace the geometry, so the meshes are taken here and not on the worker threads
+	UVSource src (other->root);
 
-			progctl.Update ((float)(curPl++) / numPl);
+	vector <MdlObject*> meshObjects;
+	vector <PolyMesh*> meshes;
+	int numPl = 0, curPl=0;
+	for (uint a=0;a<objects.size();a++) {
+		PolyMesh *pm = objects[a]->GetPolyMesh();
+		if (pm) {
+			meshObjects.push_back (objects[a]);
+			meshes.push_back (pm);
+			numPl += pm->poly.size();
+		}
+	}
+	if (meshes.empty())
+		return true;
+
+	vector <int> unmatched (meshes.size(), 0);
+	ImportObjectUVs import (&meshObjects, &meshes, &src, &unmatched);
+	ThreadPool pool (min ((int)meshes.size(), ThreadPool::GetProcessorCount()));
+
+	// one object per thread at a time, progctl can only be updated from this thread
+	for (uint first=0;first<meshes.size();first+=pool.NumThreads()) {
+		int count = min ((int)(meshes.size() - first), pool.NumThreads());
+		import.first = first;
+		pool.For (count, import);
+
+		for (int a=0;a<count;a++) {
+			meshObjects[first+a]->InvalidateRenderData();
+			curPl += meshes[first+a]->poly.size();
 		}
-		obj->InvalidateRenderData();
+		progctl.Update ((float)curPl / numPl);
+	}
+
+	int totalUnmatched = 0;
+	for (uint a=0;a<meshes.size();a++) {
+		if (unmatched[a] > 0)
+			logger.Trace (NL_Warn, "No UV mesh polygon found for %d of %d polygons in object %s\n", 
+				unmatched[a], (int)meshes[a]->poly.size(), meshObjects[a]->name.c_str());
+		totalUnmatched += unmatched[a];
 	}
+	if (totalUnmatched > 0)
+		logger.Trace (NL_Warn, "%d of %d polygons kept their old texture coordinates\n", totalUnmatched, numPl);
 
 	return true;
 }
@@ -514,6 +640,16 @@ vector<PolyMesh*> Model::GetPolyMeshList ()
 	return pmlist;
 }
 
+vector<PolyMesh*> Model::GetSharedPolyMeshList ()
+{
+	vector<MdlObject*> objlist = GetObjectList();
+	vector<PolyMesh*> pmlist;
+	for (uint a=0;a<objlist.size();a++)
+		if (objlist[a]->GetSharedPolyMesh ())
+			pmlist.push_back (objlist[a]->GetSharedPolyMesh());
+	return pmlist;
+}
+
 Model* Model::LoadOPK(const char *filename, IProgressCtl& progctl) {
 	creg::CInputStreamSerializer s;
 	Model *mdl = 0;
@@ -551,6 +687,13 @@ bool Model::SaveOPK(Model* mdl, const char *filename, IProgressCtl& progctl)
 // loads textures after a creg read serialization
 void Model::PostLoad()
 {
+	// objects that shared geometry when saved point to the same one again
+	vector<MdlObject*> objs = GetObjectList();
+	for (uint a=0;a<objs.size();a++)
+		if (objs[a]->geometry) objs[a]->geometry->shareCount = 0;
+	for (uint a=0;a<objs.size();a++)
+		if (objs[a]->geometry) objs[a]->geometry->shareCount++;
+
 	for (uint t=0;t<texBindings.size();t++)
 	{
 		if(texBindings[t].name.empty())
@@ -601,6 +744,14 @@ uint Vector3ToRGB(Vector3 v)
 	return (uint(v.x * 255.0f) << 16) | (uint(v.y * 255.0f) << 8) | (uint(v.z * 255.0f) << 0);
 }
 
+// The atlas grows up to this size if the textures don't fit in the size that was asked for
+static const int MaxS3OTextureSize = 4096;
+
+static bool TextureNameLess (Texture *a, Texture *b)
+{
+	return a->name < b->name;
+}
+
 bool Model::ConvertToS3O(std::string textureName, int texw, int texh)
 {
 	// collect all textures used by the model
@@ -631,34 +782,31 @@ bool Model::ConvertToS3O(std::string textureName, int texw, int texh)
 		}
 	}
 
-	TextureBinTree tree;
-	ImgFormat fmt (ImgFormat::RGB);
-	tree.Init (texw,texh,&fmt);
+	Timer timer;
+	TextureAtlas atlas (ImgFormat(ImgFormat::RGB));
 
-	std::map <Texture*, TextureBinTree::Node *> texToNode;
+	// added in name order, so the result doesn't depend on the addresses in the set
+	vector<Texture*> sorted (textures.begin(), textures.end());
+	sort (sorted.begin(), sorted.end(), TextureNameLess);
 
-	for (std::set<Texture*>::iterator ti = textures.begin(); ti != textures.end(); ++ti)
-	{
-		Image conv;
-		conv.format = ImgFormat(ImgFormat::RGB);
-		(*ti)->image->Convert (&conv);
-		//conv.Save ( (textureLocation + (*ti)->name + "_test.bmp").c_str());
-		TextureBinTree::Node *node = tree.AddNode (&conv);
-
-		if (!node) {
-			fltk::message ("Not enough texture space for all 3DO textures.");
-			return false;
-		}
+	std::map <Texture*, int> texToIndex;
+	for (uint a=0;a<sorted.size();a++)
+		texToIndex [sorted[a]] = atlas.Add (sorted[a]->image.Get());
 
-		texToNode [*ti] = node;
+	if (!atlas.Pack (texw, texh, MaxS3OTextureSize, true)) {
+		// also used by BatchConvertToS3O on worker threads, so no fltk::message
+		logger.Trace (NL_Error, "Not enough texture space for all 3DO textures, even in a %dx%d texture.\n", MaxS3OTextureSize, MaxS3OTextureSize);
+		return false;
 	}
-	
-	Image *res = tree.GetResult();
+	logger.Print ("Packed %d textures (%d different) in a %dx%d texture, %d%% used, %u ms\n", (int)sorted.size(), 
+		atlas.NumImages(), atlas.Width(), atlas.Height(), (int)(atlas.Occupancy() * 100.0f + 0.5f), timer.GetTicks());
+
+	Image *res = atlas.CreateImage();
 	res->Save ( textureName.c_str() );
 
 	mapping = MAPPING_S3O;
 	Texture *nt = new Texture();
-	nt->SetImage (res->Clone());
+	nt->SetImage (res);
 	nt->name = textureName;
 
 	SetTexture(0, nt);
@@ -674,7 +822,7 @@ bool Model::ConvertToS3O(std::string textureName, int texw, int texh)
 		for (uint a=0;a<pm->poly.size();a++)
 		{
 			Poly *pl = pm->poly[a];
-			TextureBinTree::Node *tnode = texToNode[pl->texture.Get()];
+			int tindex = texToIndex[pl->texture.Get()];
 
 			if (pl->verts.size() <= 4) {
 				const float tc[] = { 0.0f,1.0f,  1.0f, 1.0f,   1.0f,0.0f, 0.0f,0.0f};
@@ -682,9 +830,8 @@ bool Model::ConvertToS3O(std::string textureName, int texw, int texh)
 				for (uint v=0;v<pl->verts.size();v++) {
 					vertices.push_back (pm->verts [pl->verts[v]]);
 					Vertex& vrt = vertices.back();
-					// convert to texturebintree UV coords:
-					vrt.tc[0].x = tree.GetU (tnode, tc[v*2+0]);
-					vrt.tc[0].y = tree.GetV (tnode, tc[v*2+1]);
+					// convert to atlas UV coords:
+					atlas.MapUV (tindex, tc[v*2+0], tc[v*2+1], vrt.tc[0].x, vrt.tc[0].y);
 
 					pl->verts[v] = vertices.size()-1;
 				}
@@ -151,14 +151,25 @@ public:
 };
 
 class PolyMesh;
+class PolyMeshBVH;
 class ModelDrawer;
 
+/*
+Geometry is shared between an object and its clones until one of them changes it, see
+MdlObject::UnshareGeometry. The owners call Release instead of deleting it.
+*/
 class Geometry
 {
 public:
 	CR_DECLARE(Geometry);
 
+	Geometry() { shareCount = 1; }
+	Geometry(const Geometry&) { shareCount = 1; } // a copy isn't shared yet
 	virtual ~Geometry() {}
+
+	Geometry* Share() { shareCount++; return this; }
+	void Release() { if (--shareCount == 0) delete this; }
+	bool IsShared() { return shareCount > 1; }
 	
 	virtual void Draw(ModelDrawer *drawer, Model* mdl, MdlObject* o) = 0;
 	virtual Geometry* Clone() = 0;
@@ -167,6 +178,8 @@ public:
 	virtual void InvalidateRenderData() {}
 
 	virtual void CalculateRadius(float& radius, const Matrix &tr, const Vector3& mid) = 0;
+
+	int shareCount; // number of objects using this geometry
 };
 
 class PolyMesh : public Geometry
@@ -174,6 +187,7 @@ class PolyMesh : public Geometry
 public:
 	CR_DECLARE(PolyMesh);
 
+	PolyMesh();
 	~PolyMesh();
 
 	vector <Vertex> verts;
@@ -197,6 +211,65 @@ public:
 	void CalculateRadius (float& radius, const Matrix &tr, const Vector3& mid);
 	void CalculateNormals ();
 	void CalculateNormals2 (float maxSmoothAngle);
+	void InvalidateRenderData();
+
+	// Code (and scripts) changing verts or poly directly have to call InvalidateRenderData afterwards,
+	// the caches only notice changes in the number of vertices or polygons by themselves
+	IRenderData *renderData; // drawing cache of the ModelDrawer, not copied by Clone
+	PolyMeshBVH *bvh; // picking data, see Picking.h. Also deleted by InvalidateRenderData
+};
+
+/*
+Polygon mesh stored in flat arrays: the vertex indices of polygon i are indices[polyStart[i]] up to
+indices[polyStart[i+1]], and the other polygon attributes are kept in parallel arrays. Textures are
+stored once per mesh and referred to by index. Cloning, merging and saving such a mesh only copies
+a few arrays, while a PolyMesh allocates a Poly object (and its selector) for every face.
+The model loaders create these, and MdlObject::GetPolyMesh() converts one to a PolyMesh in place
+the first time code needs to work with Poly objects. Drawing and object picking use the arrays directly.
+*/
+class CompactPolyMesh : public Geometry
+{
+public:
+	CR_DECLARE(CompactPolyMesh);
+
+	CompactPolyMesh();
+	CompactPolyMesh(const CompactPolyMesh& src); // the caches aren't copied
+	~CompactPolyMesh();
+	CompactPolyMesh& operator=(const CompactPolyMesh& src);
+
+	enum { PF_Selected=1, PF_Curved=2 };
+
+	vector <Vertex> verts;
+	vector <int> polyStart; // NumPolys()+1 entries, the last one is indices.size()
+	vector <int> indices;
+	vector <Vector3> polyColor;
+	vector <int> polyTAColor;
+	vector <int> polyTexture; // index into texNames/textures, -1 for no texture
+	vector <char> polyFlags;
+
+	vector <string> texNames;
+	vector <RefPtr<Texture> > textures;
+
+	int NumPolys() { return (int)polyStart.size() - 1; }
+	int PolySize(int i) { return polyStart[i+1] - polyStart[i]; }
+	int AddTexture(const string& name, Texture *tex); // returns the index of an existing entry if there is one
+	void AddPoly(const int *vi, int count, int texture=-1); // white polygon without TA color
+	void Append(CompactPolyMesh *src); // adds a copy of the polygons and vertices of src
+	void FlipPolygons(); // same vertex order as Poly::Flip
+	void Optimize(PolyMesh::IsEqualVertexCB cb);
+	bool HasSelectedPolys();
+
+	static CompactPolyMesh* FromPolyMesh(PolyMesh *pm);
+
+	void Draw(ModelDrawer* drawer, Model* mdl, MdlObject* o);
+	Geometry* Clone();
+	void Transform(const Matrix& transform);
+	PolyMesh* ToPolyMesh(); // returns a new PolyMesh
+	void CalculateRadius(float& radius, const Matrix &tr, const Vector3& mid);
+	void InvalidateRenderData();
+
+	IRenderData *renderData; // drawing cache of the ModelDrawer, like PolyMesh::renderData
+	PolyMeshBVH *bvh; // object picking data. Also deleted by InvalidateRenderData
 };
 
 
@@ -251,6 +324,9 @@ struct MdlObject {
 	void RemoveChild(MdlObject *o);
 
 	PolyMesh* GetPolyMesh();
+	// Like GetPolyMesh, but a PolyMesh that is shared with clones is not copied, so only use it to read
+	PolyMesh* GetSharedPolyMesh();
+	void UnshareGeometry(); // call before changing the geometry directly
 	PolyMesh* ToPolyMesh() { return geometry ? geometry->ToPolyMesh() : 0; } // returns a new PolyMesh
 	PolyMesh* GetOrCreatePolyMesh();
 
@@ -365,6 +441,7 @@ struct Model {
 	vector<MdlObject*> GetSelectedObjects();
 	vector<MdlObject*> GetObjectList(); // returns all objects
 	vector<PolyMesh*> GetPolyMeshList();
+	vector<PolyMesh*> GetSharedPolyMeshList(); // uses MdlObject::GetSharedPolyMesh, so only use it to read
 	void DeleteObject(MdlObject *obj);
 	void ReplaceObject(MdlObject *oldObj, MdlObject *newObj);
 	void EstimateMidPosition();
@@ -377,6 +454,7 @@ struct Model {
 	void SetTextureName(uint index, const char *name);
 	void SetTexture(uint index, Texture* tex);
 
+	// Packs all 3DO textures and colors in one texture, texw x texh or larger if they don't fit, saved as texName
 	bool ConvertToS3O(std::string texName, int texw, int texh);
 
 	float radius;		//radius of collision sphere
@@ -408,4 +486,8 @@ void GenerateUniqueVectors(const std::vector<Vertex>& verts,
 						   std::vector<Vector3>& vertPos,
 						   std::vector<int>& old2new);
 
+// Recalculates the vertex normals of the objects, the meshes are done in parallel on worker threads.
+// Gives the normals of PolyMesh::CalculateNormals2, or those of PolyMesh::CalculateNormals if maxSmoothAngle < 0.
+void CalculateObjectNormals(const std::vector<MdlObject*>& objects, float maxSmoothAngle);
+
 #endif
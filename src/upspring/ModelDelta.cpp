@@ -0,0 +1,539 @@
+//-----------------------------------------------------------------------
+//  Upspring model editor
+//  Copyright 2005 Jelmer Cnossen
+//  This code is released under GPL license, see LICENSE.HTML for info.
+//-----------------------------------------------------------------------
+#include "EditorIncl.h"
+#include "EditorDef.h"
+
+#include "Model.h"
+#include "ModelDelta.h"
+
+// what an ObjectChange contains
+enum {
+	CHG_Exists=1, // created or deleted, all other parts are set too
+	CHG_Props=2,
+	CHG_Mesh=4,
+	CHG_Anim=8,
+	CHG_Links=16
+};
+
+struct ObjectProps
+{
+	Vector3 position, scale;
+	Rotator rotation;
+	string name;
+
+	void Get(MdlObject *o) {
+		position = o->position;
+		scale = o->scale;
+		rotation = o->rotation;
+		name = o->name;
+	}
+	void Set(MdlObject *o) {
+		o->position = position;
+		o->scale = scale;
+		o->rotation = rotation;
+		o->name = name;
+	}
+	bool operator==(const ObjectProps& p) const {
+		return SameVector(position, p.position) && SameVector(scale, p.scale) &&
+			SameVector(rotation.euler, p.rotation.euler) && rotation.eulerInterp == p.rotation.eulerInterp &&
+			name == p.name;
+	}
+	static bool SameVector(const Vector3& a, const Vector3& b) {
+		return a.x == b.x && a.y == b.y && a.z == b.z;
+	}
+};
+
+// Part of a mesh: the vertices starting at firstVert and the polygons starting at firstPoly.
+// Only the polygon arrays of 'polys' are used.
+struct MeshRange
+{
+	MeshRange() { firstVert = firstPoly = 0; }
+
+	int firstVert, firstPoly;
+	vector<Vertex> verts;
+	CompactPolyMesh polys;
+};
+
+struct ObjectSide
+{
+	ObjectSide() { exists = hasMesh = false; parent = -1; }
+
+	bool exists;
+	ObjectProps props;
+	bool hasMesh;
+	MeshRange range; // replaces the range of the other side
+	vector<vector<char> > anim; // key data of every animation property
+	int parent;
+	vector<int> childs;
+};
+
+struct ObjectChange
+{
+	int slot;
+	int what;
+	MdlObject *obj; // object the change was made to, for created objects
+	ObjectSide side[2]; // old, new
+};
+
+struct ObjectState
+{
+	ObjectState() { exists = false; obj = 0; mesh = 0; parent = -1; }
+	~ObjectState() { if (mesh) mesh->Release(); }
+
+	bool exists;
+	MdlObject *obj;
+	ObjectProps props;
+	CompactPolyMesh *mesh; // without selection flags, shared with the object after Apply
+	vector<vector<char> > anim;
+	int parent;
+	vector<int> childs;
+};
+
+struct ModelState
+{
+	ModelState() { radius = height = 0.0f; mapping = 0; root = -1; }
+
+	void Get(Model *mdl, map<MdlObject*, int>& liveSlots) {
+		texBindings = mdl->texBindings;
+		radius = mdl->radius;
+		height = mdl->height;
+		mid = mdl->mid;
+		mapping = mdl->mapping;
+		root = mdl->root ? liveSlots[mdl->root] : -1;
+	}
+	bool operator==(const ModelState& s) const {
+		if (texBindings.size() != s.texBindings.size())
+			return false;
+		for (uint a=0;a<texBindings.size();a++)
+			if (texBindings[a].name != s.texBindings[a].name || texBindings[a].texture.Get() != s.texBindings[a].texture.Get())
+				return false;
+		return radius == s.radius && height == s.height && ObjectProps::SameVector(mid, s.mid) &&
+			mapping == s.mapping && root == s.root;
+	}
+
+	vector<TextureBinding> texBindings;
+	float radius, height;
+	Vector3 mid;
+	int mapping;
+	int root;
+};
+
+struct ModelChange
+{
+	ModelState side[2];
+};
+
+// ------------------------------------------------------------------------------------------------
+// Mesh ranges
+// ------------------------------------------------------------------------------------------------
+
+static const string emptyString;
+
+// read access to the polygons of either type of mesh
+struct PolyReader
+{
+	PolyReader(Geometry *g) {
+		pm = dynamic_cast<PolyMesh*>(g);
+		cpm = pm ? 0 : dynamic_cast<CompactPolyMesh*>(g);
+	}
+
+	int NumVerts() { return pm ? (int)pm->verts.size() : (cpm ? (int)cpm->verts.size() : 0); }
+	const Vertex& Vert(int i) { return pm ? pm->verts[i] : cpm->verts[i]; }
+
+	int NumPolys() { return pm ? (int)pm->poly.size() : (cpm ? cpm->NumPolys() : 0); }
+	int Size(int i) { return pm ? (int)pm->poly[i]->verts.size() : cpm->PolySize(i); }
+	const int* Indices(int i) {
+		if (pm) return pm->poly[i]->verts.empty() ? 0 : &pm->poly[i]->verts[0];
+		return cpm->PolySize(i) ? &cpm->indices[cpm->polyStart[i]] : 0;
+	}
+	const Vector3& Color(int i) { return pm ? pm->poly[i]->color : cpm->polyColor[i]; }
+	int TAColor(int i) { return pm ? pm->poly[i]->taColor : cpm->polyTAColor[i]; }
+	bool Curved(int i) { return pm ? pm->poly[i]->isCurved : (cpm->polyFlags[i] & CompactPolyMesh::PF_Curved) != 0; }
+	const string& TexName(int i) {
+		if (pm) return pm->poly[i]->texname;
+		int t = cpm->polyTexture[i];
+		return t >= 0 ? cpm->texNames[t] : emptyString;
+	}
+	Texture* Tex(int i) {
+		if (pm) return pm->poly[i]->texture.Get();
+		int t = cpm->polyTexture[i];
+		return t >= 0 ? cpm->textures[t].Get() : 0;
+	}
+
+	PolyMesh *pm;
+	CompactPolyMesh *cpm;
+};
+
+static bool SameVertex(const Vertex& a, const Vertex& b)
+{
+	return !memcmp(&a, &b, sizeof(Vertex));
+}
+
+static bool SamePoly(PolyReader& a, int i, PolyReader& b, int j)
+{
+	int n = a.Size(i);
+	if (n != b.Size(j) || (n && memcmp(a.Indices(i), b.Indices(j), sizeof(int)*n)))
+		return false;
+
+	const Vector3 &ca = a.Color(i), &cb = b.Color(j);
+	return ca.x == cb.x && ca.y == cb.y && ca.z == cb.z && a.TAColor(i) == b.TAColor(j) &&
+		a.Curved(i) == b.Curved(j) && a.Tex(i) == b.Tex(j) && a.TexName(i) == b.TexName(j);
+}
+
+static void CopyPolys(CompactPolyMesh *dst, PolyReader& src, int first, int end)
+{
+	for (int a=first;a<end;a++) {
+		int tex = -1;
+		if (!src.TexName(a).empty() || src.Tex(a))
+			tex = dst->AddTexture(src.TexName(a), src.Tex(a));
+
+		dst->AddPoly(src.Indices(a), src.Size(a), tex);
+		dst->polyColor.back() = src.Color(a);
+		dst->polyTAColor.back() = src.TAColor(a);
+		dst->polyFlags.back() = src.Curved(a) ? CompactPolyMesh::PF_Curved : 0;
+	}
+}
+
+template<typename T> static void ReplaceRange(vector<T>& v, int first, int count, const vector<T>& src)
+{
+	v.erase(v.begin() + first, v.begin() + first + count);
+	v.insert(v.begin() + first, src.begin(), src.end());
+}
+
+// replaces 'count' polygons of dst starting at 'first' with the polygons of src
+static void ReplacePolys(CompactPolyMesh *dst, int first, int count, CompactPolyMesh *src)
+{
+	int n = src->NumPolys();
+	int i0 = dst->polyStart[first], i1 = dst->polyStart[first+count];
+	int growth = (int)src->indices.size() - (i1 - i0);
+
+	ReplaceRange(dst->indices, i0, i1 - i0, src->indices);
+
+	// polyStart[first] stays, the ends of the replaced polygons become those of src
+	vector<int> ends(n);
+	for (int a=0;a<n;a++)
+		ends[a] = i0 + src->polyStart[a+1];
+	ReplaceRange(dst->polyStart, first+1, count, ends);
+	for (uint a=first+1+n;a<dst->polyStart.size();a++)
+		dst->polyStart[a] += growth;
+
+	vector<int> tex(n);
+	for (int a=0;a<n;a++) {
+		int t = src->polyTexture[a];
+		tex[a] = t >= 0 ? dst->AddTexture(src->texNames[t], src->textures[t].Get()) : -1;
+	}
+	ReplaceRange(dst->polyTexture, first, count, tex);
+	ReplaceRange(dst->polyColor, first, count, src->polyColor);
+	ReplaceRange(dst->polyTAColor, first, count, src->polyTAColor);
+	ReplaceRange(dst->polyFlags, first, count, src->polyFlags);
+}
+
+static void GetAnim(MdlObject *o, vector<vector<char> >& anim)
+{
+	vector<AnimProperty*>& props = o->animInfo.properties;
+	anim.resize(props.size());
+	for (uint a=0;a<props.size();a++)
+		anim[a] = props[a]->keyData;
+}
+
+static void SetAnim(MdlObject *o, const vector<vector<char> >& anim)
+{
+	vector<AnimProperty*>& props = o->animInfo.properties;
+	for (uint a=0;a<props.size() && a<anim.size();a++)
+		props[a]->keyData = anim[a];
+}
+
+// ------------------------------------------------------------------------------------------------
+// ModelDelta
+// ------------------------------------------------------------------------------------------------
+
+ModelDelta::ModelDelta()
+{
+	model = 0;
+}
+
+ModelDelta::~ModelDelta()
+{
+	for (uint a=0;a<objects.size();a++)
+		delete objects[a];
+	delete model;
+}
+
+// ------------------------------------------------------------------------------------------------
+// ModelTracker
+// ------------------------------------------------------------------------------------------------
+
+ModelTracker::ModelTracker()
+{
+	model = new ModelState;
+}
+
+ModelTracker::~ModelTracker()
+{
+	for (uint a=0;a<slots.size();a++)
+		delete slots[a];
+	delete model;
+}
+
+int ModelTracker::FindSlot(MdlObject *o)
+{
+	map<MdlObject*, int>::iterator i = slotIndex.find(o);
+	if (i != slotIndex.end())
+		return i->second;
+
+	i = pendingSlots.find(o);
+	if (i != pendingSlots.end() && !slots[i->second]->exists)
+		return i->second;
+
+	// a new object, the slot stays unused until the delta that creates it is committed
+	slots.push_back(new ObjectState);
+	pendingSlots[o] = (int)slots.size()-1;
+	return (int)slots.size()-1;
+}
+
+ObjectChange* ModelTracker::DiffObject(int slot, MdlObject *o, map<MdlObject*, int>& liveSlots)
+{
+	ObjectState& s = *slots[slot];
+	ObjectChange *c = new ObjectChange;
+	ObjectSide &os = c->side[0], &ns = c->side[1];
+	c->slot = slot;
+	c->obj = o;
+	c->what = 0;
+
+	os.exists = s.exists;
+	ns.exists = o != 0;
+	bool all = os.exists != ns.exists;
+	if (all)
+		c->what |= CHG_Exists;
+
+	// properties
+	if (o) ns.props.Get(o);
+	if (all || !(s.props == ns.props)) {
+		os.props = s.props;
+		c->what |= CHG_Props;
+	}
+
+	// geometry: only the part between the unchanged start and end is stored.
+	// A mesh that is still shared with the tracked state hasn't changed, changing it would have made a copy.
+	bool shared = o && s.mesh && o->geometry == s.mesh;
+	PolyReader oldMesh(shared ? 0 : s.mesh), newMesh(shared || !o ? 0 : o->geometry);
+	os.hasMesh = s.mesh != 0;
+	ns.hasMesh = o && o->geometry;
+
+	int nvOld = oldMesh.NumVerts(), nvNew = newMesh.NumVerts();
+	int firstVert = 0;
+	while (firstVert < nvOld && firstVert < nvNew && SameVertex(oldMesh.Vert(firstVert), newMesh.Vert(firstVert)))
+		firstVert++;
+	int endOld = nvOld, endNew = nvNew;
+	while (endOld > firstVert && endNew > firstVert && SameVertex(oldMesh.Vert(endOld-1), newMesh.Vert(endNew-1)))
+		endOld--, endNew--;
+
+	int npOld = oldMesh.NumPolys(), npNew = newMesh.NumPolys();
+	int firstPoly = 0;
+	while (firstPoly < npOld && firstPoly < npNew && SamePoly(oldMesh, firstPoly, newMesh, firstPoly))
+		firstPoly++;
+	int pendOld = npOld, pendNew = npNew;
+	while (pendOld > firstPoly && pendNew > firstPoly && SamePoly(oldMesh, pendOld-1, newMesh, pendNew-1))
+		pendOld--, pendNew--;
+
+	if (all || os.hasMesh != ns.hasMesh || firstVert < endOld || firstVert < endNew || firstPoly < pendOld || firstPoly < pendNew) {
+		os.range.firstVert = ns.range.firstVert = firstVert;
+		os.range.firstPoly = ns.range.firstPoly = firstPoly;
+		if (firstVert < endOld) os.range.verts.assign(s.mesh->verts.begin() + firstVert, s.mesh->verts.begin() + endOld);
+		for (int a=firstVert;a<endNew;a++)
+			ns.range.verts.push_back(newMesh.Vert(a));
+		CopyPolys(&os.range.polys, oldMesh, firstPoly, pendOld);
+		CopyPolys(&ns.range.polys, newMesh, firstPoly, pendNew);
+		c->what |= CHG_Mesh;
+	}
+
+	// animation
+	if (o) GetAnim(o, ns.anim);
+	if (all || ns.anim != s.anim) {
+		os.anim = s.anim;
+		c->what |= CHG_Anim;
+	} else
+		ns.anim.clear();
+
+	// links
+	if (o) {
+		ns.parent = o->parent ? liveSlots[o->parent] : -1;
+		for (uint a=0;a<o->childs.size();a++)
+			ns.childs.push_back(liveSlots[o->childs[a]]);
+	}
+	if (all || ns.parent != s.parent || ns.childs != s.childs) {
+		os.parent = s.parent;
+		os.childs = s.childs;
+		c->what |= CHG_Links;
+	} else
+		ns.childs.clear();
+
+	if (!c->what) {
+		delete c;
+		return 0;
+	}
+	return c;
+}
+
+ModelDelta* ModelTracker::Diff(Model *mdl)
+{
+	// give every object in the model a slot
+	map<MdlObject*, int> liveSlots;
+	vector<MdlObject*> objects;
+	if (mdl->root)
+		objects = mdl->GetObjectList();
+	for (uint a=0;a<objects.size();a++)
+		liveSlots[objects[a]] = FindSlot(objects[a]);
+
+	// slot -> live object, 0 for objects that are gone
+	vector<MdlObject*> live(slots.size(), (MdlObject*)0);
+	for (map<MdlObject*, int>::iterator i = liveSlots.begin(); i != liveSlots.end(); ++i)
+		live[i->second] = i->first;
+
+	ModelDelta *d = new ModelDelta;
+	for (uint a=0;a<slots.size();a++) {
+		if (!live[a] && !slots[a]->exists)
+			continue;
+
+		ObjectChange *c = DiffObject(a, live[a], liveSlots);
+		if (c) d->objects.push_back(c);
+	}
+
+	ModelState ms;
+	ms.Get(mdl, liveSlots);
+	if (!(ms == *model)) {
+		d->model = new ModelChange;
+		d->model->side[0] = *model;
+		d->model->side[1] = ms;
+	}
+
+	if (d->objects.empty() && !d->model) {
+		delete d;
+		return 0;
+	}
+	return d;
+}
+
+void ModelTracker::Commit(ModelDelta *d, bool toNew)
+{
+	for (uint a=0;a<d->objects.size();a++) {
+		ObjectChange *c = d->objects[a];
+		ObjectState& s = *slots[c->slot];
+		ObjectSide& side = c->side[toNew ? 1 : 0];
+		ObjectSide& other = c->side[toNew ? 0 : 1];
+
+		if (c->what & CHG_Exists) {
+			if (side.exists) {
+				s.obj = c->obj;
+				slotIndex[s.obj] = c->slot;
+			} else {
+				map<MdlObject*, int>::iterator i = slotIndex.find(s.obj);
+				if (i != slotIndex.end() && i->second == c->slot)
+					slotIndex.erase(i);
+				s.obj = 0;
+			}
+			s.exists = side.exists;
+		}
+		if (c->what & CHG_Props)
+			s.props = side.props;
+		if (c->what & CHG_Mesh) {
+			if (side.hasMesh) {
+				if (!s.mesh) s.mesh = new CompactPolyMesh;
+				else if (s.mesh->IsShared()) {
+					CompactPolyMesh *cp = (CompactPolyMesh*)s.mesh->Clone();
+					s.mesh->Release();
+					s.mesh = cp;
+				}
+				ReplaceRange(s.mesh->verts, side.range.firstVert, (int)other.range.verts.size(), side.range.verts);
+				ReplacePolys(s.mesh, side.range.firstPoly, other.range.polys.NumPolys(), &side.range.polys);
+				s.mesh->InvalidateRenderData(); // it can still have the cache of an object it was shared with
+			} else if (s.mesh) {
+				s.mesh->Release();
+				s.mesh = 0;
+			}
+		}
+		if (c->what & CHG_Anim)
+			s.anim = side.anim;
+		if (c->what & CHG_Links) {
+			s.parent = side.parent;
+			s.childs = side.childs;
+		}
+	}
+
+	if (d->model)
+		*model = d->model->side[toNew ? 1 : 0];
+
+	pendingSlots.clear();
+}
+
+void ModelTracker::Apply(Model *mdl, ModelDelta *d, bool toNew)
+{
+	int to = toNew ? 1 : 0;
+
+	// recreate objects first, so links to them can be restored
+	vector<MdlObject*> deleted;
+	for (uint a=0;a<d->objects.size();a++) {
+		ObjectChange *c = d->objects[a];
+		if (c->what & CHG_Exists) {
+			if (c->side[to].exists)
+				c->obj = new MdlObject;
+			else
+				deleted.push_back(slots[c->slot]->obj);
+		}
+	}
+
+	Commit(d, toNew);
+
+	for (uint a=0;a<d->objects.size();a++) {
+		ObjectChange *c = d->objects[a];
+		ObjectState& s = *slots[c->slot];
+		if (!s.exists)
+			continue;
+
+		MdlObject *o = s.obj;
+		if (c->what & CHG_Props)
+			s.props.Set(o);
+		if (c->what & CHG_Mesh) {
+			if (o->geometry) o->geometry->Release();
+			o->geometry = s.mesh ? s.mesh->Share() : 0;
+			o->bTexturesLoaded = false;
+		}
+		if (c->what & CHG_Anim)
+			SetAnim(o, s.anim);
+		if (c->what & CHG_Links) {
+			o->parent = s.parent >= 0 ? slots[s.parent]->obj : 0;
+			o->childs.resize(s.childs.size());
+			for (uint b=0;b<s.childs.size();b++)
+				o->childs[b] = slots[s.childs[b]]->obj;
+		}
+	}
+
+	if (d->model) {
+		mdl->texBindings = model->texBindings;
+		mdl->radius = model->radius;
+		mdl->height = model->height;
+		mdl->mid = model->mid;
+		mdl->mapping = model->mapping;
+		mdl->root = model->root >= 0 ? slots[model->root]->obj : 0;
+	}
+
+	// nothing links to these anymore
+	for (uint a=0;a<deleted.size();a++) {
+		deleted[a]->childs.clear();
+		deleted[a]->parent = 0;
+		delete deleted[a];
+	}
+}
+
+void ModelTracker::Revert(Model *mdl)
+{
+	ModelDelta *d = Diff(mdl);
+	if (d) {
+		Commit(d, true);
+		Apply(mdl, d, false);
+		delete d;
+	}
+}
@@ -0,0 +1,62 @@
+//-----------------------------------------------------------------------
+//  Upspring model editor
+//  Copyright 2005 Jelmer Cnossen
+//  This code is released under GPL license, see LICENSE.HTML for info.
+//-----------------------------------------------------------------------
+#ifndef UPS_MODEL_DELTA_H
+#define UPS_MODEL_DELTA_H
+
+struct Model;
+struct MdlObject;
+struct ObjectChange;
+struct ObjectState;
+struct ModelChange;
+struct ModelState;
+
+/*
+Undo history support. Instead of a clone of the model for every undo step, the BackupManager keeps
+one copy of the model state in a ModelTracker, and for every step a ModelDelta with only the changes.
+
+For every changed object a delta holds the old and new value of its properties (transform, name),
+the part of the vertex and polygon lists between the unchanged start and end, the animation keys, and
+the parent and child links. Objects are identified by a slot number, which stays the same when an
+undo recreates a deleted object. Selection state is not part of the history.
+*/
+class ModelDelta
+{
+public:
+	ModelDelta();
+	~ModelDelta();
+
+	vector<ObjectChange*> objects; // sorted by slot
+	ModelChange *model; // 0 if the model properties didn't change
+};
+
+class ModelTracker
+{
+public:
+	ModelTracker();
+	~ModelTracker();
+
+	// Returns the changes of mdl since the tracked state, or 0 if there are none.
+	// The tracked state itself doesn't change.
+	ModelDelta* Diff(Model *mdl);
+	// Moves the tracked state to the new (toNew=true) or the old side of the delta
+	void Commit(ModelDelta *d, bool toNew);
+	// Moves both the tracked state and mdl to the new or the old side of the delta.
+	// mdl has to be in the tracked state, objects are changed in place.
+	void Apply(Model *mdl, ModelDelta *d, bool toNew);
+	// Undoes all changes of mdl since the tracked state
+	void Revert(Model *mdl);
+
+protected:
+	ObjectChange* DiffObject(int slot, MdlObject *o, map<MdlObject*, int>& liveSlots);
+	int FindSlot(MdlObject *o);
+
+	vector<ObjectState*> slots;
+	map<MdlObject*, int> slotIndex; // live objects of the tracked state
+	map<MdlObject*, int> pendingSlots; // new objects that got a slot in Diff, but aren't committed yet
+	ModelState *model;
+};
+
+#endif
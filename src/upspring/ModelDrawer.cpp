@@ -34,17 +34,47 @@ void TestGLError()
 	}
 }
 
-void RenderData::Invalidate()
+RenderData::~RenderData()
 {
-	glDeleteLists(drawList, 1);
-	drawList=0;
+	delete vertexBuffer;
+	delete indexBuffer;
 }
 
-RenderData::~RenderData()
+void RenderData::Update(PolyMesh *pm, int mapping)
+{
+	mesh.Build(pm, mapping);
+	Upload();
+}
+
+void RenderData::Update(CompactPolyMesh *cpm, int mapping)
+{
+	mesh.Build(cpm, mapping);
+	Upload();
+}
+
+void RenderData::Upload()
 {
-	if (drawList)
-		glDeleteLists(drawList,1);
-	drawList=0;
+	SAFE_DELETE(vertexBuffer);
+	SAFE_DELETE(indexBuffer);
+
+	if (!mesh.vertices.empty() && !mesh.indices.empty()) {
+		vertexBuffer = new VertexBuffer;
+		vertexBuffer->Init(mesh.vertices.size() * sizeof(BatchVertex));
+		memcpy(vertexBuffer->LockData(), &mesh.vertices[0], vertexBuffer->GetByteSize());
+		vertexBuffer->UnlockData();
+		vertexBuffer->Unbind();
+
+		indexBuffer = new IndexBuffer;
+		indexBuffer->Init(mesh.indices.size() * sizeof(uint));
+		memcpy(indexBuffer->LockData(), &mesh.indices[0], indexBuffer->GetByteSize());
+		indexBuffer->UnlockData();
+		indexBuffer->Unbind();
+	}
+
+	// the buffers have their own copy now
+	vector<BatchVertex>().swap(mesh.vertices);
+	vector<uint>().swap(mesh.indices);
+	valid=true;
 }
 
 ModelDrawer::ModelDrawer ()
@@ -52,6 +82,7 @@ ModelDrawer::ModelDrawer ()
 	glewInitialized=false;
 	canRenderS3O=false;
 	model = 0;
+	curView = 0;
 	sphereList = 0;
 	
 	buffer = 0;
@@ -148,7 +179,7 @@ void ModelDrawer::SetupGL() {
 
 void ModelDrawer::RenderPolygon (MdlObject *o, Poly*pl, IView *v, int mapping, bool allowSelect)
 {
-	PolyMesh *pm = o->GetPolyMesh();// since there are polygons, we can assume there is a polymesh
+	PolyMesh *pm = o->GetSharedPolyMesh();// since there are polygons, we can assume there is a polymesh
 	if (allowSelect) {
 		pl->selector->mesh = pm; 
 		o->GetFullTransform(pl->selector->transform);
@@ -212,6 +243,78 @@ void ModelDrawer::RenderPolygon (MdlObject *o, Poly*pl, IView *v, int mapping, b
 }
 
 
+void ModelDrawer::RenderPolyMesh (PolyMesh *pm, IView *v, int mapping)
+{
+	RenderData *rd = (RenderData*)pm->renderData;
+	if (!rd)
+		pm->renderData = rd = new RenderData;
+
+	// the size check catches edits that didn't call InvalidateRenderData, like deleting polygons
+	if (!rd->valid || !rd->mesh.IsBuiltFrom(pm, mapping))
+		rd->Update(pm, mapping);
+
+	RenderBatches(rd, v, mapping);
+}
+
+void ModelDrawer::RenderCompactPolyMesh (CompactPolyMesh *cpm, int mapping)
+{
+	RenderData *rd = (RenderData*)cpm->renderData;
+	if (!rd)
+		cpm->renderData = rd = new RenderData;
+
+	if (!rd->valid || !rd->mesh.IsBuiltFrom(cpm, mapping))
+		rd->Update(cpm, mapping);
+
+	RenderBatches(rd, curView, mapping);
+}
+
+void ModelDrawer::RenderBatches (RenderData *rd, IView *v, int mapping)
+{
+	if (!rd->vertexBuffer)
+		return;
+
+	char *vbuf = (char*)rd->vertexBuffer->Bind();
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glVertexPointer(3, GL_FLOAT, sizeof(BatchVertex), vbuf);
+	glNormalPointer(GL_FLOAT, sizeof(BatchVertex), vbuf + sizeof(Vector3));
+	glTexCoordPointer(2, GL_FLOAT, sizeof(BatchVertex), vbuf + 2 * sizeof(Vector3));
+
+	char *ibuf = (char*)rd->indexBuffer->Bind();
+	for (uint a=0;a<rd->mesh.batches.size();a++) {
+		MeshBatch::Batch& b = rd->mesh.batches[a];
+		int texture = 0;
+
+		if (mapping == MAPPING_3DO) {
+			// same state as RenderPolygon sets for each 3DO polygon
+			if (b.texture && v->GetRenderMode()>=M3D_TEX)
+				texture = b.texture->glIdent;
+
+			if (texture) {
+				glEnable (GL_TEXTURE_2D);
+				glBindTexture (GL_TEXTURE_2D, texture);
+			}
+			if (b.useColor && v->GetRenderMode()>=M3D_SOLID)
+				glColor3fv ((float*)&b.color);
+		}
+
+		glDrawElements(GL_TRIANGLES, b.numIndices, GL_UNSIGNED_INT, ibuf + b.firstIndex * sizeof(uint));
+
+		if (mapping == MAPPING_3DO) {
+			if (texture)
+				glDisable(GL_TEXTURE_2D);
+			glColor3ub (255,255,255);
+		}
+	}
+
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	rd->indexBuffer->Unbind();
+	rd->vertexBuffer->Unbind();
+}
+
 void ModelDrawer::RenderObject (MdlObject *o, IView *v, int mapping) 
 {
 	// setup selector
@@ -241,35 +344,21 @@ void ModelDrawer::RenderObject (MdlObject *o, IView *v, int mapping)
 
 //	if(polySelect) {
 		// render polygons
-	PolyMesh *pm = o->GetPolyMesh();
-	if (pm) {
-		for (uint a=0;a<pm->poly.size();a++)
-			RenderPolygon (o, pm->poly[a], v,mapping, polySelect);
-	} else if (o->geometry)
-		o->geometry->Draw(this, model, o);
-
-/*	}
-	else
-	{
-		// render geometry using drawing list
-		if (!o->renderData)
-			o->renderData = new RenderData;
-
-		RenderData* rd = (RenderData*)o->renderData;
-
-		if (rd->drawList)
-			glCallList(rd->drawList);
-		else {
-			rd->drawList = glGenLists(1);
-			glNewList(rd->drawList, GL_COMPILE_AND_EXECUTE);
-
-			// render polygons
-			for (uint a=0;a<o->poly.size();a++)
-				RenderPolygon (o, o->poly[a], v,mapping, polySelect);
-
-			glEndList ();
+	// polygon selection needs a GL name for every polygon, so that is still done one by one
+	if (polySelect && v->IsSelecting()) {
+		PolyMesh *pm = o->GetSharedPolyMesh();
+		if (pm) {
+			for (uint a=0;a<pm->poly.size();a++)
+				RenderPolygon (o, pm->poly[a], v,mapping, polySelect);
 		}
-	}*/
+	} else {
+		// a CompactPolyMesh draws itself without being converted
+		PolyMesh *pm = dynamic_cast<PolyMesh*>(o->geometry);
+		if (pm)
+			RenderPolyMesh (pm, v, mapping);
+		else if (o->geometry)
+			o->geometry->Draw(this, model, o);
+	}
 
 	for (uint a=0;a<o->childs.size();a++)
 		RenderObject (o->childs[a], v, mapping);
@@ -334,6 +423,7 @@ void ModelDrawer::Render(Model *mdl, IView *v, const Vector3& teamColor)
 		SetupGL();
 
 	model = mdl;
+	curView = v;
 	if (!model->root)
 		return;
 
@@ -576,9 +666,12 @@ void ModelDrawer::RenderHelperGeom(MdlObject *o, IView *v)
 	if (o->csurfobj)
 		o->csurfobj->Draw();
 
-	PolyMesh *pm=o->GetPolyMesh();
+	// only the normals of selected objects need a compact mesh converted
+	PolyMesh *pm=dynamic_cast<PolyMesh*>(o->geometry);
 	if (v->GetConfig(CFG_VRTNORMALS)!=0.0f)
 	{
+		if (o->isSelected && !pm)
+			pm=o->GetSharedPolyMesh();
 		if (o->isSelected && pm) {
 			for (uint a=0;a<pm->poly.size();a++)
 	//	if (o->poly[a]->isSelected) 
@@ -586,7 +679,7 @@ void ModelDrawer::RenderHelperGeom(MdlObject *o, IView *v)
 		}
 	}
 
-	if (v->GetConfig(CFG_MESHSMOOTH)!=0.0f)
+	if (v->GetConfig(CFG_MESHSMOOTH)!=0.0f && pm)
 	{
 		for (uint a=0;a<pm->poly.size();a++)
 			if (pm->poly[a]->isSelected) 
@@ -611,19 +704,24 @@ void ModelDrawer::RenderSelection_ (MdlObject *o, IView *view)
 	glColor3ub (0,0,255);
 
 	bool psel=view->GetConfig(CFG_POLYSELECT)!=0.0f;
-	for (PolyIterator pi(o);!pi.End();pi.Next())
-	{
-		Poly *pl = *pi;
-
-		if ((o->isSelected && !psel) || (pl->isSelected && psel))
+	// skip compact meshes without anything selected, ConstPolyIterator would convert them
+	CompactPolyMesh *cpm = dynamic_cast<CompactPolyMesh*>(o->geometry);
+	bool skip = cpm && !(psel ? cpm->HasSelectedPolys() : o->isSelected);
+	if (!skip) {
+		for (ConstPolyIterator pi(o);!pi.End();pi.Next())
 		{
-			if (!pi.verts())
-				continue;
+			Poly *pl = *pi;
 
-			glBegin(GL_POLYGON);
-			for (int b=0;b<pl->verts.size();b++)
-				glVertex3fv ((float *)& (*pi.verts())[pl->verts[b]].pos);
-			glEnd ();
+			if ((o->isSelected && !psel) || (pl->isSelected && psel))
+			{
+				if (!pi.verts())
+					continue;
+
+				glBegin(GL_POLYGON);
+				for (int b=0;b<pl->verts.size();b++)
+					glVertex3fv ((float *)& (*pi.verts())[pl->verts[b]].pos);
+				glEnd ();
+			}
 		}
 	}
 	for (uint a=0;a<o->childs.size();a++)
@@ -9,6 +9,7 @@
 
 #include "Model.h"
 #include "VertexBuffer.h"
+#include "MeshBatch.h"
 
 enum RenderMethod
 {
@@ -18,15 +19,24 @@ enum RenderMethod
 	RM_TEXTURE1COLOR
 };
 
-// Cached rendering data for objects
+// Cached rendering data for a PolyMesh or CompactPolyMesh: the triangulated mesh in a vertex and index buffer.
+// Invalidate only marks it as outdated, the buffers are rebuilt when the mesh is drawn next
 struct RenderData : IRenderData
 {
-	RenderData() { drawList=0; }
+	RenderData() { vertexBuffer=0; indexBuffer=0; valid=false; }
 	~RenderData();
 
-	unsigned int drawList;
+	MeshBatch mesh; // only the batches are kept after uploading
+	VertexBuffer *vertexBuffer;
+	IndexBuffer *indexBuffer;
+	bool valid;
 
-	void Invalidate ();
+	void Update (PolyMesh *pm, int mapping);
+	void Update (CompactPolyMesh *cpm, int mapping);
+	void Invalidate () { valid=false; }
+
+protected:
+	void Upload ();
 };
 
 
@@ -40,6 +50,8 @@ public:
 	void Render (Model* mdl, IView *view, const Vector3& teamcolor);
     void RenderObject (MdlObject *o, IView *view, int mapping);
 	void RenderPolygon (MdlObject *o, Poly *pl, IView *v, int mapping, bool allowSelect);
+	void RenderPolyMesh (PolyMesh *pm, IView *v, int mapping); // draws from the cached RenderData
+	void RenderCompactPolyMesh (CompactPolyMesh *cpm, int mapping); // same, for the view being drawn
 
 protected:
 	void RenderSelection (IView *view);
@@ -47,6 +59,7 @@ protected:
 	void RenderHelperGeom(MdlObject *o, IView *v);
 
 	void RenderSmoothPolygon(PolyMesh *pm, Poly *pl);
+	void RenderBatches(RenderData *rd, IView *v, int mapping);
 
 	void RenderSelection_ (MdlObject *o, IView *view);
 	void SetupS3OAdvDrawing (const Vector3& teamcol, IView *v);
@@ -72,6 +85,7 @@ protected:
 	Vector3* buffer;
 
 	Model* model;// valid while drawing
+	IView* curView;// valid while drawing
 
 	uint sphereList; // display list for rendering a sphere
 };
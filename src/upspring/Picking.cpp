@@ -0,0 +1,342 @@
+//-----------------------------------------------------------------------
+//  Upspring model editor
+//  Copyright 2005 Jelmer Cnossen
+//  This code is released under GPL license, see LICENSE.HTML for info.
+//-----------------------------------------------------------------------
+#include "EditorIncl.h"
+#include "EditorDef.h"
+
+#include "Model.h"
+#include "Picking.h"
+
+static const int MaxLeafTris = 4;
+
+// ------------------------------------------------------------------------------------------------
+// PickRegion
+// ------------------------------------------------------------------------------------------------
+
+PickRegion::PickRegion(const Matrix& m, float x0, float y0, float x1, float y1)
+{
+	toClip = m;
+
+	// x >= x0*w, x <= x1*w, y >= y0*w, y <= y1*w, z >= -w, z <= w in clip space
+	const Vector4 clipPlanes[6] = {
+		Vector4( 1, 0, 0, -x0),
+		Vector4(-1, 0, 0,  x1),
+		Vector4( 0, 1, 0, -y0),
+		Vector4( 0,-1, 0,  y1),
+		Vector4( 0, 0, 1,  1),
+		Vector4( 0, 0,-1,  1)
+	};
+
+	// a plane p in clip space is the plane transpose(toClip) * p before the transform
+	for (int a=0;a<6;a++) {
+		const Vector4& p = clipPlanes[a];
+		planes[a].x = p.x * m.v(0,0) + p.y * m.v(1,0) + p.z * m.v(2,0) + p.w * m.v(3,0);
+		planes[a].y = p.x * m.v(0,1) + p.y * m.v(1,1) + p.z * m.v(2,1) + p.w * m.v(3,1);
+		planes[a].z = p.x * m.v(0,2) + p.y * m.v(1,2) + p.z * m.v(2,2) + p.w * m.v(3,2);
+		planes[a].w = p.x * m.v(0,3) + p.y * m.v(1,3) + p.z * m.v(2,3) + p.w * m.v(3,3);
+	}
+}
+
+static inline float PlaneDis(const Vector4& pl, const Vector3& p)
+{
+	return pl.x * p.x + pl.y * p.y + pl.z * p.z + pl.w;
+}
+
+bool PickRegion::Contains(const Vector3& p) const
+{
+	for (int a=0;a<6;a++)
+		if (PlaneDis(planes[a], p) < 0.0f)
+			return false;
+	return true;
+}
+
+float PickRegion::Depth(const Vector3& p) const
+{
+	float z = toClip.v(2,0) * p.x + toClip.v(2,1) * p.y + toClip.v(2,2) * p.z + toClip.v(2,3);
+	float w = toClip.v(3,0) * p.x + toClip.v(3,1) * p.y + toClip.v(3,2) * p.z + toClip.v(3,3);
+	return w != 0.0f ? z / w : z;
+}
+
+// true if the box is completely outside one of the planes
+static bool BoxOutside(const Vector4 *planes, const Vector3& mn, const Vector3& mx)
+{
+	for (int a=0;a<6;a++) {
+		const Vector4& pl = planes[a];
+		// the corner that is furthest inside
+		Vector3 p (pl.x >= 0.0f ? mx.x : mn.x, pl.y >= 0.0f ? mx.y : mn.y, pl.z >= 0.0f ? mx.z : mn.z);
+		if (PlaneDis(pl, p) < 0.0f)
+			return true;
+	}
+	return false;
+}
+
+// Clips the triangle to the region and returns the depth of the nearest point left, or false if nothing is left
+static bool ClipTriangle(const PickRegion& r, const Vector3 *tri, float& depth)
+{
+	// each plane can add one vertex
+	Vector3 buf[2][3+6];
+	int n = 3;
+	buf[0][0] = tri[0]; buf[0][1] = tri[1]; buf[0][2] = tri[2];
+
+	int cur = 0;
+	for (int a=0;a<6 && n>0;a++) {
+		const Vector4& pl = r.planes[a];
+		Vector3 *src = buf[cur], *dst = buf[cur^1];
+		int m = 0;
+
+		for (int i=0, j=n-1;i<n;j=i++) {
+			float dj = PlaneDis(pl, src[j]), di = PlaneDis(pl, src[i]);
+			if ((dj >= 0.0f) != (di >= 0.0f))
+				dst[m++] = src[j] + (src[i] - src[j]) * (dj / (dj - di));
+			if (di >= 0.0f)
+				dst[m++] = src[i];
+		}
+		n = m;
+		cur ^= 1;
+	}
+
+	if (n == 0)
+		return false;
+
+	depth = r.Depth(buf[cur][0]);
+	for (int a=1;a<n;a++)
+		depth = min(depth, r.Depth(buf[cur][a]));
+	return true;
+}
+
+// ------------------------------------------------------------------------------------------------
+// PolyMeshBVH
+// ------------------------------------------------------------------------------------------------
+
+struct TriangleCentroidLess
+{
+	TriangleCentroidLess(int axis) : axis(axis) {}
+	template<typename T> bool operator()(const T& a, const T& b) const {
+		return a.v[0][axis] + a.v[1][axis] + a.v[2][axis] < b.v[0][axis] + b.v[1][axis] + b.v[2][axis];
+	}
+	int axis;
+};
+
+void PolyMeshBVH::Build(PolyMesh *pm)
+{
+	nodes.clear();
+	tris.clear();
+	numVerts = pm->verts.size();
+	numPolys = pm->poly.size();
+
+	for (uint a=0;a<pm->poly.size();a++) {
+		Poly *pl = pm->poly[a];
+		if (!pl->verts.empty())
+			AddPolygon(pm->verts, &pl->verts[0], pl->verts.size(), a);
+	}
+	BuildTree();
+}
+
+void PolyMeshBVH::Build(CompactPolyMesh *cpm)
+{
+	nodes.clear();
+	tris.clear();
+	numVerts = cpm->verts.size();
+	numPolys = cpm->NumPolys();
+
+	for (int a=0;a<cpm->NumPolys();a++)
+		if (cpm->PolySize(a))
+			AddPolygon(cpm->verts, &cpm->indices[cpm->polyStart[a]], cpm->PolySize(a), a);
+	BuildTree();
+}
+
+// triangulates like the ModelDrawer does
+void PolyMeshBVH::AddPolygon(const vector<Vertex>& verts, const int *vi, int count, int poly)
+{
+	for (int b=2;b<count;b++) {
+		Triangle t;
+		t.v[0] = verts[vi[0]].pos;
+		t.v[1] = verts[vi[b-1]].pos;
+		t.v[2] = verts[vi[b]].pos;
+		t.poly = poly;
+		tris.push_back(t);
+	}
+}
+
+void PolyMeshBVH::BuildTree()
+{
+	if (tris.empty())
+		return;
+
+	nodes.reserve(2 * tris.size() / MaxLeafTris + 1);
+	nodes.push_back(Node());
+	BuildNode(0, 0, tris.size());
+}
+
+void PolyMeshBVH::BuildNode(int node, int first, int count)
+{
+	Vector3 mn = tris[first].v[0], mx = mn;
+	Vector3 cmin(1e30f, 1e30f, 1e30f), cmax(-1e30f, -1e30f, -1e30f);
+	for (int a=first;a<first+count;a++) {
+		const Triangle& t = tris[a];
+		for (int b=0;b<3;b++) {
+			mn.incboundingmin(&t.v[b]);
+			mx.incboundingmax(&t.v[b]);
+		}
+		Vector3 c = t.v[0] + t.v[1] + t.v[2];
+		cmin.incboundingmin(&c);
+		cmax.incboundingmax(&c);
+	}
+
+	nodes[node].min = mn;
+	nodes[node].max = mx;
+
+	// split in the middle of the longest axis of the triangle centers
+	Vector3 ext = cmax - cmin;
+	int axis = 0;
+	if (ext.y > ext[axis]) axis = 1;
+	if (ext.z > ext[axis]) axis = 2;
+
+	if (count <= MaxLeafTris || ext[axis] <= 0.0f) {
+		nodes[node].first = first;
+		nodes[node].count = count;
+		return;
+	}
+
+	int half = count / 2;
+	nth_element(tris.begin() + first, tris.begin() + first + half, tris.begin() + first + count, TriangleCentroidLess(axis));
+
+	int child = nodes.size();
+	nodes[node].first = child;
+	nodes[node].count = 0;
+	nodes.push_back(Node());
+	nodes.push_back(Node());
+	BuildNode(child, first, half);
+	BuildNode(child + 1, first + half, count - half);
+}
+
+bool PolyMeshBVH::IsBuiltFrom(PolyMesh *pm)
+{
+	return numVerts == pm->verts.size() && numPolys == pm->poly.size();
+}
+
+bool PolyMeshBVH::IsBuiltFrom(CompactPolyMesh *cpm)
+{
+	return numVerts == cpm->verts.size() && numPolys == (uint)cpm->NumPolys();
+}
+
+void PolyMeshBVH::Query(const PickRegion& region, vector<pair<int, float> >& hits)
+{
+	if (nodes.empty())
+		return;
+
+	vector<pair<int, float> > found;
+	vector<int> stack;
+	stack.push_back(0);
+
+	while (!stack.empty()) {
+		const Node& n = nodes[stack.back()];
+		stack.pop_back();
+
+		if (BoxOutside(region.planes, n.min, n.max))
+			continue;
+
+		if (n.count == 0) {
+			stack.push_back(n.first + 1);
+			stack.push_back(n.first);
+			continue;
+		}
+
+		for (int a=n.first;a<n.first+n.count;a++) {
+			float depth;
+			if (ClipTriangle(region, tris[a].v, depth))
+				found.push_back(make_pair(tris[a].poly, depth));
+		}
+	}
+
+	// one hit per polygon, with the nearest depth of its triangles
+	sort(found.begin(), found.end());
+	for (uint a=0;a<found.size();a++)
+		if (a == 0 || found[a].first != found[a-1].first)
+			hits.push_back(found[a]);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Model picking
+// ------------------------------------------------------------------------------------------------
+
+// InvalidateRenderData deletes the BVH, the size check catches edits that didn't call it
+template<typename Mesh> static PolyMeshBVH* UpdateBVH(Mesh *mesh)
+{
+	if (!mesh->bvh || !mesh->bvh->IsBuiltFrom(mesh)) {
+		if (!mesh->bvh) mesh->bvh = new PolyMeshBVH;
+		mesh->bvh->Build(mesh);
+	}
+	return mesh->bvh;
+}
+
+static void PickObject(MdlObject *o, const Matrix& worldToClip, float x0, float y0, float x1, float y1, int flags, vector<PickHit>& hits)
+{
+	Matrix world;
+	o->GetFullTransform(world);
+	PickRegion region(world * worldToClip, x0, y0, x1, y1);
+
+	PickHit objHit;
+	objHit.obj = o;
+	objHit.poly = 0;
+	objHit.depth = 0.0f;
+	bool objPicked = false;
+
+	if ((flags & PICK_CENTERS) && region.Contains(Vector3())) {
+		objHit.depth = region.Depth(Vector3());
+		objPicked = true;
+	}
+
+	// picked polygons get selected, so they have to belong to this object only.
+	// Objects are picked from a CompactPolyMesh without converting it.
+	PolyMesh *pm = 0;
+	PolyMeshBVH *bvh = 0;
+	CompactPolyMesh *cpm = (flags & PICK_POLYGONS) ? 0 : dynamic_cast<CompactPolyMesh*>(o->geometry);
+	if (cpm)
+		bvh = UpdateBVH(cpm);
+	else {
+		pm = (flags & PICK_POLYGONS) ? o->GetPolyMesh() : o->GetSharedPolyMesh();
+		if (pm) bvh = UpdateBVH(pm);
+	}
+
+	if (bvh) {
+		vector<pair<int, float> > polyHits;
+		bvh->Query(region, polyHits);
+
+		for (uint a=0;a<polyHits.size();a++) {
+			if (flags & PICK_POLYGONS) {
+				PickHit h;
+				h.obj = o;
+				h.poly = pm->poly[polyHits[a].first];
+				h.depth = polyHits[a].second;
+				hits.push_back(h);
+			} else if (!objPicked || polyHits[a].second < objHit.depth) {
+				objHit.depth = polyHits[a].second;
+				objPicked = true;
+			}
+		}
+	}
+
+	if (objPicked)
+		hits.push_back(objHit);
+
+	for (uint a=0;a<o->childs.size();a++)
+		PickObject(o->childs[a], worldToClip, x0, y0, x1, y1, flags, hits);
+}
+
+void PickModel(MdlObject *root, const Matrix& worldToClip, float x0, float y0, float x1, float y1, int flags, vector<PickHit>& hits)
+{
+	if (root)
+		PickObject(root, worldToClip, x0, y0, x1, y1, flags, hits);
+}
+
+const PickHit* NearestHit(const vector<PickHit>& hits)
+{
+	const PickHit *best = 0;
+	for (uint a=0;a<hits.size();a++)
+		if (!best || hits[a].depth < best->depth)
+			best = &hits[a];
+	return best;
+}
@@ -0,0 +1,84 @@
+//-----------------------------------------------------------------------
+//  Upspring model editor
+//  Copyright 2005 Jelmer Cnossen
+//  This code is released under GPL license, see LICENSE.HTML for info.
+//-----------------------------------------------------------------------
+#ifndef UPS_PICKING_H
+#define UPS_PICKING_H
+
+struct MdlObject;
+struct Poly;
+class PolyMesh;
+class CompactPolyMesh;
+
+/*
+Selection without OpenGL. The pick region is the part of clip space that projects into a rectangle
+of the screen, the same volume gluPickMatrix selects in GL_SELECT mode. A click uses a small
+rectangle around the cursor, box selection uses the dragged rectangle.
+
+Instead of transforming the meshes, the six planes of the region are moved into the object space
+of each mesh, where a bounding volume hierarchy over its triangles is tested against them.
+*/
+struct PickRegion
+{
+	// toClip transforms to clip space, x0-y1 is the rectangle in normalized device coordinates
+	PickRegion(const Matrix& toClip, float x0, float y0, float x1, float y1);
+
+	bool Contains(const Vector3& p) const;
+	float Depth(const Vector3& p) const; // normalized device z
+
+	Matrix toClip;
+	// a point p is inside a plane when x*p.x + y*p.y + z*p.z + w >= 0
+	Vector4 planes[6];
+};
+
+class PolyMeshBVH
+{
+public:
+	void Build(PolyMesh *pm);
+	void Build(CompactPolyMesh *cpm);
+	// false if the mesh changed in size since Build. Vertices moved in place aren't noticed,
+	// the mesh deletes its BVH in InvalidateRenderData for that
+	bool IsBuiltFrom(PolyMesh *pm);
+	bool IsBuiltFrom(CompactPolyMesh *cpm);
+
+	// Adds (polygon index, depth) for every polygon that has a part inside the region,
+	// which has to be in the object space of the mesh. Hits are sorted by polygon index.
+	void Query(const PickRegion& region, vector<pair<int, float> >& hits);
+
+protected:
+	struct Node {
+		Vector3 min, max;
+		int first, count; // leaf: triangles [first, first+count), otherwise count=0 and the childs are first and first+1
+	};
+	struct Triangle {
+		Vector3 v[3];
+		int poly;
+	};
+
+	void AddPolygon(const vector<Vertex>& verts, const int *vi, int count, int poly);
+	void BuildTree();
+	void BuildNode(int node, int first, int count);
+
+	vector<Node> nodes;
+	vector<Triangle> tris;
+	uint numVerts, numPolys;
+};
+
+struct PickHit
+{
+	MdlObject *obj;
+	Poly *poly; // 0 when the object itself is picked
+	float depth; // nearest normalized device z of the part inside the region
+};
+
+#define PICK_POLYGONS 1 // report the polygons instead of the objects they belong to
+#define PICK_CENTERS 2 // object centers can be picked too
+
+// Finds everything inside the region, worldToClip is the view and projection.
+// Hits are in object order, and in polygon order within an object.
+void PickModel(MdlObject *root, const Matrix& worldToClip, float x0, float y0, float x1, float y1, int flags, vector<PickHit>& hits);
+// Returns the nearest hit, the first one wins if several are equally near
+const PickHit* NearestHit(const vector<PickHit>& hits);
+
+#endif
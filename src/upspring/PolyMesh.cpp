@@ -3,6 +3,10 @@
 
 #include "Model.h"
 #include "Util.h"
+#include "Picking.h"
+#include "ModelDrawer.h"
+#include "ThreadPool.h"
+#include "VertexHashGrid.h"
 
 
 // ------------------------------------------------------------------------------------------------
@@ -85,11 +89,27 @@ void Poly::RotateVerts ()
 // ------------------------------------------------------------------------------------------------
 
 
+PolyMesh::PolyMesh()
+{
+	renderData = 0;
+	bvh = 0;
+}
+
 PolyMesh::~PolyMesh()
 {
 	for (uint a=0;a<poly.size();a++)
 		if (poly[a]) delete poly[a]; 
 	poly.clear();
+
+	delete renderData;
+	delete bvh;
+}
+
+void PolyMesh::InvalidateRenderData()
+{
+	if (renderData)
+		renderData->Invalidate();
+	SAFE_DELETE(bvh);
 }
 
 // Special case... polymesh drawing is done in the ModelDrawer
@@ -113,7 +133,8 @@ Geometry* PolyMesh::Clone()
 	return cp;
 }
 
-void PolyMesh::Transform(const Matrix& transform)
+// shared by PolyMesh and CompactPolyMesh
+static void TransformVertices(vector<Vertex>& verts, const Matrix& transform)
 {
 	Matrix normalTransform, invTransform;
 	transform.inverse(invTransform);
@@ -132,63 +153,98 @@ void PolyMesh::Transform(const Matrix& transform)
 	}
 }
 
+void PolyMesh::Transform(const Matrix& transform)
+{
+	TransformVertices(verts, transform);
+	InvalidateRenderData();
+}
+
+
+// Position tolerance of IsEqualVertexTC and IsEqualVertexTCNormal, VertexHashGrid depends on it
+static const float VertexPosEpsilon = 0.001f;
 
 bool PolyMesh::IsEqualVertexTC (Vertex& a,Vertex& b)
 {		 
-	return a.pos.epsilon_compare (&b.pos, 0.001f) && 
+	return a.pos.epsilon_compare (&b.pos, VertexPosEpsilon) && 
 		a.tc[0].x == b.tc[0].x && a.tc[0].y == b.tc[0].y;
 }
 
 bool PolyMesh::IsEqualVertexTCNormal (Vertex& a, Vertex& b)
 {
-	return a.pos.epsilon_compare (&b.pos, 0.001f) && 
+	return a.pos.epsilon_compare (&b.pos, VertexPosEpsilon) && 
 		a.tc[0].x == b.tc[0].x && a.tc[0].y == b.tc[0].y &&
 		a.normal.epsilon_compare (&b.normal, 0.01f);
 }
 
 
+struct VertexMatch
+{
+	VertexMatch (Vertex& v, vector<Vertex>& items, PolyMesh::IsEqualVertexCB cb) : v(v), items(items), cb(cb) {}
+	bool operator()(int i) { return cb (v, items[i]); }
+
+	Vertex& v;
+	vector<Vertex>& items;
+	PolyMesh::IsEqualVertexCB cb;
+};
 
-void PolyMesh::OptimizeVertices (PolyMesh::IsEqualVertexCB cb)
+
+// Replaces verts by the used vertices with duplicates (according to cb) removed, old2new maps the old indices to the new ones
+static void WeldVertices (vector<Vertex>& verts, const vector<int>& usage, vector<int>& old2new, PolyMesh::IsEqualVertexCB cb)
 {
-	vector <int> old2new;
-	vector <int> usage;
 	vector <Vertex> nv;
 
-	old2new.resize(verts.size());
-	usage.resize (verts.size());
-	fill(usage.begin(),usage.end(),0);
+	// The hash grid is only valid for callbacks that compare positions with VertexPosEpsilon
+	bool hashed = (cb == &PolyMesh::IsEqualVertexTC || cb == &PolyMesh::IsEqualVertexTCNormal);
+	VertexHashGrid grid (hashed ? (uint)verts.size() : 0, VertexPosEpsilon);
 
-	for (uint a=0;a<poly.size();a++)
-	{
-		Poly *pl=poly[a];
-		for (uint b=0;b<pl->verts.size();b++)
-			usage[pl->verts[b]]++;
-	}
+	old2new.resize(verts.size());
 
 	for (uint a=0;a<verts.size();a++) {
-		bool matched=false;
+		int match = -1;
 
 		if (!usage[a])
 			continue;
 
-		for (uint b=0;b<nv.size();b++) {
-			Vertex *va = &verts[a];
-			Vertex *vb = &nv[b];
+		if (hashed) {
+			VertexMatch vm (verts[a], nv, cb);
+			match = grid.FindFirst (verts[a].pos, vm);
+		} else {
+			for (uint b=0;b<nv.size();b++) {
+				Vertex *va = &verts[a];
+				Vertex *vb = &nv[b];
 
-			if (cb(*va, *vb)) {
-				matched=true;
-				old2new[a] = b;
-				break;
+				if (cb(*va, *vb)) {
+					match = b;
+					break;
+				}
 			}
 		}
 
-		if (!matched) {
+		if (match >= 0)
+			old2new[a] = match;
+		else {
 			old2new[a] = nv.size();
+			if (hashed) grid.Add (verts[a].pos, nv.size());
 			nv.push_back (verts[a]);
 		}
 	}
 
 	verts = nv;
+}
+
+void PolyMesh::OptimizeVertices (PolyMesh::IsEqualVertexCB cb)
+{
+	vector <int> old2new;
+	vector <int> usage (verts.size(), 0);
+
+	for (uint a=0;a<poly.size();a++)
+	{
+		Poly *pl=poly[a];
+		for (uint b=0;b<pl->verts.size();b++)
+			usage[pl->verts[b]]++;
+	}
+
+	WeldVertices (verts, usage, old2new, cb);
 
 	// map the poly vertex-indices to the new set of vertices
 	for (uint a=0;a<poly.size();a++)
@@ -199,6 +255,21 @@ void PolyMesh::OptimizeVertices (PolyMesh::IsEqualVertexCB cb)
 	}
 }
 
+// removes every vertex index that is the same as the one before it
+static void RemoveDoubleLinkedVertices (vector<int>& pv)
+{
+	bool finished;
+	do {
+		finished=true;
+		for (uint i=0,j=(int)pv.size()-1;i<pv.size();j=i++)
+			if (pv[i] == pv[j]) {
+				pv.erase (pv.begin()+i);
+				finished=false;
+				break;
+			}
+	} while (!finished);
+}
+
 void PolyMesh::Optimize (PolyMesh::IsEqualVertexCB cb)
 {
 	OptimizeVertices(cb);
@@ -208,27 +279,18 @@ void PolyMesh::Optimize (PolyMesh::IsEqualVertexCB cb)
 	for (uint a=0;a<poly.size();a++) {
 		Poly *pl=poly[a];
 
-		bool finished;
-		do {
-			finished=true;
-			for (uint i=0,j=(int)pl->verts.size()-1;i<pl->verts.size();j=i++)
-				if (pl->verts[i] == pl->verts[j]) {
-					pl->verts.erase (pl->verts.begin()+i);
-					finished=false;
-					break;
-				}
-		} while (!finished);
-
+		RemoveDoubleLinkedVertices (pl->verts);
 		if (pl->verts.size()>=3)
 			npl.push_back(pl);
 		else
 			delete pl;
 	}
 	poly=npl;
+	InvalidateRenderData();
 }
 
 
-void PolyMesh::CalculateRadius(float& radius, const Matrix &tr, const Vector3& mid)
+static void VertexRadius(const vector<Vertex>& verts, float& radius, const Matrix &tr, const Vector3& mid)
 {
 	for(uint v=0;v<verts.size();v++)
 	{
@@ -239,6 +301,11 @@ void PolyMesh::CalculateRadius(float& radius, const Matrix &tr, const Vector3& m
 	}
 }
 
+void PolyMesh::CalculateRadius(float& radius, const Matrix &tr, const Vector3& mid)
+{
+	VertexRadius(verts, radius, tr, mid);
+}
+
 
 vector<Triangle> PolyMesh::MakeTris ()
 {
@@ -261,33 +328,98 @@ vector<Triangle> PolyMesh::MakeTris ()
 }
 
 
+struct PositionMatch
+{
+	PositionMatch (const Vector3& pos, vector<Vector3>& items) : pos(pos), items(items) {}
+	bool operator()(int i) { return items[i] == pos; }
+
+	const Vector3& pos;
+	vector<Vector3>& items;
+};
+
+// Vector3::operator== compares with EPSILON, so this uses the same hash grid as OptimizeVertices
+// to return the first matching position, exactly like a linear search would.
 void GenerateUniqueVectors(const std::vector<Vertex>& verts, 
 						   std::vector<Vector3>& vertPos, 
 						   std::vector<int>& old2new)
 {
 	old2new.resize(verts.size());
 
+	VertexHashGrid grid ((uint)(vertPos.size() + verts.size()), EPSILON);
+	for (uint b=0;b<vertPos.size();b++)
+		grid.Add (vertPos[b], b);
+
 	for (uint a=0;a<verts.size();a++) {
-		bool matched=false;
+		PositionMatch pm (verts[a].pos, vertPos);
+		int match = grid.FindFirst (verts[a].pos, pm);
 
-		for (uint b=0;b<vertPos.size();b++)
-			if (vertPos[b] == verts[a].pos) {
-				old2new[a] = b;
-				matched=true;
-				break;
-			}
-		if (!matched) {
+		if (match >= 0)
+			old2new[a] = match;
+		else {
 			old2new[a] = vertPos.size();
+			grid.Add (verts[a].pos, vertPos.size());
 			vertPos.push_back (verts[a].pos);
 		}
 	}
 }
 
-	
-struct FaceVert {
-	std::vector <int> adjacentFaces;
-};
+// Times GenerateUniqueVectors from 1k to 1M vertices, and compares the result with the linear search
+// it replaced for the sizes where that is still fast enough.
+// Every position is used by 4 vertices, each moved by less than EPSILON/2, like the corners of a welded quad mesh.
+bool unique_vectors_test()
+{
+	const uint sizes[] = { 1000, 10000, 100000, 1000000 };
+	const uint maxLinear = 10000;
+	uint seed = 12345;
+	bool ok = true;
+
+	for (int s=0;s<4;s++) {
+		uint count = sizes[s];
+		vector<Vertex> verts (count);
+		for (uint a=0;a<count;a++) {
+			uint k = a / 4;
+			Vector3 jitter;
+			for (int c=0;c<3;c++) {
+				seed = seed * 1664525 + 1013904223;
+				jitter[c] = ((seed >> 8) / float(1<<24) - 0.5f) * EPSILON * 0.5f;
+			}
+			verts[a].pos = Vector3 ((float)(k % 100), (float)(k / 100 % 100), (float)(k / 10000)) + jitter;
+		}
+		random_shuffle (verts.begin(), verts.end());
+
+		vector<Vector3> vertPos;
+		vector<int> old2new;
+		Timer timer;
+		GenerateUniqueVectors (verts, vertPos, old2new);
+		uint ticks = timer.GetTicks();
+
+		bool equal = true;
+		if (count <= maxLinear) {
+			vector<Vector3> linPos;
+			for (uint a=0;a<count && equal;a++) {
+				uint b = 0;
+				for (;b<linPos.size();b++)
+					if (linPos[b] == verts[a].pos) break;
+				if (b == linPos.size())
+					linPos.push_back (verts[a].pos);
+				if (old2new[a] != (int)b) equal = false;
+			}
+			if (linPos.size() != vertPos.size()) equal = false;
+		}
+		ok = ok && equal && vertPos.size() == (count + 3) / 4;
+
+		logger.Print ("GenerateUniqueVectors: %d vertices, %d positions, %u ms%s\n", count, (int)vertPos.size(), ticks,
+			count <= maxLinear ? (equal ? ", equal to linear search" : ", DIFFERS from linear search") : "");
+	}
+	return ok;
+}
+
 
+/*
+Every polygon corner gets the normal of its polygon plus the normals of the other polygons at the same position
+that differ less than maxSmoothAngle from it, where a normal that is already in the sum is not added twice.
+The polygons at each position are kept in one array (faceStart/faces), so no lists are allocated per corner.
+*/
 void PolyMesh::CalculateNormals2(float maxSmoothAngle)
 {
 	float ang_c = cosf (M_PI * maxSmoothAngle / 180.0f);
@@ -295,97 +427,120 @@ void PolyMesh::CalculateNormals2(float maxSmoothAngle)
 	vector<int> old2new;
 	GenerateUniqueVectors(verts, vertPos, old2new);
 
-	vector<vector<int> > new2old;
-	new2old.resize(vertPos.size());
-	for (uint a=0;a<old2new.size();a++)
-		new2old[old2new[a]].push_back(a);
-
 	// Calculate planes
-	std::vector <Plane> polyPlanes;
-	polyPlanes.resize (poly.size());
+	vector<Vector3> polyNormals (poly.size());
 	for (uint a=0;a<poly.size();a++)
-		polyPlanes[a] = poly[a]->CalcPlane (verts);
-
-	// Determine which faces are using which unique vertex
-	std::vector <FaceVert> faceVerts; // one per unique vertex
-	faceVerts.resize (old2new.size ());
+		polyNormals[a] = poly[a]->CalcPlane (verts).GetVector();
 
+	// The polygons using unique vertex p are faces[faceStart[p]] up to faces[faceStart[p+1]], 
+	// in polygon order and once for every corner
+	vector<int> faceStart (vertPos.size() + 1, 0);
+	uint numCorners = 0;
 	for (uint a=0;a<poly.size();a++) {
 		Poly *pl = poly[a];
 		for (uint v=0;v<pl->verts.size();v++)
-			faceVerts[old2new[pl->verts[v]]].adjacentFaces.push_back (a);
+			faceStart[old2new[pl->verts[v]] + 1] ++;
+		numCorners += pl->verts.size();
 	}
+	for (uint p=0;p<vertPos.size();p++)
+		faceStart[p+1] += faceStart[p];
 
-	// Calculate normals
-	int cnorm = 0;
-	for (uint a=0;a<poly.size();a++) cnorm += poly[a]->verts.size();
-	std::vector <Vector3> normals;
-	normals.resize (cnorm);
+	vector<int> faces (numCorners), next (faceStart.begin(), faceStart.end() - 1);
+	for (uint a=0;a<poly.size();a++) {
+		Poly *pl = poly[a];
+		for (uint v=0;v<pl->verts.size();v++)
+			faces[next[old2new[pl->verts[v]]] ++] = a;
+	}
 
-	cnorm = 0;
+	// Create a new vertex for every corner, with the calculated normal
+	vector <Vertex> newVertices;
+	newVertices.reserve (numCorners);
+	vector<Vector3> vnormals; // normals in the sum of the current corner
 	for (uint a=0;a<poly.size();a++) {
 		Poly *pl = poly[a];
+		const Vector3& normal = polyNormals[a];
+
 		for (uint v=0;v<pl->verts.size();v++)
 		{
-			FaceVert& fv = faceVerts[old2new[pl->verts[v]]];
-			std::vector<Vector3> vnormals;
-			vnormals.push_back(polyPlanes[a].GetVector());
-			for (uint adj = 0; adj < fv.adjacentFaces.size(); adj ++)
+			int p = old2new[pl->verts[v]];
+			vnormals.clear();
+			vnormals.push_back (normal);
+
+			for (int f=faceStart[p];f<faceStart[p+1];f++)
 			{
 				// Same poly?
-				if (fv.adjacentFaces [adj] == a)
+				if (faces[f] == (int)a)
 					continue;
 
-				Plane adjPlane = polyPlanes[fv.adjacentFaces[adj]];
-
 				// Spring 3DO style smoothing
-				float dot = adjPlane.GetVector ().dot (polyPlanes[a].GetVector());
-			//	logger.Print("Dot: %f\n",dot);
-				if (dot < ang_c) 
+				Vector3 adj = polyNormals[faces[f]];
+				if (adj.dot (normal) < ang_c) 
 					continue;
 
 				// see if the normal is unique for this vertex
-				bool isUnique = true;
-				for (uint norm = 0; norm < vnormals.size(); norm ++)
-					if (vnormals[norm] == adjPlane.GetVector ()) 
-					{
-						isUnique = false;
+				uint n;
+				for (n=0;n<vnormals.size();n++)
+					if (vnormals[n] == adj)
 						break;
-					}
-					
-				if (isUnique)
-					vnormals.push_back (adjPlane.GetVector());
+				if (n == vnormals.size())
+					vnormals.push_back (adj);
 			}
-			Vector3 normal;
-			for (uint n=0;n<vnormals.size();n++)
-				normal += vnormals[n];
 
-			if (normal.length () > 0.0f)
-				normal.normalize ();
-			normals [cnorm ++] = normal;
-		}
-	}
+			Vector3 sum;
+			for (uint n=0;n<vnormals.size();n++)
+				sum += vnormals[n];
+			if (sum.length () > 0.0f)
+				sum.normalize ();
 
-	// Create a new set of vertices with the calculated normals
-	std::vector <Vertex> newVertices;
-	newVertices.reserve(poly.size()*4); // approximate
-	cnorm = 0;
-	for (uint a=0;a<poly.size();a++) {
-		Poly *pl = poly[a];
-		for (uint v=0;v<pl->verts.size();v++) {
-			//FaceVert &fv = faceVerts[old2new[pl->verts[v]]]; //unused
 			Vertex nv = verts[pl->verts[v]];
-			nv.normal = normals[cnorm++];
+			nv.normal = sum;
 			newVertices.push_back (nv);
 			pl->verts [v] = newVertices.size () - 1;
 		}
 	}
 
 	// Optimize
-	verts = newVertices;
+	verts.swap (newVertices);
 	Optimize(&PolyMesh::IsEqualVertexTCNormal);
 }
 
+struct CalculateMeshNormals
+{
+	CalculateMeshNormals (vector<PolyMesh*> *meshes, float maxSmoothAngle) : meshes(meshes), maxSmoothAngle(maxSmoothAngle) {}
+
+	void operator()(int index)
+	{
+		PolyMesh *pm = (*meshes)[index];
+		if (maxSmoothAngle < 0.0f)
+			pm->CalculateNormals();
+		else
+			pm->CalculateNormals2(maxSmoothAngle);
+	}
+
+	vector<PolyMesh*> *meshes;
+	float maxSmoothAngle;
+};
+
+void CalculateObjectNormals(const vector<MdlObject*>& objects, float maxSmoothAngle)
+{
+	// GetPolyMesh converts and unshares the geometry, so every job gets a mesh of its own
+	vector<PolyMesh*> meshes;
+	for (uint a=0;a<objects.size();a++) {
+		PolyMesh *pm = objects[a]->GetPolyMesh();
+		if (pm)
+			meshes.push_back (pm);
+	}
+
+	if (meshes.size() > 1) {
+		ThreadPool pool;
+		pool.For ((int)meshes.size(), CalculateMeshNormals (&meshes, maxSmoothAngle));
+	} else if (!meshes.empty())
+		CalculateMeshNormals (&meshes, maxSmoothAngle) (0);
+
+	for (uint a=0;a<objects.size();a++)
+		objects[a]->InvalidateRenderData ();
+}
+
 // In short, the reason for the complexity of this function is:
 //  - creates a list of vertices where every vertex has a unique position (UV ignored)
 //  - doesn't allow the same poly normal to be added to the same vertex twice
@@ -437,12 +592,14 @@ void PolyMesh::CalculateNormals()
 		for (uint b=0;b<vlist.size();b++)
 			verts[vlist[b]].normal = sum;
 	}
+	InvalidateRenderData();
 }
 
 void PolyMesh::FlipPolygons()
 {
 	for (uint a=0;a<poly.size();a++)
 		poly[a]->Flip();
+	InvalidateRenderData();
 }
 
 
@@ -464,4 +621,259 @@ void PolyMesh::MoveGeometry (PolyMesh *dst)
 	verts.clear ();
 
 	InvalidateRenderData();
+	dst->InvalidateRenderData();
+}
+
+
+// ------------------------------------------------------------------------------------------------
+// CompactPolyMesh
+// ------------------------------------------------------------------------------------------------
+
+CompactPolyMesh::CompactPolyMesh()
+{
+	polyStart.push_back(0);
+	renderData = 0;
+	bvh = 0;
+}
+
+CompactPolyMesh::CompactPolyMesh(const CompactPolyMesh& src) : Geometry(src)
+{
+	renderData = 0;
+	bvh = 0;
+	*this = src;
+}
+
+CompactPolyMesh::~CompactPolyMesh()
+{
+	delete renderData;
+	delete bvh;
+}
+
+CompactPolyMesh& CompactPolyMesh::operator=(const CompactPolyMesh& src)
+{
+	verts = src.verts;
+	polyStart = src.polyStart;
+	indices = src.indices;
+	polyColor = src.polyColor;
+	polyTAColor = src.polyTAColor;
+	polyTexture = src.polyTexture;
+	polyFlags = src.polyFlags;
+	texNames = src.texNames;
+	textures = src.textures;
+
+	InvalidateRenderData();
+	return *this;
+}
+
+void CompactPolyMesh::InvalidateRenderData()
+{
+	if (renderData)
+		renderData->Invalidate();
+	SAFE_DELETE(bvh);
+}
+
+void CompactPolyMesh::Draw(ModelDrawer* drawer, Model *mdl, MdlObject *o)
+{
+	drawer->RenderCompactPolyMesh(this, mdl->mapping);
+}
+
+int CompactPolyMesh::AddTexture(const string& name, Texture *tex)
+{
+	for (uint a=0;a<texNames.size();a++)
+		if (texNames[a] == name && textures[a].Get() == tex)
+			return a;
+
+	texNames.push_back(name);
+	textures.push_back(tex);
+	return (int)texNames.size()-1;
+}
+
+void CompactPolyMesh::AddPoly(const int *vi, int count, int texture)
+{
+	indices.insert(indices.end(), vi, vi+count);
+	polyStart.push_back((int)indices.size());
+	polyColor.push_back(Vector3(1,1,1));
+	polyTAColor.push_back(-1);
+	polyTexture.push_back(texture);
+	polyFlags.push_back(0);
+}
+
+void CompactPolyMesh::Append(CompactPolyMesh *src)
+{
+	int vertOfs = (int)verts.size();
+	int indexOfs = (int)indices.size();
+	int firstPoly = NumPolys();
+
+	verts.insert(verts.end(), src->verts.begin(), src->verts.end());
+
+	indices.insert(indices.end(), src->indices.begin(), src->indices.end());
+	for (uint a=indexOfs;a<indices.size();a++)
+		indices[a] += vertOfs;
+
+	polyStart.insert(polyStart.end(), src->polyStart.begin()+1, src->polyStart.end());
+	for (uint a=firstPoly+1;a<polyStart.size();a++)
+		polyStart[a] += indexOfs;
+
+	polyColor.insert(polyColor.end(), src->polyColor.begin(), src->polyColor.end());
+	polyTAColor.insert(polyTAColor.end(), src->polyTAColor.begin(), src->polyTAColor.end());
+	polyFlags.insert(polyFlags.end(), src->polyFlags.begin(), src->polyFlags.end());
+
+	// map the texture indices of src to this mesh
+	vector<int> texMap(src->texNames.size());
+	for (uint a=0;a<texMap.size();a++)
+		texMap[a] = AddTexture(src->texNames[a], a < src->textures.size() ? src->textures[a].Get() : 0);
+	for (uint a=0;a<src->polyTexture.size();a++) {
+		int t = src->polyTexture[a];
+		polyTexture.push_back(t >= 0 ? texMap[t] : -1);
+	}
+
+	InvalidateRenderData();
+}
+
+void CompactPolyMesh::FlipPolygons()
+{
+	vector<int> pv;
+	for (int p=0;p<NumPolys();p++) {
+		int *vi = &indices[polyStart[p]];
+		int n = PolySize(p);
+		pv.assign(vi, vi+n);
+		for (int a=0;a<n;a++)
+			vi[n-a-1]=pv[(a+2)%n];
+	}
+	InvalidateRenderData();
+}
+
+bool CompactPolyMesh::HasSelectedPolys()
+{
+	for (uint a=0;a<polyFlags.size();a++)
+		if (polyFlags[a] & PF_Selected) return true;
+	return false;
+}
+
+void CompactPolyMesh::Optimize(PolyMesh::IsEqualVertexCB cb)
+{
+	vector <int> old2new;
+	vector <int> usage (verts.size(), 0);
+
+	for (uint a=0;a<indices.size();a++)
+		usage[indices[a]]++;
+
+	WeldVertices (verts, usage, old2new, cb);
+
+	// Remap the indices and remove double linked vertices, like PolyMesh::Optimize.
+	// The arrays are compacted in place, so polyStart[p+1] is read before it gets overwritten.
+	vector<int> pv;
+	int dst = 0, numPolys = NumPolys();
+	int start = 0, ofs = 0;
+	for (int p=0;p<numPolys;p++) {
+		int end = polyStart[p+1];
+		pv.clear();
+		for (int a=start;a<end;a++)
+			pv.push_back(old2new[indices[a]]);
+		start = end;
+
+		RemoveDoubleLinkedVertices (pv);
+		if (pv.size() < 3)
+			continue;
+
+		copy(pv.begin(), pv.end(), indices.begin()+ofs);
+		ofs += (int)pv.size();
+		polyStart[dst+1] = ofs;
+		polyColor[dst] = polyColor[p];
+		polyTAColor[dst] = polyTAColor[p];
+		polyTexture[dst] = polyTexture[p];
+		polyFlags[dst] = polyFlags[p];
+		dst++;
+	}
+
+	indices.resize(ofs);
+	polyStart.resize(dst+1);
+	polyColor.resize(dst);
+	polyTAColor.resize(dst);
+	polyTexture.resize(dst);
+	polyFlags.resize(dst);
+
+	InvalidateRenderData();
+}
+
+CompactPolyMesh* CompactPolyMesh::FromPolyMesh(PolyMesh *pm)
+{
+	CompactPolyMesh *cpm = new CompactPolyMesh;
+
+	uint numIndices = 0;
+	for (uint a=0;a<pm->poly.size();a++)
+		numIndices += (uint)pm->poly[a]->verts.size();
+
+	cpm->verts = pm->verts;
+	cpm->indices.reserve(numIndices);
+	cpm->polyStart.reserve(pm->poly.size()+1);
+	cpm->polyColor.reserve(pm->poly.size());
+	cpm->polyTAColor.reserve(pm->poly.size());
+	cpm->polyTexture.reserve(pm->poly.size());
+	cpm->polyFlags.reserve(pm->poly.size());
+
+	// consecutive polygons usually have the same texture
+	Poly *last = 0;
+	int lastTexture = -1;
+
+	for (uint a=0;a<pm->poly.size();a++) {
+		Poly *pl = pm->poly[a];
+
+		if (!last || last->texname != pl->texname || last->texture.Get() != pl->texture.Get())
+			lastTexture = (pl->texname.empty() && !pl->texture) ? -1 : cpm->AddTexture(pl->texname, pl->texture.Get());
+		last = pl;
+
+		cpm->indices.insert(cpm->indices.end(), pl->verts.begin(), pl->verts.end());
+		cpm->polyStart.push_back((int)cpm->indices.size());
+		cpm->polyColor.push_back(pl->color);
+		cpm->polyTAColor.push_back(pl->taColor);
+		cpm->polyTexture.push_back(lastTexture);
+		cpm->polyFlags.push_back((pl->isSelected ? PF_Selected : 0) | (pl->isCurved ? PF_Curved : 0));
+	}
+	return cpm;
+}
+
+Geometry* CompactPolyMesh::Clone()
+{
+	CompactPolyMesh *cp = new CompactPolyMesh(*this);
+
+	// Poly::Clone doesn't copy the selection either
+	for (uint a=0;a<cp->polyFlags.size();a++)
+		cp->polyFlags[a] &= ~PF_Selected;
+	return cp;
+}
+
+void CompactPolyMesh::Transform(const Matrix& transform)
+{
+	TransformVertices(verts, transform);
+	InvalidateRenderData();
+}
+
+PolyMesh* CompactPolyMesh::ToPolyMesh()
+{
+	PolyMesh *pm = new PolyMesh;
+
+	pm->verts = verts;
+	pm->poly.resize(NumPolys());
+	for (int p=0;p<NumPolys();p++) {
+		Poly *pl = pm->poly[p] = new Poly;
+		pl->verts.assign(indices.begin()+polyStart[p], indices.begin()+polyStart[p+1]);
+		pl->color = polyColor[p];
+		pl->taColor = polyTAColor[p];
+		pl->isSelected = (polyFlags[p] & PF_Selected) != 0;
+		pl->isCurved = (polyFlags[p] & PF_Curved) != 0;
+
+		int t = polyTexture[p];
+		if (t >= 0) {
+			pl->texname = texNames[t];
+			if (t < (int)textures.size()) // textures aren't serialized
+				pl->texture = textures[t];
+		}
+	}
+	return pm;
+}
+
+void CompactPolyMesh::CalculateRadius(float& radius, const Matrix &tr, const Vector3& mid)
+{
+	VertexRadius(verts, radius, tr, mid);
 }
@@ -171,6 +171,7 @@ public:
 	T* Get() const { return object; }
 	T* operator*() const { return object; }
 	T* operator->() const { return object; }
+	bool operator<(const RefPtr& r) const { return object < r.object; } // for sets and maps
 	
 private:
 	T* object;
@@ -15,8 +15,20 @@ TexGroupUI::TexGroupUI(TextureGroupHandler *tgh, TextureHandler *th)
 {
 	CreateUI ();
 
+	// Every texture is decoded here, the references keep them loaded while the dialog is open
+	vector<string> names;
 	for (map<string, TextureHandler::TexRef>::iterator ti=th->textures.begin();ti != th->textures.end(); ++ti)
-		texBrowser->AddTexture (ti->second.texture.Get());
+		names.push_back (ti->first);
+	th->DecodeTextures (names);
+
+	vector<RefPtr<Texture> > allTextures;
+	for (map<string, TextureHandler::TexRef>::iterator ti=th->textures.begin();ti != th->textures.end(); ++ti) {
+		Texture *tex = th->GetTexture (ti->first.c_str());
+		if (tex) {
+			allTextures.push_back (tex);
+			texBrowser->AddTexture (tex);
+		}
+	}
 
 	texBrowser->UpdatePositions();
 	current=0;
@@ -44,8 +56,8 @@ void TexGroupUI::InitGroupTexBrowser()
 {
 	groupTexBrowser->clear();
 	if (!current) return;
-	for (set<Texture*>::iterator i=current->textures.begin();i!=current->textures.end();++i)
-		groupTexBrowser->AddTexture(*i);
+	for (set<RefPtr<Texture> >::iterator i=current->textures.begin();i!=current->textures.end();++i)
+		groupTexBrowser->AddTexture(i->Get());
 	groupTexBrowser->UpdatePositions();
 	groupTexBrowser->redraw();
 }
@@ -10,6 +10,9 @@
 #include "Util.h"
 #include "CfgParser.h"
 #include "Image.h"
+#include "ThreadPool.h"
+#include "TextureCache.h"
+#include "nv_dds.h"
 
 #include <IL/il.h>
 #include <IL/ilu.h>
@@ -30,6 +33,7 @@ string Texture::textureLoadDir;
 Texture::Texture() 
 {
 	glIdent = 0;
+	compressed = 0;
 }
 
 Texture::Texture (const string& fn) {
@@ -44,6 +48,7 @@ bool Texture::Load (const string& fn, const string& hintpath)
 {
 	name = fltk::filename_name(fn.c_str());
 	glIdent = 0;
+	compressed = 0;
 
 	vector<string> paths;
 	paths.push_back ("");
@@ -52,17 +57,27 @@ bool Texture::Load (const string& fn, const string& hintpath)
 
 	bool succes=true;
 	for(uint a=0;a<paths.size();a++) {
+		// the file contents are needed for the cache key as well
+		string path = paths[a] + fn;
+		vector<char> buf;
+		if (!LoadFileContents (path.c_str(), buf) || buf.empty()) {
+			logger.Print ("Failed to load texture: Failed to open file %s\n", path.c_str());
+			succes = false;
+			continue;
+		}
+
 		Image *img = new Image;
 		try {
-			img->Load ( (paths[a] + fn).c_str());
+			img->LoadFromMemory (&buf[0], buf.size());
 			succes = true;
 		} catch(content_error& e) {
-			logger.Print ("Failed to load texture: %s\n", e.errMsg.c_str());
+			logger.Print ("Failed to load texture: Error loading image %s: %s\n", path.c_str(), e.errMsg.c_str());
 			succes = false;
 			delete img;
 		}
 		if (succes) {
 			SetImage(img);
+			cacheKey = TextureCache::MakeKey (&buf[0], buf.size());
 			break;
 		}
 	}
@@ -73,6 +88,7 @@ Texture::Texture (void *buf, int len, const char *_name)
 {
 	name = _name;
 	glIdent = 0;
+	compressed = 0;
 
 	Image *img = new Image;
 	try {
@@ -84,6 +100,7 @@ Texture::Texture (void *buf, int len, const char *_name)
 		return;
 	}
 	SetImage(img);
+	cacheKey = TextureCache::MakeKey (buf, len);
 }
 
 void Texture::SetImage(Image *img)
@@ -97,6 +114,53 @@ Texture::~Texture()
 		glDeleteTextures (1, &glIdent);
 		glIdent = 0;
 	}
+	delete compressed;
+}
+
+int Texture::MemoryUse ()
+{
+	int total = image ? image->MemoryUse() : 0;
+	for (uint a=0;a<mipmaps.size();a++)
+		if (mipmaps[a].Get() != image.Get())
+			total += mipmaps[a]->MemoryUse();
+	if (compressed)
+		total += TextureCache::MemoryUse (compressed);
+	return total;
+}
+
+void Texture::BuildMipmaps (bool useCache)
+{
+	mipmaps.clear();
+	SAFE_DELETE (compressed);
+	if (!image)
+		return;
+
+	ImgFormat format (image->format.HasAlpha () ? ImgFormat::RGBA : ImgFormat::RGB);
+	if (memcmp (&format, &image->format, sizeof(ImgFormat))) {
+		Image *conv = new Image;
+		conv->format = format;
+		image->Convert (conv);
+		image = conv;
+	}
+
+	useCache = useCache && TextureCache::IsEnabled () && !cacheKey.empty();
+	if (useCache && (compressed = TextureCache::Load (cacheKey)))
+		return;
+
+	// the GL needs power of two sizes
+	Image *base = image->ScaleToPow2 ();
+	mipmaps.push_back (base ? base : image.Get());
+
+	vector<Image*> levels;
+	mipmaps[0]->GenMipmaps (levels);
+	for (uint a=0;a<levels.size();a++)
+		mipmaps.push_back (levels[a]);
+
+	if (useCache) {
+		compressed = TextureCache::Store (cacheKey, mipmaps);
+		if (compressed)
+			mipmaps.clear();
+	}
 }
 
 bool Texture::VideoInit ()
@@ -107,33 +171,53 @@ bool Texture::VideoInit ()
 	bool mipmapped = true;
 	GLenum linear = true;
 
+	// the compressed levels are no use if the GL can't read them
+	bool canCompress = GLEW_EXT_texture_compression_s3tc != 0;
+	if (compressed && !canCompress)
+		SAFE_DELETE (compressed);
+
+	// usually done on a worker thread by TextureHandler::DecodeTextures
+	if (mipmaps.empty() && !compressed)
+		BuildMipmaps (canCompress);
+
 	glGenTextures(1, &glIdent);
 	glBindTexture(GL_TEXTURE_2D, glIdent);
 
 	GLenum format = image->format.HasAlpha () ? GL_RGBA : GL_RGB;
-	Image *conv = new Image;
-	conv->format = ImgFormat(format == GL_RGBA ? ImgFormat::RGBA : ImgFormat::RGB);
-	image->Convert (conv);
-	image = conv;
-
 	GLenum internalFormat = format;
 
+	// the rows of small RGB levels aren't 4 byte aligned
+	GLint alignment;
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
 	glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER, linear ? GL_LINEAR : GL_NEAREST);
 	if (mipmapped) {
 		if (linear) 
 			glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 		else
 			glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
-
-		gluBuild2DMipmaps(GL_TEXTURE_2D, internalFormat, conv->w, conv->h, format, GL_UNSIGNED_BYTE, conv->data);
 	} else {
 		if (linear) 
 			glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 		else
 			glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	}
 
-		glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, conv->w, conv->h, 0, format, GL_UNSIGNED_BYTE, conv->data);
+	if (compressed)
+		compressed->upload_texture2D ();
+	else {
+		uint numLevels = mipmapped ? mipmaps.size() : 1;
+		for (uint a=0;a<numLevels;a++) {
+			Image *level = mipmaps[a].Get();
+			glTexImage2D(GL_TEXTURE_2D, a, internalFormat, level->w, level->h, 0, format, GL_UNSIGNED_BYTE, level->data);
+		}
 	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+
+	// the GL has them now
+	mipmaps.clear();
+	SAFE_DELETE (compressed);
 	return true;
 }
 
@@ -143,8 +227,15 @@ bool Texture::VideoInit ()
 // ------------------------------------------------------------------------------------------------
 
 
+// Decoded textures that are not in use are released when they take more memory than this
+static const uint DefaultTextureMemoryLimit = 64 * 1024 * 1024;
+
 TextureHandler::TextureHandler ()
-{}
+{
+	useCounter = 0;
+	memoryLimit = DefaultTextureMemoryLimit;
+	decodePool = 0;
+}
 
 
 TextureHandler::~TextureHandler ()
@@ -154,54 +245,223 @@ TextureHandler::~TextureHandler ()
 	}
 	zips.clear();
 	textures.clear();
+	delete decodePool;
 }
 
 
-Texture* TextureHandler::GetTexture(const char *name)
+// renamed is set if the name was found with 00 appended
+map<string,TextureHandler::TexRef>::iterator TextureHandler::FindTexRef(const char *name, bool *renamed)
 {
 	string tmp = name;
 	transform(tmp.begin(), tmp.end(), tmp.begin(), ::tolower);
 
+	*renamed = false;
 	map<string,TexRef>::iterator ti = textures.find(tmp);
 	if (ti == textures.end()) {
 		tmp += "00";
 		ti = textures.find(tmp);
-		if (ti == textures.end()) {
+		if (ti == textures.end())
 			logger.Trace(NL_Debug,"Texture %s not found.\n", tmp.c_str());
-			return 0;
-		}
-		ti->second.texture->name = name; // HACK: start using the name without the 00 now
-		return ti->second.texture.Get();
+		else
+			*renamed = true;
 	}
+	return ti;
+}
 
-	return ti->second.texture.Get();
+Texture* TextureHandler::GetTexture(const char *name)
+{
+	bool renamed;
+	map<string,TexRef>::iterator ti = FindTexRef (name, &renamed);
+	if (ti == textures.end())
+		return 0;
+
+	TexRef &ref = ti->second;
+	ref.lastUse = ++useCounter;
+	if (!ref.texture && !ref.failed) {
+		ref.texture = LoadTexture (zips[ref.zip], ref.index, ti->first.c_str());
+		ref.failed = !ref.texture;
+		if (ref.texture)
+			FreeMemory (&ref);
+	}
+
+	if (renamed && ref.texture)
+		ref.texture->name = name; // HACK: start using the name without the 00 now
+	return ref.texture.Get();
 }
 
-Texture* TextureHandler::LoadTexture (ZipFile*zf,int index, const char *name)
+static bool TexRefLastUseCmp (const pair<uint, RefPtr<Texture>*>& a, const pair<uint, RefPtr<Texture>*>& b)
+{
+	return a.first < b.first;
+}
+
+// Releases the least recently used textures until the memory limit is met, 'keep' is never released
+void TextureHandler::FreeMemory (TexRef *keep)
+{
+	uint used = 0;
+	vector<pair<uint, RefPtr<Texture>*> > unused;
+
+	for (map<string,TexRef>::iterator ti = textures.begin(); ti != textures.end(); ++ti) {
+		TexRef &ref = ti->second;
+		if (!ref.texture || !ref.texture->image)
+			continue;
+
+		used += ref.texture->MemoryUse();
+		// only the handler references it, so no model or texture group uses it
+		if (&ref != keep && ref.texture->GetRefCount() == 1)
+			unused.push_back (make_pair (ref.lastUse, &ref.texture));
+	}
+
+	if (used <= memoryLimit)
+		return;
+
+	sort (unused.begin(), unused.end(), TexRefLastUseCmp);
+	for (uint a=0;a<unused.size() && used > memoryLimit;a++) {
+		RefPtr<Texture>& tex = *unused[a].second;
+		used -= tex->MemoryUse();
+		tex = 0;
+	}
+}
+
+// Reason DecodeImage failed. It isn't logged there, because the NL_Error callback of the editor opens a dialog.
+struct DecodeError
+{
+	DecodeError () : level(NL_Debug) {}
+	void Log () { if (!msg.empty()) logger.Trace (level, "%s", msg.c_str()); }
+
+	LogNotifyLevel level;
+	string msg;
+};
+
+// Can be called from several threads at once, key is set to the TextureCache key of the file
+static Image* DecodeImage (ZipFile *zf, int index, const char *name, string& key, DecodeError& error)
 {
 	int len=zf->GetFileLen (index);
-	char *buf=new char[len];
-	TError r = zf->ReadFile (index, buf);
 
-	if (r==RET_FAIL) {
-		logger.Trace (NL_Debug, "Failed to read texture file %s from zip\n",name);
-		delete[] buf;
-		return 0;
+	// stored files are decoded straight from the mapped archive
+	vector<char> buf;
+	void *data = (void*)zf->GetStoredData (index);
+	if (!data) {
+		buf.resize (len);
+		if (!len || zf->ReadFile (index, &buf[0]) == RET_FAIL) {
+			error.msg = SPrintf ("Failed to read texture file %s from zip\n", name);
+			return 0;
+		}
+		data = &buf[0];
 	}
 
-	Texture *tex = new Texture (buf, len, name);
-	if (!tex->IsLoaded ()) {
-		delete[] buf;
-		delete tex;
+	Image *img = new Image;
+	try {
+		img->LoadFromMemory (data, len);
+	} catch(content_error& e) {
+		delete img;
+		error.level = NL_Error;
+		error.msg = SPrintf ("Image loading exception: %s\n", e.what());
 		return 0;
 	}
+	key = TextureCache::MakeKey (data, len);
+	return img;
+}
 
-	//logger.Trace(NL_Debug, "Texture %s loaded.\n", name);
+Texture* TextureHandler::LoadTexture (ZipFile*zf,int index, const char *name)
+{
+	string key;
+	DecodeError error;
+	Image *img = DecodeImage (zf, index, name, key, error);
+	if (!img) {
+		error.Log ();
+		return 0;
+	}
 
-	delete[] buf;
+	Texture *tex = new Texture;
+	tex->name = name;
+	tex->SetImage (img);
+	tex->cacheKey = key;
 	return tex;
 }
 
+struct TextureDecodeJob
+{
+	TextureDecodeJob (vector<ZipFile*>& zips, vector<int>& zip, vector<int>& index, vector<const char*>& names, 
+		vector<Texture*>& textures, vector<DecodeError>& errors, bool buildMipmaps)
+		: zips(zips), zip(zip), index(index), names(names), textures(textures), errors(errors), buildMipmaps(buildMipmaps) {}
+
+	void operator()(int i) {
+		string key;
+		Image *img = DecodeImage (zips[zip[i]], index[i], names[i], key, errors[i]);
+		if (!img)
+			return;
+
+		Texture *tex = new Texture;
+		tex->name = names[i];
+		tex->SetImage (img);
+		tex->cacheKey = key;
+		if (buildMipmaps)
+			tex->BuildMipmaps ();
+		textures[i] = tex;
+	}
+
+	vector<ZipFile*>& zips;
+	vector<int>& zip;
+	vector<int>& index;
+	vector<const char*>& names;
+	vector<Texture*>& textures;
+	vector<DecodeError>& errors; // logged by DecodeTextures on the calling thread
+	bool buildMipmaps;
+};
+
+void TextureHandler::DecodeTextures (const vector<string>& names, bool buildMipmaps)
+{
+	vector<TexRef*> refs;
+	vector<const char*> keys;
+	set<TexRef*> added;
+
+	for (uint a=0;a<names.size();a++) {
+		bool renamed;
+		map<string,TexRef>::iterator ti = FindTexRef (names[a].c_str(), &renamed);
+		if (ti == textures.end() || ti->second.texture || ti->second.failed)
+			continue;
+		if (!added.insert (&ti->second).second)
+			continue;
+		refs.push_back (&ti->second);
+		keys.push_back (ti->first.c_str());
+	}
+
+	if (refs.empty())
+		return;
+
+	if (!decodePool)
+		decodePool = new ThreadPool;
+
+	// A batch is decoded by the pool, and then published here
+	uint batchSize = decodePool->NumThreads() * 4;
+	for (uint first=0;first<refs.size();first+=batchSize) {
+		uint count = min(batchSize, (uint)refs.size() - first);
+
+		vector<int> zip (count), index (count);
+		vector<const char*> batchNames (keys.begin() + first, keys.begin() + first + count);
+		vector<Texture*> batchTextures (count);
+		vector<DecodeError> errors (count);
+		for (uint a=0;a<count;a++) {
+			zip[a] = refs[first+a]->zip;
+			index[a] = refs[first+a]->index;
+		}
+
+		decodePool->For (count, TextureDecodeJob (zips, zip, index, batchNames, batchTextures, errors, buildMipmaps));
+
+		// like GetTexture, so the decoded textures count as used now and the memory limit is kept
+		for (uint a=0;a<count;a++) {
+			TexRef *ref = refs[first+a];
+			errors[a].Log ();
+			ref->failed = !batchTextures[a];
+			if (batchTextures[a]) {
+				ref->texture = batchTextures[a];
+				ref->lastUse = ++useCounter;
+			}
+		}
+		FreeMemory (0);
+	}
+}
+
 
 
 // KLOOTNOTE: replacement for strlwr()
@@ -246,57 +506,44 @@ static char* FixTextureName(char* temp) {
 
 bool TextureHandler::Load (const char *zip) 
 {
-	FILE *f = fopen (zip, "rb");
-
-	if (f) {
-		ZipFile *zf = new ZipFile;
-		if (zf->Init (f) == RET_FAIL) {
-			logger.Trace (NL_Error, "Failed to load zip archive %s\n", zip);
-			fclose (f);
-			return false;
-		}
-
-		const char *imgExt[]={ "bmp", "jpg", "tga", "png", "dds", "pcx", "pic", "gif", "ico", 0 };
+	ZipFile *zf = new ZipFile;
 
-		// Add the zip entries to the texture set
-		for (int a=0;a<zf->GetNumFiles ();a++)
-		{
-			char tempFile[64];
-			zf->GetFilename (a, tempFile, sizeof(tempFile));
+	if (zf->Init (zip) == RET_FAIL) {
+		logger.Trace (NL_Error, "Failed to load zip archive %s\n", zip);
+		delete zf;
+		return false;
+	}
 
-			char *ext=FixTextureName (tempFile);
-			if (ext)
-			{
-				int x=0;
-				for (x=0;imgExt[x];x++)
-					if (!strcmp(imgExt[x],ext)) break;
+	const char *imgExt[]={ "bmp", "jpg", "tga", "png", "dds", "pcx", "pic", "gif", "ico", 0 };
 
-				if (!imgExt[x])
-					continue;
+	// Add the zip entries to the texture set
+	for (int a=0;a<zf->GetNumFiles ();a++)
+	{
+		char tempFile[64];
+		zf->GetFilename (a, tempFile, sizeof(tempFile));
 
-				if (textures.find(tempFile) != textures.end())
-					continue;
+		char *ext=FixTextureName (tempFile);
+		if (ext)
+		{
+			int x=0;
+			for (x=0;imgExt[x];x++)
+				if (!strcmp(imgExt[x],ext)) break;
 
-				TexRef ref;
-				ref.zip = zips.size();
-				ref.index = a;
-				ref.texture = LoadTexture (zf,a, tempFile);
+			if (!imgExt[x])
+				continue;
 
-				if(textures.find(tempFile)!=textures.end())
-					logger.Trace(NL_Debug,"Texture %s already loaded\n", tempFile);
+			if (textures.find(tempFile) != textures.end())
+				continue;
 
-				TexRef &tr = textures[tempFile];
-				tr.texture = ref.texture;
-				tr.index = a;;
-				tr.zip = zips.size();
-			}
+			// only register it, GetTexture decodes it when it's used
+			TexRef &tr = textures[tempFile];
+			tr.index = a;
+			tr.zip = zips.size();
 		}
-
-		fclose (f);
-
-		zips.push_back (zf);
 	}
 
+	zips.push_back (zf);
+
 	return false;
 }
 
@@ -324,6 +571,21 @@ bool TextureGroupHandler::Load(const char *fn)
 	if (!cfg) 
 		return false;
 
+	// decode all the textures of all groups in parallel first
+	vector<string> names;
+	for (list<CfgListElem>::iterator li = cfg->childs.begin(); li != cfg->childs.end(); ++li) {
+		CfgList *gc = dynamic_cast<CfgList*>(li->value);
+		CfgList *texlist = gc ? dynamic_cast<CfgList*>(gc->GetValue("textures")) : 0;
+		if (!texlist) continue;
+
+		for (list<CfgListElem>::iterator i=texlist->childs.begin();i!=texlist->childs.end();i++) {
+			CfgLiteral *l=dynamic_cast<CfgLiteral*>(i->value);
+			if (l && !l->value.empty())
+				names.push_back (l->value);
+		}
+	}
+	textureHandler->DecodeTextures (names);
+
 	for (list<CfgListElem>::iterator li = cfg->childs.begin(); li != cfg->childs.end(); ++li) {
 		CfgList *gc = dynamic_cast<CfgList*>(li->value);
 		if (!gc) continue;
@@ -388,7 +650,7 @@ CfgList* TextureGroupHandler::MakeConfig (TextureGroup *tg)
 
 	CfgList *texlist=new CfgList;
 	int index=0;
-	for (set<Texture*>::iterator t=tg->textures.begin();t!=tg->textures.end();++t) {
+	for (set<RefPtr<Texture> >::iterator t=tg->textures.begin();t!=tg->textures.end();++t) {
 		sprintf (n,"tex%d", index++);
 		texlist->AddLiteral (n, (*t)->name.c_str());
 	}
@@ -397,69 +659,200 @@ CfgList* TextureGroupHandler::MakeConfig (TextureGroup *tg)
 	return gc;
 }
 
-/*
-TextureAtlas::TextureAtlas()
-{
-}
+// ------------------------------------------------------------------------------------------------
+// TextureAtlas
+// ------------------------------------------------------------------------------------------------
 
-static int texCompareFunc(Texture *a, Texture *b)
+TextureAtlas::TextureAtlas (const ImgFormat& fmt)
 {
-	return a->height - b->height;
+	format = fmt;
+	width = height = 0;
 }
 
-Texture* TextureAtlas::Process(int w, int h, const std::vector<Texture*>& src)
+int TextureAtlas::Add (Image *img)
 {
-	std::map <int, std::vector <Texture*> > texmth;
-
-	for (int a=0;a<src.size();a++)
-		texmth [src[a]->height].push_back (src[a]);
+	Image *conv = img;
+	if (memcmp (&format, &img->format, sizeof(ImgFormat))) {
+		conv = new Image;
+		conv->format = format;
+		img->Convert (conv);
+	}
 
-	int surf = 0;
+	uint len = conv->w * conv->h * format.bytesPerPixel;
+	string key = SPrintf ("%dx%d-", conv->w, conv->h) + TextureCache::MakeKey (conv->data, len);
+	map<string, int>::iterator ci = contents.find (key);
+	if (ci != contents.end() && !memcmp (images[ci->second]->data, conv->data, len)) {
+		if (conv != img)
+			delete conv;
+		return ci->second;
+	}
 
-	if (w < 0 || h < 0) {
-		for (int a=0;a<src.size();a++)
-		{
-			Texture * t = src[a];
-			surf += t->width * t->height;
-		}
-		w = sqrtf (surf);
-		h = sqrtf (surf);
+	if (conv == img)
+		conv = img->Clone ();
+	if (ci == contents.end())
+		contents [key] = images.size();
+	images.push_back (conv);
+	return images.size() - 1;
+}
 
-		int x=1,y=1;
-		while (x < w) x*=2;
-		while (y < h) y*=2;
+struct AtlasPackOrder
+{
+	AtlasPackOrder (vector<RefPtr<Image> >& images, bool allowTranspose) : images(images), allowTranspose(allowTranspose) {}
+	int Side (int i) const { return allowTranspose ? max(images[i]->w, images[i]->h) : images[i]->h; }
+	bool operator()(int a, int b) const {
+		if (Side (a) != Side (b))
+			return Side (a) > Side (b);
+		return images[a]->w * images[a]->h > images[b]->w * images[b]->h;
 	}
+	vector<RefPtr<Image> >& images;
+	bool allowTranspose;
+};
 
-	this->w = w;
-	this->h = h;
+static inline bool RectContains (const TextureAtlas::Rect& a, const TextureAtlas::Rect& b)
+{
+	return b.x >= a.x && b.y >= a.y && b.x + b.w <= a.x + a.w && b.y + b.h <= a.y + a.h;
+}
 
-	for (int a=0;a<sorted.size();a++)
-		AddTexture (sorted[a]);
+bool TextureAtlas::PackRects (int w, int h, bool allowTranspose)
+{
+	vector<int> order (images.size());
+	for (uint a=0;a<order.size();a++)
+		order[a] = a;
+	stable_sort (order.begin(), order.end(), AtlasPackOrder (images, allowTranspose));
+
+	vector<Rect> freeRects;
+	Rect all = { 0, 0, w, h, false };
+	freeRects.push_back (all);
+
+	rects.resize (images.size());
+	for (uint i=0;i<order.size();i++) {
+		Image *img = images[order[i]].Get();
+
+		// best short side fit
+		Rect best = { 0, 0, 0, 0, false };
+		int bestShort = 0x7fffffff, bestLong = 0x7fffffff;
+		for (uint f=0;f<freeRects.size();f++) {
+			const Rect& fr = freeRects[f];
+			for (int t=0;t<(allowTranspose && img->w != img->h ? 2 : 1);t++) {
+				int rw = t ? img->h : img->w, rh = t ? img->w : img->h;
+				if (rw > fr.w || rh > fr.h)
+					continue;
+				int shortSide = min(fr.w - rw, fr.h - rh), longSide = max(fr.w - rw, fr.h - rh);
+				if (shortSide < bestShort || (shortSide == bestShort && longSide < bestLong)) {
+					Rect r = { fr.x, fr.y, rw, rh, t != 0 };
+					best = r;
+					bestShort = shortSide;
+					bestLong = longSide;
+				}
+			}
+		}
+		if (bestShort == 0x7fffffff)
+			return false;
+		rects[order[i]] = best;
+
+		// split the free rectangles that overlap it into the parts left and right, above and below
+		vector<Rect> split;
+		for (uint f=0;f<freeRects.size();f++) {
+			const Rect& fr = freeRects[f];
+			if (best.x >= fr.x + fr.w || best.x + best.w <= fr.x || best.y >= fr.y + fr.h || best.y + best.h <= fr.y) {
+				split.push_back (fr);
+				continue;
+			}
+			if (best.x > fr.x) {
+				Rect r = { fr.x, fr.y, best.x - fr.x, fr.h, false };
+				split.push_back (r);
+			}
+			if (best.x + best.w < fr.x + fr.w) {
+				Rect r = { best.x + best.w, fr.y, fr.x + fr.w - best.x - best.w, fr.h, false };
+				split.push_back (r);
+			}
+			if (best.y > fr.y) {
+				Rect r = { fr.x, fr.y, fr.w, best.y - fr.y, false };
+				split.push_back (r);
+			}
+			if (best.y + best.h < fr.y + fr.h) {
+				Rect r = { fr.x, best.y + best.h, fr.w, fr.y + fr.h - best.y - best.h, false };
+				split.push_back (r);
+			}
+		}
 
-	return 0;
+		// keep only the rectangles that don't lie inside another (of two equal ones, the first)
+		freeRects.clear();
+		for (uint a=0;a<split.size();a++) {
+			uint b;
+			for (b=0;b<split.size();b++)
+				if (b != a && RectContains (split[b], split[a]) && (b < a || !RectContains (split[a], split[b])))
+					break;
+			if (b == split.size())
+				freeRects.push_back (split[a]);
+		}
+	}
+	return true;
 }
 
-TextureAtlas::Slot* TextureAtlas::AddTexture(Texture *t)
+bool TextureAtlas::Pack (int w, int h, int maxSize, bool allowTranspose)
 {
-	HeightSet& s = hs [t->height];
-	
-	if (s.totalw + t->width > w) {
-		s.row ++;
-		s.totalw = 0;
+	width = w;
+	height = h;
+	if (PackRects (w, h, allowTranspose))
+		return true;
+
+	// continue with the power of two sizes from w x h
+	int pw = 1, ph = 1;
+	while (pw < w) pw *= 2;
+	while (ph < h) ph *= 2;
+	if (pw == w && ph == h) {
+		if (pw <= ph) pw *= 2;
+		else ph *= 2;
 	}
-	Slot slot;
-	slot.x = totalw;
-	slot.w = t->width;
-	slot.h = t->height;
-	s.slots.push_back (slot);
 
-	totalw += slot.w;
+	while (pw <= maxSize && ph <= maxSize) {
+		width = pw;
+		height = ph;
+		if (PackRects (pw, ph, allowTranspose))
+			return true;
+		if (pw <= ph) pw *= 2;
+		else ph *= 2;
+	}
+	return false;
+}
 
-	return &s.slots.back();
+Image* TextureAtlas::CreateImage ()
+{
+	Image *atlas = new Image (width, height, format);
+	uint bpp = format.bytesPerPixel;
+
+	for (uint a=0;a<images.size();a++) {
+		Image *img = images[a].Get();
+		const Rect& r = rects[a];
+		if (!r.transposed) {
+			img->Blit (atlas, 0, 0, r.x, r.y, img->w, img->h);
+			continue;
+		}
+		// pixel x,y of the image goes to y,x of the rectangle
+		for (int y=0;y<img->h;y++)
+			for (int x=0;x<img->w;x++)
+				memcpy (&atlas->data [((r.y + x) * width + r.x + y) * bpp], &img->data [(y * img->w + x) * bpp], bpp);
+	}
+	return atlas;
 }
 
+void TextureAtlas::MapUV (int index, float u, float v, float& au, float& av)
+{
+	const Rect& r = rects[index];
+	if (r.transposed)
+		swap(u, v);
+	au = (r.x + 0.5f + u * (r.w - 1)) / width;
+	av = (r.y + 0.5f + v * (r.h - 1)) / height;
+}
 
-*/
+float TextureAtlas::Occupancy ()
+{
+	int used = 0;
+	for (uint a=0;a<images.size();a++)
+		used += images[a]->w * images[a]->h;
+	return (width > 0 && height > 0) ? used / float(width * height) : 0.0f;
+}
 
 
 // ------------------------------------------------------------------------------------------------
@@ -575,3 +968,93 @@ TextureBinTree::Node* TextureBinTree::AddNode (Image *subtex)
 }
 
 
+static inline uint AtlasTestRand (uint& seed)
+{
+	seed = seed * 1664525 + 1013904223;
+	return seed >> 8;
+}
+
+// Packs 200 generated sets of 3DO textures with TextureAtlas and with TextureBinTree, and prints the occupancy,
+// total atlas area and packing time of both. Both start at 256x256 and grow the same way, TextureBinTree
+// gets the textures in the order they were made and stores duplicates again.
+// Each set has 10-80 textures of 8 to 128 pixels per side, about 20% are 1x1 colors and 10% are duplicates.
+bool texture_atlas_test()
+{
+	const int numModels = 200, startSize = 256, maxSize = 4096;
+	const int sides[] = { 8, 16, 16, 32, 32, 32, 64, 64, 64, 128, 128, 24, 48, 96 };
+	const int numSides = sizeof(sides) / sizeof(int);
+	ImgFormat fmt (ImgFormat::RGB);
+
+	uint seed = 12345;
+
+	double atlasArea = 0.0, treeArea = 0.0, atlasOcc = 0.0, treeOcc = 0.0;
+	uint atlasTicks = 0, treeTicks = 0;
+	int numFailed = 0;
+
+	for (int m=0;m<numModels;m++) {
+		vector<RefPtr<Image> > images;
+		int count = 10 + AtlasTestRand (seed) % 71;
+		for (int a=0;a<count;a++) {
+			uint r = AtlasTestRand (seed) % 10;
+			if (r == 0 && !images.empty()) { // duplicate
+				images.push_back (images [AtlasTestRand (seed) % images.size()]);
+				continue;
+			}
+			Image *img;
+			if (r <= 2)
+				img = new Image (1, 1, fmt);
+			else
+				img = new Image (sides [AtlasTestRand (seed) % numSides], sides [AtlasTestRand (seed) % numSides], fmt);
+			for (int b=0;b<img->w * img->h * 3;b++)
+				img->data[b] = (uchar)AtlasTestRand (seed);
+			images.push_back (img);
+		}
+
+		Timer timer;
+		TextureAtlas atlas (fmt);
+		for (uint a=0;a<images.size();a++)
+			atlas.Add (images[a].Get());
+		bool packed = atlas.Pack (startSize, startSize, maxSize, true);
+		atlasTicks += timer.GetTicks();
+
+		// grown like TextureAtlas::Pack does it for power of two sizes
+		timer.Reset ();
+		int w = startSize, h = startSize, used = 0;
+		bool treePacked = false;
+		while (!treePacked && w <= maxSize && h <= maxSize) {
+			TextureBinTree tree;
+			tree.Init (w, h, &fmt);
+			treePacked = true;
+			used = 0;
+			for (uint a=0;a<images.size() && treePacked;a++) {
+				treePacked = tree.AddNode (images[a].Get()) != 0;
+				used += images[a]->w * images[a]->h;
+			}
+			if (!treePacked) {
+				if (w <= h) w *= 2;
+				else h *= 2;
+			}
+		}
+		treeTicks += timer.GetTicks();
+
+		if (!packed || !treePacked) {
+			numFailed++;
+			continue;
+		}
+		atlasArea += atlas.Width() * atlas.Height();
+		atlasOcc += atlas.Occupancy();
+		treeArea += w * h;
+		treeOcc += used / float(w * h);
+	}
+
+	int n = numModels - numFailed;
+	if (n > 0) {
+		logger.Print ("TextureAtlas:   %d%% average occupancy, %.1f Mpixels total, %u ms\n", 
+			(int)(atlasOcc * 100.0 / n + 0.5), atlasArea / 1e6, atlasTicks);
+		logger.Print ("TextureBinTree: %d%% average occupancy, %.1f Mpixels total, %u ms\n", 
+			(int)(treeOcc * 100.0 / n + 0.5), treeArea / 1e6, treeTicks);
+	}
+	if (numFailed)
+		logger.Print ("Texture atlas test: %d of %d texture sets didn't fit in %dx%d\n", numFailed, numModels, maxSize, maxSize);
+	return !numFailed && atlasArea <= treeArea;
+}
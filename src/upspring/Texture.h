@@ -11,6 +11,8 @@
 
 class ZipFile;
 class CfgList;
+class ThreadPool;
+namespace nv_dds { class CDDSImage; }
 
 class Texture : public Referenced
 {
@@ -28,15 +30,32 @@ public:
 	void SetImage (Image *img);
 	int Width() { return image->w; }
 	int Height() { return image->h; }
+	int MemoryUse ();
+
+	// Converts the image to the format for the GL and creates the mipmap levels for VideoInit.
+	// It doesn't use GL, so it can run on a worker thread. VideoInit calls it if it didn't happen yet.
+	// With useCache and a cacheKey, the levels are loaded from the TextureCache, or compressed and stored in it.
+	void BuildMipmaps (bool useCache=true);
 
 	uint glIdent;
 	string name;
 	RefPtr<Image> image;
+	// levels for VideoInit to upload, [0] is the image or a copy scaled to power of two sizes
+	vector<RefPtr<Image> > mipmaps;
+	// DXT compressed levels from the TextureCache, which VideoInit uploads instead
+	nv_dds::CDDSImage *compressed;
+	// TextureCache key of the source file, empty if the texture isn't cached
+	string cacheKey;
 
 	static string textureLoadDir;
 };
 
-// manages 3do textures
+/*
+Manages 3do textures. Load only registers the images in an archive, a texture is decoded
+the first time GetTexture asks for it. When the decoded textures use more than the memory limit,
+the least recently used ones that nothing else references (like the polygons of the current model
+or a texture group) are released again, and decoded again when they are needed.
+*/
 class TextureHandler
 {
 public:
@@ -44,21 +63,37 @@ public:
 	~TextureHandler ();
 
 	bool Load (const char *zip); // load archive
-	Texture* GetTexture (const char *name);
+	Texture* GetTexture (const char *name); // the caller should keep a RefPtr to it
+	void SetMemoryLimit (uint bytes) { memoryLimit = bytes; }
+
+	// Decodes the named textures that aren't loaded yet on a thread pool, so the GetTexture calls for them 
+	// don't have to. The worker threads decode the images and build their mipmaps (or load them from the TextureCache),
+	// the textures are added to the handler on the calling thread after each batch, which also logs the failures
+	// and applies the memory limit. GL uploads (Texture::VideoInit) are left to the caller.
+	// Without buildMipmaps only the images are decoded, for textures that are never drawn.
+	void DecodeTextures (const vector<string>& names, bool buildMipmaps=true);
 
 protected:
 	Texture* LoadTexture (ZipFile *zf, int index, const char *name);
 
 	struct TexRef {
-		TexRef (){zip=index=0; }
+		TexRef (){zip=index=0; lastUse=0; failed=false; }
 
 		int zip;
 		int index;
 		RefPtr<Texture> texture;
+		uint lastUse; // value of useCounter at the last GetTexture, or when DecodeTextures loaded it
+		bool failed; // decoding failed, don't try again
 	};
 
+	void FreeMemory (TexRef *keep);
+	map<string,TexRef>::iterator FindTexRef (const char *name, bool *renamed);
+
 	vector <ZipFile *> zips;
 	map <string, TexRef> textures;
+	uint useCounter;
+	uint memoryLimit;
+	ThreadPool *decodePool; // created by the first DecodeTextures call
 
 	friend class TexGroupUI;
 };
@@ -68,7 +103,7 @@ class TextureGroup
 {
 public:
 	string name;
-	set <Texture *> textures;
+	set <RefPtr<Texture> > textures;
 };
 
 class TextureGroupHandler
@@ -132,30 +167,46 @@ protected:
 };
 
 /*
+Packs a set of images into one, used to convert 3DO textures to a single S3O texture.
+Images with the same size and contents are stored once. Pack uses the MaxRects algorithm:
+the images are placed from the largest to the smallest, each in the free rectangle that leaves
+the shortest side over, and the free space is kept as a list of maximal (overlapping) rectangles.
+Images can be stored transposed (width and height swapped) if that fits better.
+*/
 class TextureAtlas
 {
 public:
-	TextureAtlas();
+	struct Rect {
+		int x, y, w, h; // in the atlas, w and h are swapped for transposed images
+		bool transposed;
+	};
 
-	Texture* Process(const std::vector <Texture*>& src);
-protected:
-	int w,h;
+	TextureAtlas (const ImgFormat& fmt);
 
-	struct Slot {
-		int x, w, h;
-		Texture *texture;
-	};
+	// Adds a copy in the format of the atlas and returns its index
+	int Add (Image *img);
+	// Tries w x h first, and if the images don't fit, power of two sizes up to maxSize by doubling the smaller side
+	bool Pack (int w, int h, int maxSize, bool allowTranspose);
+	// Creates the atlas image, the caller owns it
+	Image* CreateImage ();
+
+	// Maps texture coordinates of an image to the atlas. 0 and 1 go to the centers of the edge pixels,
+	// so nothing of the neighbouring images bleeds in.
+	void MapUV (int index, float u, float v, float& au, float& av);
 
-	struct HeightSet {
-		HeightSet() { totalw=row=0; }
-		int totalw;
-		int row;
-		std::list<Slot> slots;
-	}
-	std::map<int, HeightSet> hs;
+	int Width () { return width; }
+	int Height () { return height; }
+	int NumImages () { return images.size(); }
+	float Occupancy (); // part of the atlas covered by images
 
-	Slot* AddTexture(Texture *t);
+protected:
+	bool PackRects (int w, int h, bool allowTranspose);
+
+	ImgFormat format;
+	vector<RefPtr<Image> > images;
+	vector<Rect> rects;
+	map<string, int> contents; // size and content hash -> image index
+	int width, height;
 };
-*/
 
 #endif // JC_TEXTURE_H
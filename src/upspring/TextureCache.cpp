@@ -0,0 +1,291 @@
+//-----------------------------------------------------------------------
+//  Upspring model editor
+//  Copyright 2005 Jelmer Cnossen
+//  This code is released under GPL license, see LICENSE.HTML for info.
+//-----------------------------------------------------------------------
+#include "EditorIncl.h"
+#include "EditorDef.h"
+
+#include "TextureCache.h"
+#include "Util.h"
+#include "nv_dds.h"
+
+#ifdef WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+// ------------------------------------------------------------------------------------------------
+// DXT compression
+// ------------------------------------------------------------------------------------------------
+
+// Reads the block of 4x4 pixels at bx,by as RGBA, pixels outside the image repeat the last row or column
+static void GetBlock (Image *img, int bx, int by, uchar *block)
+{
+	int bpp = img->format.bytesPerPixel;
+	for (int y=0;y<4;y++) {
+		int sy = min(by*4 + y, img->h - 1);
+		const uchar *row = img->data + sy * img->w * bpp;
+		for (int x=0;x<4;x++, block+=4) {
+			const uchar *p = row + min(bx*4 + x, img->w - 1) * bpp;
+			block[0] = p[0];
+			block[1] = p[1];
+			block[2] = p[2];
+			block[3] = bpp == 4 ? p[3] : 255;
+		}
+	}
+}
+
+static inline uint To565 (const int *c)
+{
+	return ((c[0] >> 3) << 11) | ((c[1] >> 2) << 5) | (c[2] >> 3);
+}
+
+static inline void From565 (uint c, int *rgb)
+{
+	int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+	rgb[0] = (r << 3) | (r >> 2);
+	rgb[1] = (g << 2) | (g >> 4);
+	rgb[2] = (b << 3) | (b >> 2);
+}
+
+/*
+The end points are the corners of the bounding box of the colors, on the diagonal that follows them
+(red and blue are flipped when they go down where green goes up), moved inwards by 1/16th of the box,
+which lowers the error of the colors in between. Each pixel then gets the nearest of the 4 palette colors.
+*/
+static void CompressColorBlock (const uchar *block, uchar *dst)
+{
+	int mn[3] = { 255, 255, 255 }, mx[3] = { 0, 0, 0 };
+	for (int i=0;i<16;i++)
+		for (int c=0;c<3;c++) {
+			mn[c] = min(mn[c], (int)block[i*4+c]);
+			mx[c] = max(mx[c], (int)block[i*4+c]);
+		}
+
+	int covR = 0, covB = 0;
+	for (int i=0;i<16;i++) {
+		int g = block[i*4+1] * 2 - mn[1] - mx[1];
+		covR += (block[i*4] * 2 - mn[0] - mx[0]) * g;
+		covB += (block[i*4+2] * 2 - mn[2] - mx[2]) * g;
+	}
+	if (covR < 0) swap(mn[0], mx[0]);
+	if (covB < 0) swap(mn[2], mx[2]);
+
+	for (int c=0;c<3;c++) {
+		int inset = (mx[c] - mn[c]) / 16;
+		mx[c] -= inset;
+		mn[c] += inset;
+	}
+
+	// color0 > color1 selects the 4 color mode
+	uint c0 = To565 (mx), c1 = To565 (mn);
+	if (c0 < c1) swap(c0, c1);
+
+	uint indices = 0;
+	if (c0 != c1) {
+		int pal[4][3];
+		From565 (c0, pal[0]);
+		From565 (c1, pal[1]);
+		for (int c=0;c<3;c++) {
+			pal[2][c] = (2 * pal[0][c] + pal[1][c]) / 3;
+			pal[3][c] = (pal[0][c] + 2 * pal[1][c]) / 3;
+		}
+
+		for (int i=0;i<16;i++) {
+			const uchar *p = &block[i*4];
+			int best = 0, bestDist = 0x7fffffff;
+			for (int a=0;a<4;a++) {
+				int dr = p[0] - pal[a][0], dg = p[1] - pal[a][1], db = p[2] - pal[a][2];
+				int dist = dr*dr + dg*dg + db*db;
+				if (dist < bestDist) {
+					bestDist = dist;
+					best = a;
+				}
+			}
+			indices |= best << (i*2);
+		}
+	}
+
+	dst[0] = c0 & 0xff;
+	dst[1] = c0 >> 8;
+	dst[2] = c1 & 0xff;
+	dst[3] = c1 >> 8;
+	for (int a=0;a<4;a++)
+		dst[4+a] = (indices >> (a*8)) & 0xff;
+}
+
+// Alpha end points are the minimum and maximum, so fully transparent and opaque pixels stay exact
+static void CompressAlphaBlock (const uchar *block, uchar *dst)
+{
+	int mn = 255, mx = 0;
+	for (int i=0;i<16;i++) {
+		mn = min(mn, (int)block[i*4+3]);
+		mx = max(mx, (int)block[i*4+3]);
+	}
+
+	// alpha0 > alpha1 selects the 8 value mode, 3 bits per pixel
+	uint bits[2] = { 0, 0 };
+	if (mx != mn) {
+		int pal[8];
+		pal[0] = mx;
+		pal[1] = mn;
+		for (int a=2;a<8;a++)
+			pal[a] = ((8-a) * mx + (a-1) * mn) / 7;
+
+		for (int i=0;i<16;i++) {
+			int v = block[i*4+3];
+			int best = 0, bestDist = 256;
+			for (int a=0;a<8;a++) {
+				int dist = abs(v - pal[a]);
+				if (dist < bestDist) {
+					bestDist = dist;
+					best = a;
+				}
+			}
+			bits[i/8] |= best << ((i%8) * 3);
+		}
+	}
+
+	dst[0] = mx;
+	dst[1] = mn;
+	for (int a=0;a<3;a++) {
+		dst[2+a] = (bits[0] >> (a*8)) & 0xff;
+		dst[5+a] = (bits[1] >> (a*8)) & 0xff;
+	}
+}
+
+void CompressDXT (Image *img, bool alpha, uchar *dst)
+{
+	uchar block[64];
+	for (int by=0;by<(img->h+3)/4;by++)
+		for (int bx=0;bx<(img->w+3)/4;bx++) {
+			GetBlock (img, bx, by, block);
+			if (alpha) {
+				CompressAlphaBlock (block, dst);
+				dst += 8;
+			}
+			CompressColorBlock (block, dst);
+			dst += 8;
+		}
+}
+
+// ------------------------------------------------------------------------------------------------
+// TextureCache
+// ------------------------------------------------------------------------------------------------
+
+// Part of the key, so changing the way the levels are built or compressed makes the old files unused
+static const uint CacheVersion = 1;
+
+string TextureCache::directory;
+
+void TextureCache::SetDirectory (const string& path)
+{
+	directory = path;
+	if (path.empty())
+		return;
+
+	// fails if it already exists, and otherwise storing fails as well
+#ifdef WIN32
+	_mkdir (path.c_str());
+#else
+	mkdir (path.c_str(), 0755);
+#endif
+}
+
+// 64 bit FNV-1a hash and the length
+string TextureCache::MakeKey (const void *data, uint len)
+{
+	unsigned long long h = 14695981039346656037ULL ^ CacheVersion;
+	const uchar *p = (const uchar *)data;
+	for (uint a=0;a<len;a++) {
+		h ^= p[a];
+		h *= 1099511628211ULL;
+	}
+	return SPrintf ("%08x%08x-%x", (uint)(h >> 32), (uint)h, len);
+}
+
+static bool IsPow2 (uint x) { return x && !(x & (x-1)); }
+
+nv_dds::CDDSImage* TextureCache::Load (const string& key)
+{
+	if (directory.empty())
+		return 0;
+
+	// the levels are stored with the bottom row first like they are uploaded, so they aren't flipped
+	nv_dds::CDDSImage *dds = new nv_dds::CDDSImage;
+	if (!dds->load (directory + key + ".dds", false)) {
+		delete dds;
+		return 0;
+	}
+
+	// anything but what Store writes is ignored
+	uint w = dds->get_width(), h = dds->get_height(), levels = 1;
+	while ((w >> levels) || (h >> levels))
+		levels ++;
+	if (!dds->is_compressed() || dds->get_type() != nv_dds::TextureFlat || !IsPow2 (w) || !IsPow2 (h) || dds->get_num_mipmaps() + 1 != levels) {
+		logger.Trace (NL_Debug, "Ignoring invalid texture cache file %s.dds\n", key.c_str());
+		delete dds;
+		return 0;
+	}
+	return dds;
+}
+
+static bool HasTransparency (Image *img)
+{
+	if (img->format.bytesPerPixel != 4)
+		return false;
+
+	uint n = img->w * img->h;
+	for (uint a=0;a<n;a++)
+		if (img->data[a*4+3] != 255)
+			return true;
+	return false;
+}
+
+nv_dds::CDDSImage* TextureCache::Store (const string& key, const vector<RefPtr<Image> >& mipmaps)
+{
+	if (mipmaps.empty())
+		return 0;
+
+	bool alpha = HasTransparency (mipmaps[0].Get());
+	uint blockSize = alpha ? 16 : 8;
+
+	nv_dds::CTexture tex;
+	vector<uchar> buf;
+	for (uint a=0;a<mipmaps.size();a++) {
+		Image *level = mipmaps[a].Get();
+		uint size = ((level->w + 3) / 4) * ((level->h + 3) / 4) * blockSize;
+		buf.resize (size);
+		CompressDXT (level, alpha, &buf[0]);
+
+		if (a == 0)
+			tex.create (level->w, level->h, 1, size, &buf[0]);
+		else
+			tex.add_mipmap (nv_dds::CSurface (level->w, level->h, 1, size, &buf[0]));
+	}
+
+	nv_dds::CDDSImage *dds = new nv_dds::CDDSImage;
+	dds->create_textureFlat (alpha ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGBA_S3TC_DXT1_EXT, alpha ? 4 : 3, tex);
+
+	if (!directory.empty()) {
+		// Written to a temporary file first, so a file that another thread is storing is never loaded half written.
+		// If the same texture was stored in the mean time, the rename fails on windows, which is fine.
+		string fn = directory + key + ".dds";
+		string tmp = fn + SPrintf (".%p.tmp", dds);
+		if (!dds->save (tmp, false) || rename (tmp.c_str(), fn.c_str()) != 0) {
+			remove (tmp.c_str());
+			logger.Trace (NL_Debug, "Failed to store texture cache file %s\n", fn.c_str());
+		}
+	}
+	return dds;
+}
+
+int TextureCache::MemoryUse (nv_dds::CDDSImage *dds)
+{
+	int total = dds->get_size();
+	for (uint a=0;a<dds->get_num_mipmaps();a++)
+		total += dds->get_mipmap(a).get_size();
+	return total;
+}
@@ -0,0 +1,47 @@
+//-----------------------------------------------------------------------
+//  Upspring model editor
+//  Copyright 2005 Jelmer Cnossen
+//  This code is released under GPL license, see LICENSE.HTML for info.
+//-----------------------------------------------------------------------
+#ifndef UPS_TEXTURE_CACHE_H
+#define UPS_TEXTURE_CACHE_H
+
+#include "Referenced.h"
+#include "Image.h"
+
+namespace nv_dds { class CDDSImage; }
+
+/*
+Keeps the mipmaps of the textures that were loaded before as DDS files in a directory, so they don't have
+to be built again. The levels are compressed to DXT1, or DXT5 if the texture has transparent pixels,
+which also makes them take a quarter (DXT5) to an eighth (DXT1) of the video memory.
+
+The files are named after a hash of the contents of the source file, so a changed texture gets a new entry,
+and the same texture in several archives shares one. Load and Store can be called from several threads.
+*/
+class TextureCache
+{
+public:
+	// Creates the directory if needed, an empty path disables the cache
+	static void SetDirectory (const string& path);
+	static bool IsEnabled () { return !directory.empty(); }
+
+	static string MakeKey (const void *data, uint len);
+
+	// Returns the cached levels, or 0 if there are none
+	static nv_dds::CDDSImage* Load (const string& key);
+	// Compresses the levels and saves them, the result is returned even if saving failed
+	static nv_dds::CDDSImage* Store (const string& key, const vector<RefPtr<Image> >& mipmaps);
+
+	// Size of the compressed levels in bytes
+	static int MemoryUse (nv_dds::CDDSImage *dds);
+
+protected:
+	static string directory;
+};
+
+// Compresses an RGB or RGBA image to DXT1 blocks, or DXT5 blocks if alpha is true.
+// dst needs 8 (DXT1) or 16 (DXT5) bytes for every block of 4x4 pixels, rows of blocks start with the first row of the image.
+void CompressDXT (Image *img, bool alpha, uchar *dst);
+
+#endif
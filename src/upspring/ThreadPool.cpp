@@ -0,0 +1,112 @@
+//-----------------------------------------------------------------------
+//  Upspring model editor
+//  Copyright 2005 Jelmer Cnossen
+//  This code is released under GPL license, see LICENSE.HTML for info.
+//-----------------------------------------------------------------------
+#include "EditorIncl.h"
+#include "EditorDef.h"
+#include "ThreadPool.h"
+
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+ThreadPool::ThreadPool (int n)
+{
+	if (n <= 0)
+		n = GetProcessorCount ();
+
+	numThreads = n;
+	running = 0;
+	pending = 0;
+	quit = false;
+
+	for (int a=0;a<numThreads;a++) {
+		fltk::Thread t;
+		if (fltk::create_thread (t, WorkerProc, this) >= 0) {
+#ifndef WIN32
+			pthread_detach (t); // workers are never joined, the destructor waits for 'running' instead
+#endif
+			lock.lock ();
+			running ++;
+			lock.unlock ();
+		}
+	}
+}
+
+ThreadPool::~ThreadPool ()
+{
+	Wait ();
+
+	lock.lock ();
+	quit = true;
+	lock.signal ();
+	while (running > 0)
+		lock.wait ();
+	lock.unlock ();
+}
+
+int ThreadPool::GetProcessorCount ()
+{
+#ifdef WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo (&info);
+	int n = info.dwNumberOfProcessors;
+#else
+	int n = (int)sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+	return n > 0 ? n : 1;
+}
+
+void ThreadPool::AddJob (Job *job)
+{
+	lock.lock ();
+	if (!running) {
+		// no worker threads could be created, so run it right here
+		lock.unlock ();
+		job->Run ();
+		delete job;
+		return;
+	}
+	jobs.push_back (job);
+	pending ++;
+	lock.signal ();
+	lock.unlock ();
+}
+
+void ThreadPool::Wait ()
+{
+	lock.lock ();
+	while (pending > 0)
+		lock.wait ();
+	lock.unlock ();
+}
+
+void* ThreadPool::WorkerProc (void *data)
+{
+	ThreadPool *pool = (ThreadPool *)data;
+
+	pool->lock.lock ();
+	for (;;) {
+		while (pool->jobs.empty () && !pool->quit)
+			pool->lock.wait ();
+
+		if (pool->jobs.empty ())
+			break;
+
+		Job *job = pool->jobs.front ();
+		pool->jobs.pop_front ();
+		pool->lock.unlock ();
+
+		job->Run ();
+		delete job;
+
+		pool->lock.lock ();
+		pool->pending --;
+		pool->lock.signal ();
+	}
+	pool->running --;
+	pool->lock.signal ();
+	pool->lock.unlock ();
+	return 0;
+}
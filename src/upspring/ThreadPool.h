@@ -0,0 +1,62 @@
+//-----------------------------------------------------------------------
+//  Upspring model editor
+//  Copyright 2005 Jelmer Cnossen
+//  This code is released under GPL license, see LICENSE.HTML for info.
+//-----------------------------------------------------------------------
+#ifndef UPS_THREADPOOL_H
+#define UPS_THREADPOOL_H
+
+#include <fltk/Threads.h>
+#include <deque>
+
+/*
+Runs independent jobs on a fixed set of worker threads.
+Jobs must not touch the GUI or the GL context, those are only valid on the main thread.
+*/
+class ThreadPool
+{
+public:
+	struct Job {
+		virtual ~Job() {}
+		virtual void Run() = 0;
+	};
+
+	ThreadPool (int numThreads = 0); // 0 means one thread per processor
+	~ThreadPool ();
+
+	void AddJob (Job *job); // the pool deletes the job after running it
+	void Wait (); // blocks until all jobs added so far have finished
+
+	int NumThreads () { return numThreads; }
+
+	// Calls f(i) for every i in [0, count) and returns when all calls are done
+	template<typename Fn>
+	void For (int count, Fn f)
+	{
+		for (int i=0;i<count;i++)
+			AddJob (new ForJob<Fn> (f, i));
+		Wait ();
+	}
+
+	static int GetProcessorCount ();
+
+protected:
+	template<typename Fn>
+	struct ForJob : Job {
+		ForJob (Fn f, int i) : f(f), index(i) {}
+		void Run () { f(index); }
+		Fn f;
+		int index;
+	};
+
+	static void* WorkerProc (void *data);
+
+	fltk::SignalMutex lock;
+	std::deque<Job*> jobs;
+	int numThreads;
+	int running; // number of worker threads still alive
+	int pending; // jobs added but not yet finished
+	bool quit;
+};
+
+#endif
@@ -9,57 +9,21 @@
 #include "EditorDef.h"
 
 #include "CfgParser.h"
+#include "Util.h"
 
 #include "AnimationUI.h"
 #include "BackupManager.h"
+#include "AnimEvaluator.h"
 
 #include <fltk/run.h>
 
 
-#ifdef WIN32
-#include <windows.h>
-
-class Timer {
-	LARGE_INTEGER startCounter;
-
-	public:
-		void Reset() {
-			QueryPerformanceCounter(&startCounter);
-		}
-
-		unsigned int GetTicks(void) {
-			LARGE_INTEGER cur;
-			QueryPerformanceCounter(&cur);
-
-			cur.QuadPart -= startCounter.QuadPart;
-			cur.QuadPart *= 1000;
-
-			LARGE_INTEGER tickps;
-			QueryPerformanceFrequency(&tickps);
-			cur.QuadPart /= tickps.QuadPart;
-
-			return (DWORD) cur.QuadPart;
-		}
-};
-
-#else
-// #error implement tick counting stuff for other OSes here
-// KLOOTNOTE: stub Timer replacement
-class Timer {
-	unsigned int startCounter;
-
-	public:
-		void Reset(void) {}
-		unsigned int GetTicks(void) { return 0; }
-};
-#endif
-
-
 TimelineUI::TimelineUI(IEditor* editor) {
 	callback = editor;
 	time = 0.0f;
 	isPlaying = false;
 	timer = new Timer;
+	animEval = new AnimEvaluator;
 
 	CreateUI();
 
@@ -70,6 +34,7 @@ TimelineUI::~TimelineUI()
 {
 	delete window;
 	delete timer;
+	delete animEval;
 }
 
 
@@ -107,7 +72,11 @@ void TimelineUI::idle_cb (void *arg)
 		ui->time = 0;
 
 	Model *mdl = ui->callback->GetMdl ();
-	if (mdl->root) mdl->root->UpdateAnimation (ui->time);
+	if (mdl->root) {
+		if (!ui->animEval->IsBuiltFrom (mdl->root))
+			ui->animEval->Build (mdl->root);
+		ui->animEval->Evaluate (ui->time);
+	}
 
 	// update views
 	ui->callback->RedrawViews();
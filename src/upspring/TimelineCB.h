@@ -6,6 +6,7 @@
 
 	IEditor *callback;
 	Timer *timer;
+	AnimEvaluator *animEval;
 
 	float time;
 	unsigned int prevTicks;
@@ -446,6 +446,7 @@ struct ETextureTool : Tool
 					pm->poly[a]->texname = tex->name;
 				}
 			}
+			pm->InvalidateRenderData();
 		}
 		for (uint a=0;a<o->childs.size();a++)
 			applyTexture(o->childs[a],tex);
@@ -506,6 +507,7 @@ struct EPolyColorTool : Tool
 				pi->texname.clear();
 				pi->texture=0;
 			 }
+		o->InvalidateRenderData();
 		for (uint a=0;a<o->childs.size();a++)
 			applyColor (o->childs[a], color);
 	}
@@ -537,6 +539,7 @@ struct EPolyFlipTool : Tool
 		for (PolyIterator pi(o);!pi.End();pi.Next())
 			 if (pi->isSelected)
 				 pi->Flip ();
+		o->InvalidateRenderData();
 	}
 
 	bool toggle (bool enable) { return true; }
@@ -560,6 +563,7 @@ struct ERotateTexTool : Tool
 		for (PolyIterator p(o);!p.End();p.Next())
 			 if (p->isSelected)
 				 p->RotateVerts();
+		o->InvalidateRenderData();
 	}
 
 	bool toggle (bool enable) { return true; }
@@ -658,30 +662,19 @@ FltkImage* FltkImage::Load(const char *filebuf, int filelen)
 
 void Tools::LoadImages()
 {
-	FILE *f = fopen("data/buttons.ups", "rb");
-	if (!f) {
+	ZipFile zf;
+	if (zf.Init("data/buttons.ups") != RET_OK) {
 		fltk::message("Failed to load data/buttons.ups");
 	}
 	else
 	{
-		ZipFile zf;
-		zf.Init(f);
-
 		for(int a=0;a<tools.size();a++) {
 			if (!tools[a]->imageFile)
 				continue;
 
 			std::string fn = tools[a]->imageFile;
 
-			int zipIndex=-1;
-			for (int fi=0;fi<zf.GetNumFiles();fi++) {
-				char zfn [64];
-				zf.GetFilename(fi, zfn, sizeof(zfn));
-				if (!STRCASECMP(zfn, fn.c_str())) {
-					zipIndex = fi;
-					break;
-				}
-			}
+			int zipIndex=zf.Find(fn.c_str());
 
 			if (zipIndex>=0) {
 				int len = zf.GetFileLen(zipIndex);
@@ -701,7 +694,6 @@ void Tools::LoadImages()
 			} else
 				fltk::message("Couldn't find %s in data/buttons.ups", fn.c_str());
 		}
-		fclose(f);
 	}
 }
 
@@ -129,7 +129,7 @@ void UVViewWindow::DrawScene ()
 	vector <MdlObject*> objs = mdl->GetObjectList ();
 	for (uint a=0;a<objs.size();a++) {
 		MdlObject *obj = objs[a];
-		for (PolyIterator pi(obj);!pi.End();pi.Next()) {
+		for (ConstPolyIterator pi(obj);!pi.End();pi.Next()) {
 			if (!pi.verts())
 				continue;
 
@@ -233,6 +233,7 @@ void MappingUI::flipUVs ()
 
 		for (VertexIterator vi(o); !vi.End(); vi.Next())
 			vi->tc[0].y = 1.0f - vi->tc[0].y;
+		o->InvalidateRenderData();
 	}
 }
 
@@ -247,6 +248,7 @@ void MappingUI::mirrorUVs()
 
 		for (VertexIterator vi(o); !vi.End(); vi.Next())
 			vi->tc[0].x = 1.0f - vi->tc[0].x;
+		o->InvalidateRenderData();
 	}
 }
 
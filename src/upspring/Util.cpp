@@ -9,6 +9,12 @@
 
 #include "Util.h"
 
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
 Logger logger;
 
 
@@ -71,6 +77,53 @@ string ReadString (int offset, FILE *f)
 	return str;
 }
 
+bool LoadFileContents (const char *filename, vector<char>& data)
+{
+	FILE *f = fopen (filename, "rb");
+	if (!f)
+		return false;
+
+	fseek (f, 0, SEEK_END);
+	long len = ftell(f);
+	fseek (f, 0, SEEK_SET);
+
+	bool ok = len >= 0;
+	if (ok) {
+		data.resize (len);
+		ok = !len || fread (&data[0], len, 1, f) == 1;
+	}
+	fclose (f);
+	return ok;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Timer
+// ------------------------------------------------------------------------------------------------
+
+double Timer::GetSeconds()
+{
+#ifdef WIN32
+	LARGE_INTEGER cur, tickps;
+	QueryPerformanceCounter(&cur);
+	QueryPerformanceFrequency(&tickps);
+	return (double)cur.QuadPart / (double)tickps.QuadPart;
+#else
+	timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec * 0.000001;
+#endif
+}
+
+void Timer::Reset()
+{
+	start = GetSeconds();
+}
+
+unsigned int Timer::GetTicks()
+{
+	return (unsigned int)((GetSeconds() - start) * 1000.0);
+}
+
 // ------------------------------------------------------------------------------------------------
 // Globals
 // ------------------------------------------------------------------------------------------------
@@ -100,9 +100,24 @@ struct InputBuffer
 
 std::string ReadString (int offset, FILE *f);
 std::string ReadZStr (FILE*f);
+bool LoadFileContents (const char *filename, std::vector<char>& data); // reads the whole file with a single fread
 void WriteZStr (FILE *f, const std::string& s);
 std::string GetFilePath (const std::string& fn);
 void AddTrailingSlash(std::string& tld);
 
 
 std::string SPrintf(const char *fmt, ...);
+
+
+// Millisecond tick counter, used for animation playback and timing of batch jobs
+class Timer
+{
+public:
+	Timer() { Reset(); }
+	void Reset();
+	unsigned int GetTicks(); // milliseconds since Reset()
+
+protected:
+	static double GetSeconds();
+	double start;
+};
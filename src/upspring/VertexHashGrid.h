@@ -0,0 +1,75 @@
+//-----------------------------------------------------------------------
+//  Upspring model editor
+//  Copyright 2005 Jelmer Cnossen
+//  This code is released under GPL license, see LICENSE.HTML for info.
+//-----------------------------------------------------------------------
+#ifndef UPS_VERTEX_HASH_GRID_H
+#define UPS_VERTEX_HASH_GRID_H
+
+/*
+Hash grid over positions, so vertex welding doesn't have to compare every vertex with all vertices
+kept so far. ImportUVCoords uses it to find polygons by their center.
+The cells are bigger than the probe box around a vertex, so only the (usually one, at most 8)
+cells overlapping that box have to be searched. Hash collisions between cells only add
+candidates, the match function still makes the final decision.
+*/
+class VertexHashGrid
+{
+public:
+	VertexHashGrid (uint maxItems, float epsilon)
+	{
+		radius = epsilon * 2.0f; // a bit larger than epsilon, to be safe against rounding
+		cellSize = epsilon * 4.0f;
+
+		uint size = 64;
+		while (size < maxItems * 2)
+			size *= 2;
+		head.resize (size, -1);
+		mask = size - 1;
+		next.reserve (maxItems);
+	}
+
+	// items have to be added with consecutive indices, starting at 0
+	void Add (const Vector3& pos, int index)
+	{
+		uint h = CellHash (Cell(pos.x), Cell(pos.y), Cell(pos.z));
+		assert (index == (int)next.size());
+		next.push_back (head[h]);
+		head[h] = index;
+	}
+
+	// returns the lowest index near pos for which match(index) is true, or -1
+	template<typename MatchFn>
+	int FindFirst (const Vector3& pos, MatchFn& match)
+	{
+		long long lo[3], hi[3];
+		for (int a=0;a<3;a++) {
+			lo[a] = Cell (pos[a] - radius);
+			hi[a] = Cell (pos[a] + radius);
+		}
+
+		int best = -1;
+		for (long long x=lo[0];x<=hi[0];x++)
+			for (long long y=lo[1];y<=hi[1];y++)
+				for (long long z=lo[2];z<=hi[2];z++)
+					for (int i = head[CellHash(x,y,z)]; i >= 0; i = next[i])
+						if ((best < 0 || i < best) && match (i))
+							best = i;
+		return best;
+	}
+
+protected:
+	long long Cell (float p) { return (long long)floor (p / cellSize); }
+	uint CellHash (long long x, long long y, long long z)
+	{
+		unsigned long long h = x * 73856093ULL ^ y * 19349663ULL ^ z * 83492791ULL;
+		return (uint)(h ^ (h >> 32)) & mask;
+	}
+
+	float radius, cellSize;
+	uint mask;
+	vector<int> head; // first item in each bucket
+	vector<int> next; // next item in the same bucket, per item
+};
+
+#endif
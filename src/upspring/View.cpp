@@ -15,6 +15,7 @@
 #include "Model.h"
 #include "Tools.h"
 #include "CfgParser.h"
+#include "Picking.h"
 
 const int PopupBoxW = 32;
 const int PopupBoxH = 18;
@@ -992,6 +993,61 @@ void EditorViewWindow::PopSelector () {
 	ViewWindow::PopSelector();
 }
 
+// Same pick region as ViewWindow::Select, but without rendering in GL_SELECT mode.
+// Only the projection matrix is read back from GL.
+void EditorViewWindow::Select(float sx, float sy, int w, int h, bool box)
+{
+	Model *mdl = editor->GetMdl();
+	if (!mdl || !mdl->root)
+		return;
+
+	make_current();
+
+	float glProj[16];
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	SetupProjectionMatrix();
+	glGetFloatv(GL_PROJECTION_MATRIX, glProj);
+
+	Matrix proj, view;
+	for (int a=0;a<16;a++) // GL stores the matrix in column order
+		proj.v(a&3, a>>2) = glProj[a];
+	GetViewMatrix(view);
+
+	int vp[4];
+	glGetIntegerv(GL_VIEWPORT, vp);
+
+	// the rectangle in normalized device coordinates, y goes up in GL
+	float x0 = (sx - vp[0]) / vp[2] * 2.0f - 1.0f;
+	float x1 = (sx + w - vp[0]) / vp[2] * 2.0f - 1.0f;
+	float y0 = (this->h() - (sy + h) - vp[1]) / vp[3] * 2.0f - 1.0f;
+	float y1 = (this->h() - sy - vp[1]) / vp[3] * 2.0f - 1.0f;
+
+	int flags = 0;
+	if (GetConfig(CFG_POLYSELECT) != 0.0f) flags |= PICK_POLYGONS;
+	if (GetConfig(CFG_OBJCENTERS) != 0.0f) flags |= PICK_CENTERS;
+
+	vector<PickHit> hits;
+	PickModel(mdl->root, view * proj, x0, y0, x1, y1, flags, hits);
+
+	Vector3 pos;
+	if (box) {
+		for (uint a=0;a<hits.size();a++) {
+			ViewSelector *sel = hits[a].poly ? (ViewSelector*)hits[a].poly->selector : hits[a].obj->selector;
+			sel->Toggle(pos, !sel->IsSelected());
+		}
+	} else {
+		const PickHit *nearest = NearestHit(hits);
+		if (nearest) {
+			ViewSelector *sel = nearest->poly ? (ViewSelector*)nearest->poly->selector : nearest->obj->selector;
+			sel->Toggle(pos, !sel->IsSelected());
+		}
+	}
+
+	if (!hits.empty())
+		editor->SelectionUpdated ();
+}
+
 void EditorViewWindow::Serialize(CfgList& cfg, bool store)
 {
 	ViewWindow::Serialize (cfg, store);
@@ -45,7 +45,7 @@ protected:
 	Vector3 FindSelCoords (int sx, int sy);
 	void resize (int x,int y,int w, int h);
 	void InitGL ();
-	void Select (float sx, float sy, int w, int h, bool box);
+	virtual void Select (float sx, float sy, int w, int h, bool box);
 	void DeSelect ();
 	void PushSelector (ViewSelector *s);
 	void PopSelector ();
@@ -118,6 +118,7 @@ public:
 	void ShowViewModifyMenu(int x,int y);
 
 	void SetupProjectionMatrix ();
+	void Select (float sx, float sy, int w, int h, bool box); // picks the model on the CPU, see Picking.h
 	void DrawScene ();
 	void Draw2D ();
 	void DrawLight();
@@ -8,6 +8,16 @@
 #include "ZipFile.h"
 
 #include <zlib.h>
+#include <ctype.h>
+
+#ifdef WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
 
 
 // --------------------------------------------------------------------------
@@ -21,7 +31,7 @@
 // --------------------------------------------------------------------------
 // Basic types.
 // --------------------------------------------------------------------------
-typedef unsigned long dword;
+typedef unsigned int dword; // 32 bit, the structures below have to match the file layout
 typedef unsigned short word;
 typedef unsigned char byte;
 
@@ -108,10 +118,33 @@ struct ZipFile::TZipDirFileHeader
 
 #pragma pack()
 
+ZipFile::ZipFile() : m_pData(0), m_nSize(0), m_bMapped(false), m_nEntries(0)
+{
+#ifdef WIN32
+  m_hMapping = 0;
+#endif
+}
+
+// --------------------------------------------------------------------------
+// Function:      Init
+// Purpose:       Initialize the object and read the zip file directory.
+// Parameters:    The name of the zip file.
+// --------------------------------------------------------------------------
+TError ZipFile::Init(const char *filename)
+{
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
+    return RET_FAIL;
+
+  TError ret = Init(f);
+  fclose(f);
+  return ret;
+}
+
 // --------------------------------------------------------------------------
 // Function:      Init
 // Purpose:       Initialize the object and read the zip file directory.
-// Parameters:    A stdio FILE* used for reading.
+// Parameters:    A stdio FILE* used for reading. It is not used after Init returns.
 // --------------------------------------------------------------------------
 TError ZipFile::Init(FILE *f)
 {
@@ -119,66 +152,175 @@ TError ZipFile::Init(FILE *f)
   if (f == NULL)
     return RET_FAIL;
 
-  // Assuming no extra comment at the end, read the whole end record.
-  TZipDirHeader dh;
+  if (MapFile(fileno(f)) != RET_OK)
+  {
+    // Read the whole thing instead.
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (size <= 0)
+      return RET_FAIL;
+
+    m_Buffer.resize(size);
+    if (fread(&m_Buffer[0], size, 1, f) != 1)
+    {
+      End();
+      return RET_FAIL;
+    }
+    m_pData = &m_Buffer[0];
+    m_nSize = (unsigned int)size;
+  }
 
-  fseek(f, -(int)sizeof(dh), SEEK_END);
-  long dhOffset = ftell(f);
-  memset(&dh, 0, sizeof(dh));
-  fread(&dh, sizeof(dh), 1, f);
+  TError ret = ReadDirectory();
+  if (ret != RET_OK)
+    End();
+  return ret;
+}
 
-  // Check
-  if (dh.sig != TZipDirHeader::SIGNATURE)
+// --------------------------------------------------------------------------
+// Function:      MapFile
+// Purpose:       Map the whole file in memory, read-only.
+// Parameters:    The file descriptor.
+// --------------------------------------------------------------------------
+TError ZipFile::MapFile(int fd)
+{
+#ifdef WIN32
+  HANDLE hFile = (HANDLE)_get_osfhandle(fd);
+  if (hFile == INVALID_HANDLE_VALUE)
     return RET_FAIL;
 
-  // Go to the beginning of the directory.
-  fseek(f, dhOffset - dh.dirSize, SEEK_SET);
+  DWORD sizeHigh = 0;
+  DWORD size = GetFileSize(hFile, &sizeHigh);
+  if (size == INVALID_FILE_SIZE || size == 0 || sizeHigh != 0)
+    return RET_FAIL;
 
-  // Allocate the data buffer, and read the whole thing.
-  m_pDirData = new char[dh.dirSize + dh.nDirEntries*sizeof(*m_papDir)];
-  if (!m_pDirData)
+  HANDLE hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (hMapping == NULL)
     return RET_FAIL;
-  memset(m_pDirData, 0, dh.dirSize + dh.nDirEntries*sizeof(*m_papDir));
-  fread(m_pDirData, dh.dirSize, 1, f);
 
-  // Now process each entry.
-  char *pfh = m_pDirData;
-  m_papDir = (const TZipDirFileHeader **)(m_pDirData + dh.dirSize);
+  void *p = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+  if (p == NULL)
+  {
+    CloseHandle(hMapping);
+    return RET_FAIL;
+  }
+  m_hMapping = hMapping;
+#else
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0 || (unsigned long long)st.st_size > 0xffffffffULL)
+    return RET_FAIL;
+
+  size_t size = (size_t)st.st_size;
+  void *p = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED)
+    return RET_FAIL;
+#endif
+
+  m_pData = (const char *)p;
+  m_nSize = (unsigned int)size;
+  m_bMapped = true;
+  return RET_OK;
+}
+
+// --------------------------------------------------------------------------
+// Function:      HashName
+// Purpose:       Case-insensitive hash of a name, '/' hashes like '\'.
+// Parameters:    The name and its length.
+// --------------------------------------------------------------------------
+static inline char NormalizeChar(char c)
+{
+  return c == '/' ? '\\' : (char)tolower((unsigned char)c);
+}
+
+unsigned int ZipFile::HashName(const char *name, int len)
+{
+  unsigned int h = 2166136261U;
+  for (int i = 0; i < len; i++)
+    h = (h ^ (unsigned char)NormalizeChar(name[i])) * 16777619U;
+  return h;
+}
 
-  TError ret = RET_OK;
+// --------------------------------------------------------------------------
+// Function:      ReadDirectory
+// Purpose:       Check and index the directory in m_pData.
+// Parameters:    
+// --------------------------------------------------------------------------
+TError ZipFile::ReadDirectory()
+{
+  // Find the end record, it's followed by a comment of at most 64k.
+  TZipDirHeader dh;
+  if (m_nSize < sizeof(dh))
+    return RET_FAIL;
 
-  for (int i = 0; i < dh.nDirEntries && ret == RET_OK; i++)
+  long dhOffset = -1;
+  long minOffset = (long)m_nSize - (long)sizeof(dh) - 0xffff;
+  for (long ofs = m_nSize - sizeof(dh); ofs >= 0 && ofs >= minOffset; ofs--)
   {
-    TZipDirFileHeader &fh = *(TZipDirFileHeader*)pfh;
+    dword sig;
+    memcpy(&sig, m_pData + ofs, sizeof(sig));
+    if (sig == TZipDirHeader::SIGNATURE)
+    {
+      dhOffset = ofs;
+      break;
+    }
+  }
+  if (dhOffset < 0)
+    return RET_FAIL;
 
-    // Store the address of nth file for quicker access.
-    m_papDir[i] = &fh;
+  memcpy(&dh, m_pData + dhOffset, sizeof(dh));
+  if (dh.dirSize > (dword)dhOffset)
+    return RET_FAIL;
+
+  // Now process each entry.
+  const char *pfh = m_pData + dhOffset - dh.dirSize;
+  const char *pEnd = m_pData + dhOffset;
+
+  m_papDir.resize(dh.nDirEntries);
+  m_NameOfs.resize(dh.nDirEntries);
+  m_Names.clear();
+  m_Names.reserve(dh.dirSize);
 
+  for (int i = 0; i < dh.nDirEntries; i++)
+  {
     // Check the directory entry integrity.
+    if (pEnd - pfh < (long)sizeof(TZipDirFileHeader))
+      return RET_FAIL;
+
+    const TZipDirFileHeader &fh = *(const TZipDirFileHeader*)pfh;
     if (fh.sig != TZipDirFileHeader::SIGNATURE)
-      ret = RET_FAIL;
-    else
-    {
-      pfh += sizeof(fh);
+      return RET_FAIL;
+    if (pEnd - pfh < (long)(sizeof(fh) + fh.fnameLen + fh.xtraLen + fh.cmntLen))
+      return RET_FAIL;
 
-      // Convert UNIX slashes to DOS backlashes.
-      for (int j = 0; j < fh.fnameLen; j++)
-        if (pfh[j] == '/')
-          pfh[j] = '\\';
+    // Store the address of nth file for quicker access.
+    m_papDir[i] = &fh;
 
-      // Skip name, extra and comment fields.
-      pfh += fh.fnameLen + fh.xtraLen + fh.cmntLen;
-    }
+    // Store the name, with UNIX slashes converted to DOS backlashes.
+    m_NameOfs[i] = (int)m_Names.size();
+    const char *name = fh.GetName();
+    for (int j = 0; j < fh.fnameLen; j++)
+      m_Names.push_back(name[j] == '/' ? '\\' : name[j]);
+    m_Names.push_back(0);
+
+    // Skip header, name, extra and comment fields.
+    pfh += sizeof(fh) + fh.fnameLen + fh.xtraLen + fh.cmntLen;
   }
-  if (ret != RET_OK)
-    delete[] m_pDirData;
-  else
+
+  // Build the name index. Entries are added last to first, so Find returns the first of duplicate names.
+  unsigned int size = 64;
+  while (size < (unsigned int)dh.nDirEntries * 2)
+    size *= 2;
+  m_HashHead.assign(size, -1);
+  m_HashNext.assign(dh.nDirEntries, -1);
+  for (int i = dh.nDirEntries - 1; i >= 0; i--)
   {
-    m_nEntries = dh.nDirEntries;
-    m_f = f;
+    unsigned int h = HashName(&m_Names[m_NameOfs[i]], m_papDir[i]->fnameLen) & (size - 1);
+    m_HashNext[i] = m_HashHead[h];
+    m_HashHead[h] = i;
   }
 
-  return ret;
+  m_nEntries = dh.nDirEntries;
+  return RET_OK;
 }
 
 // --------------------------------------------------------------------------
@@ -188,11 +330,27 @@ TError ZipFile::Init(FILE *f)
 // --------------------------------------------------------------------------
 void ZipFile::End()
 {
-  if (IsOk())
+  if (m_bMapped)
   {
-    delete[] m_pDirData;
-    m_nEntries = 0;
+#ifdef WIN32
+    UnmapViewOfFile((void *)m_pData);
+    CloseHandle((HANDLE)m_hMapping);
+    m_hMapping = 0;
+#else
+    munmap((void *)m_pData, m_nSize);
+#endif
+    m_bMapped = false;
   }
+  m_pData = 0;
+  m_nSize = 0;
+  m_nEntries = 0;
+
+  std::vector<char>().swap(m_Buffer);
+  m_Names.clear();
+  m_NameOfs.clear();
+  m_papDir.clear();
+  m_HashHead.clear();
+  m_HashNext.clear();
 }
 
 // --------------------------------------------------------------------------
@@ -209,10 +367,9 @@ void ZipFile::GetFilename(int i, char *pszDest, int Max)  const
     else
     {
 		int m=m_papDir[i]->fnameLen;
-		if (Max<m) m=Max;
+		if (Max-1<m) m=Max-1;
 
-		//strncpy (pszDest, m_papDir[i]->GetName(), MIN(Max, m_papDir[i]->fnameLen));
-		memcpy(pszDest, m_papDir[i]->GetName(),m );
+		memcpy(pszDest, &m_Names[m_NameOfs[i]], m);
 		pszDest[m] = '\0';
     }
   }
@@ -231,58 +388,115 @@ int ZipFile::GetFileLen(int i) const
     return m_papDir[i]->ucSize;
 }
 
+// --------------------------------------------------------------------------
+// Function:      Find
+// Purpose:       Look up a file by name
+// Parameters:    The name, case and slash direction don't matter.
+// --------------------------------------------------------------------------
+int ZipFile::Find(const char *name) const
+{
+  if (!m_nEntries || name == NULL)
+    return -1;
+
+  int len = (int)strlen(name);
+  unsigned int h = HashName(name, len) & (unsigned int)(m_HashHead.size() - 1);
+
+  for (int i = m_HashHead[h]; i >= 0; i = m_HashNext[i])
+  {
+    if (m_papDir[i]->fnameLen != len)
+      continue;
+
+    const char *entry = &m_Names[m_NameOfs[i]];
+    int j = 0;
+    while (j < len && NormalizeChar(entry[j]) == NormalizeChar(name[j]))
+      j++;
+    if (j == len)
+      return i;
+  }
+  return -1;
+}
+
+// --------------------------------------------------------------------------
+// Function:      GetFileData
+// Purpose:       Find the (possibly compressed) data of a file in the archive
+// Parameters:    The file index, and where to store the compression method.
+// --------------------------------------------------------------------------
+const char* ZipFile::GetFileData(int i, int *compression) const
+{
+  if (i < 0 || i >= m_nEntries)
+    return 0;
+
+  // The sizes are taken from the directory, the local header may not have them.
+  const TZipDirFileHeader &fh = *m_papDir[i];
+  if (fh.hdrOffset > m_nSize || m_nSize - fh.hdrOffset < sizeof(TZipLocalHeader))
+    return 0;
+
+  TZipLocalHeader h;
+  memcpy(&h, m_pData + fh.hdrOffset, sizeof(h));
+  if (h.sig != TZipLocalHeader::SIGNATURE)
+    return 0;
+
+  // Skip name and extra fields
+  unsigned int ofs = fh.hdrOffset + sizeof(h) + h.fnameLen + h.xtraLen;
+  if (ofs > m_nSize || m_nSize - ofs < fh.cSize)
+    return 0;
+
+  *compression = fh.compression;
+  return m_pData + ofs;
+}
+
+// --------------------------------------------------------------------------
+// Function:      GetStoredData
+// Purpose:       Direct access to a file that isn't compressed
+// Parameters:    The file index.
+// --------------------------------------------------------------------------
+const void* ZipFile::GetStoredData(int i) const
+{
+  int compression;
+  const char *data = GetFileData(i, &compression);
+
+  if (data == NULL || compression != TZipDirFileHeader::COMP_STORE || m_papDir[i]->cSize != m_papDir[i]->ucSize)
+    return 0;
+  return data;
+}
+
 // --------------------------------------------------------------------------
 // Function:      ReadFile
 // Purpose:       Uncompress a complete file
 // Parameters:    The file index and the pre-allocated buffer
 // --------------------------------------------------------------------------
-TError ZipFile::ReadFile(int i, void *pBuf)
+TError ZipFile::ReadFile(int i, void *pBuf) const
 {
-  if (pBuf == NULL || i < 0 || i >= m_nEntries)
+  if (pBuf == NULL)
     return RET_FAIL;
 
-  // Quick'n dirty read, the whole file at once.
-  // Ungood if the ZIP has huge files inside
-
-  // Go to the actual file and read the local header.
-  fseek(m_f, m_papDir[i]->hdrOffset, SEEK_SET);
-  TZipLocalHeader h;
-
-  memset(&h, 0, sizeof(h));
-  fread(&h, sizeof(h), 1, m_f);
-  if (h.sig != TZipLocalHeader::SIGNATURE)
+  int compression;
+  const char *data = GetFileData(i, &compression);
+  if (data == NULL)
     return RET_FAIL;
 
-  // Skip extra fields
-  fseek(m_f, h.fnameLen + h.xtraLen, SEEK_CUR);
+  const TZipDirFileHeader &fh = *m_papDir[i];
 
-  if (h.compression == TZipLocalHeader::COMP_STORE)
+  if (compression == TZipDirFileHeader::COMP_STORE)
   {
-    // Simply read in raw stored data.
-    fread(pBuf, h.cSize, 1, m_f);
+    // Simply copy the raw stored data.
+    if (fh.cSize != fh.ucSize)
+      return RET_FAIL;
+    memcpy(pBuf, data, fh.ucSize);
     return RET_OK;
   }
-  else if (h.compression != TZipLocalHeader::COMP_DEFLAT)
+  else if (compression != TZipDirFileHeader::COMP_DEFLAT)
     return RET_FAIL;
 
-  // Alloc compressed data buffer and read the whole stream
-  char *pcData = new char[h.cSize];
-  if (!pcData)
-    return RET_FAIL;
-
-  memset(pcData, 0, h.cSize);
-  fread(pcData, h.cSize, 1, m_f);
-
-  TError ret = RET_OK;
-
-  // Setup the inflate stream.
+  // Setup the inflate stream, reading straight from the archive data.
   z_stream stream;
   int err;
 
-  stream.next_in = (Bytef*)pcData;
-  stream.avail_in = (uInt)h.cSize;
+  memset(&stream, 0, sizeof(stream));
+  stream.next_in = (Bytef*)data;
+  stream.avail_in = (uInt)fh.cSize;
   stream.next_out = (Bytef*)pBuf;
-  stream.avail_out = h.ucSize;
+  stream.avail_out = fh.ucSize;
   stream.zalloc = (alloc_func)0;
   stream.zfree = (free_func)0;
 
@@ -292,13 +506,10 @@ TError ZipFile::ReadFile(int i, void *pBuf)
   {
     err = inflate(&stream, Z_FINISH);
     inflateEnd(&stream);
-    if (err == Z_STREAM_END)
+    if (err == Z_STREAM_END && stream.total_out == fh.ucSize)
       err = Z_OK;
-    inflateEnd(&stream);
+    else if (err == Z_OK)
+      err = Z_DATA_ERROR; // truncated stream
   }
-  if (err != Z_OK)
-    ret = RET_FAIL;
-
-  delete[] pcData;
-  return ret;
+  return err == Z_OK ? RET_OK : RET_FAIL;
 }
@@ -7,11 +7,16 @@
 #define _ZIPFILE_H_
 
 #include <stdio.h>
+#include <vector>
 
 // A quick'n dirty ZIP file reader class.
 // (C) Copyright 2000 Javier Arevalo. Use and modify as you like
 // Get zlib from http://www.cdrom.com/pub/infozip/zlib/
 
+// The archive is memory mapped (or read into memory in one go if mapping fails), and a
+// case-insensitive hash index of the names is built by Init. After Init the object is
+// never modified, so any number of threads can call the const functions at the same time.
+
 enum TError
 {
   RET_OK,
@@ -23,10 +28,11 @@ class ZipFile
 {
   public:
 
-    ZipFile    (): m_nEntries(0) { }
+    ZipFile    ();
     ~ZipFile   ()                { End(); }
 
-    TError  Init          (FILE *f);
+    TError  Init          (const char *filename);
+    TError  Init          (FILE *f); // the file can be closed after Init
     void    End           ();
     bool    IsOk          ()         const { return (m_nEntries != 0); }
 
@@ -35,7 +41,15 @@ class ZipFile
     void    GetFilename   (int i, char *pszDest, int Max) const;
     int     GetFileLen    (int i) const;
 
-    TError  ReadFile      (int i, void *pBuf);
+    // Returns the index of a file, or -1. Case-insensitive, and '/' matches '\\'.
+    int     Find          (const char *name) const;
+
+    // Data of a stored (uncompressed) file inside the mapping, 0 if the file is compressed.
+    // Valid until End() is called.
+    const void* GetStoredData (int i) const;
+
+    // Uncompresses a complete file into pBuf, which must hold GetFileLen(i) bytes.
+    TError  ReadFile      (int i, void *pBuf) const;
 
   private:
 
@@ -43,12 +57,28 @@ class ZipFile
     struct TZipDirFileHeader;
     struct TZipLocalHeader;
 
-    FILE                     *m_f;
-    char                     *m_pDirData; // Raw data buffer.
+    TError  MapFile       (int fd);
+    TError  ReadDirectory ();
+    const char* GetFileData (int i, int *compression) const;
+    static unsigned int HashName (const char *name, int len);
+
+    const char               *m_pData;    // The whole archive.
+    unsigned int              m_nSize;
+    bool                      m_bMapped;  // m_pData is a memory mapping instead of m_Buffer
+#ifdef WIN32
+    void                     *m_hMapping;
+#endif
+    std::vector<char>         m_Buffer;   // Used when the file couldn't be mapped.
+    std::vector<char>         m_Names;    // Zero terminated names, with DOS backslashes.
+    std::vector<int>          m_NameOfs;  // Offset in m_Names for each entry.
     int                       m_nEntries; // Number of entries.
 
-    // Pointers to the dir entries in pDirData.
-    const TZipDirFileHeader **m_papDir;   
+    // Pointers to the dir entries in m_pData.
+    std::vector<const TZipDirFileHeader*> m_papDir;
+
+    // Name hash index: first entry in each bucket, and the next entry in the same bucket per entry.
+    std::vector<int>          m_HashHead;
+    std::vector<int>          m_HashNext;
 };
 
 #endif // _ZIPFILE_H_
@@ -316,7 +316,7 @@ bool CDDSImage::load(string filename, bool flipImage)
     fread(filecode, 1, 4, fp);
     if (strncmp(filecode, "DDS ", 4) != 0)
     {
-        //fclose(fp);
+        fclose(fp);
         return false;
     }
 
@@ -421,7 +421,14 @@ bool CDDSImage::load(string filename, bool flipImage)
 
         // load surface
         unsigned char *pixels = new unsigned char[size];
-        fread(pixels, 1, size, fp);
+        if (fread(pixels, 1, size, fp) != size)
+        {
+            // truncated file
+            delete [] pixels;
+            fclose(fp);
+            clear();
+            return false;
+        }
 
 		img.create(width, height, depth, size, pixels);
         
@@ -454,7 +461,13 @@ bool CDDSImage::load(string filename, bool flipImage)
             size = (this->*sizefunc)(w, h)*d;
 
             unsigned char *pixels = new unsigned char[size];
-            fread(pixels, 1, size, fp);
+            if (fread(pixels, 1, size, fp) != size)
+            {
+                delete [] pixels;
+                fclose(fp);
+                clear();
+                return false;
+            }
 
             mipmap.create(w, h, d, size, pixels);
             
@@ -74,32 +74,33 @@ namespace nv_dds
         unsigned char row[6];
     };
 
+    // the fields are 32 bit, unsigned long is 64 bit on 64 bit unixes
     struct DDS_PIXELFORMAT
     {
-        unsigned long dwSize;
-        unsigned long dwFlags;
-        unsigned long dwFourCC;
-        unsigned long dwRGBBitCount;
-        unsigned long dwRBitMask;
-        unsigned long dwGBitMask;
-        unsigned long dwBBitMask;
-        unsigned long dwABitMask;
+        unsigned int dwSize;
+        unsigned int dwFlags;
+        unsigned int dwFourCC;
+        unsigned int dwRGBBitCount;
+        unsigned int dwRBitMask;
+        unsigned int dwGBitMask;
+        unsigned int dwBBitMask;
+        unsigned int dwABitMask;
     };
 
     struct DDS_HEADER
     {
-        unsigned long dwSize;
-        unsigned long dwFlags;
-        unsigned long dwHeight;
-        unsigned long dwWidth;
-        unsigned long dwPitchOrLinearSize;
-        unsigned long dwDepth;
-        unsigned long dwMipMapCount;
-        unsigned long dwReserved1[11];
+        unsigned int dwSize;
+        unsigned int dwFlags;
+        unsigned int dwHeight;
+        unsigned int dwWidth;
+        unsigned int dwPitchOrLinearSize;
+        unsigned int dwDepth;
+        unsigned int dwMipMapCount;
+        unsigned int dwReserved1[11];
         DDS_PIXELFORMAT ddspf;
-        unsigned long dwCaps1;
-        unsigned long dwCaps2;
-        unsigned long dwReserved2[3];
+        unsigned int dwCaps1;
+        unsigned int dwCaps2;
+        unsigned int dwReserved2[3];
     };
 
     typedef enum TextureType
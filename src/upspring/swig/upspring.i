@@ -5,6 +5,7 @@
 
 #include "ScriptInterface.h"
 #include "../Model.h"
+#include "../AnimEvaluator.h"
 #include "DebugTrace.h"
 //#include "../Fltk.h"
 %}
@@ -71,7 +72,7 @@ const char* input(const char *label, const char *def);
 
 %extend MdlObject {
 	void NewPolyMesh() {
-		delete self->geometry;
+		if (self->geometry) self->geometry->Release();
 		self->geometry = new PolyMesh;
 	}
 }
@@ -190,6 +191,53 @@ void upsAnimInsertFloatKey(AnimProperty& prop, float time, float val)
 		prop.InsertKey(&val, time);
 }
 
+// Like calling upsAnimInsertVectorKey for every time in times, with the Vector3 at values[3*i],
+// but the keys of the property are rebuilt only once. Rotations are given as euler angles.
+void upsAnimInsertVectorKeys(AnimProperty& prop, const std::vector<float>& times, const std::vector<float>& values)
+{
+	int count = (int)std::min(times.size(), values.size() / 3);
+	if (count <= 0)
+		return;
+
+	std::vector<Vector3> v(count);
+	for (int a=0;a<count;a++)
+		v[a] = Vector3(values[a*3], values[a*3+1], values[a*3+2]);
+
+	switch(prop.controller->GetType()) {
+	case AnimController::ANIMKEY_Vector3:
+		prop.InsertKeys(&times[0], &v[0], count);
+		break;
+	case AnimController::ANIMKEY_Quat: {
+		std::vector<Quaternion> q(count);
+		for (int a=0;a<count;a++) {
+			Rotator rot;
+			rot.SetEuler(v[a]);
+			q[a] = rot.GetQuat();
+		}
+		prop.InsertKeys(&times[0], &q[0], count);
+		break; }
+	}
+}
+
+// Like calling upsAnimInsertFloatKey for every time in times, with the value at the same index
+void upsAnimInsertFloatKeys(AnimProperty& prop, const std::vector<float>& times, const std::vector<float>& values)
+{
+	int count = (int)std::min(times.size(), values.size());
+	if (count > 0 && prop.controller->GetType() == AnimController::ANIMKEY_Float)
+		prop.InsertKeys(&times[0], &values[0], count);
+}
+
+// Evaluates numFrames frames of the animation of root and all its children. Each frame has the
+// values of all float, vector3 and rotation properties, in the order of GetObjectList() and the
+// animInfo.properties of each object. A rotation quaternion is 4 values. Returns the values per frame.
+int upsAnimBake(MdlObject *root, float startTime, float frameTime, int numFrames, std::vector<float>& out)
+{
+	AnimEvaluator eval;
+	eval.Build(root);
+	eval.Bake(startTime, frameTime, numFrames, out);
+	return eval.NumValues();
+}
+
 
 
 %}
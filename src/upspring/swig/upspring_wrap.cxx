@@ -1493,6 +1493,7 @@ static swig_module_info swig_module = {swig_types, 74, 0, 0, 0, 0};
 
 #include "ScriptInterface.h"
 #include "../Model.h"
+#include "../AnimEvaluator.h"
 #include "DebugTrace.h"
 //#include "../Fltk.h"
 
@@ -1586,7 +1587,7 @@ SWIGINTERN int std_vector_Sl_short_Sg____len(std::vector<short > *self){
 				return (*self).size();
 			}
 SWIGINTERN void MdlObject_NewPolyMesh(MdlObject *self){
-		delete self->geometry;
+		if (self->geometry) self->geometry->Release();
 		self->geometry = new PolyMesh;
 	}
 SWIGINTERN void Model_SetRoot(Model *self,MdlObject *o){
@@ -1801,6 +1802,53 @@ void upsAnimInsertFloatKey(AnimProperty& prop, float time, float val)
 		prop.InsertKey(&val, time);
 }
 
+// Like calling upsAnimInsertVectorKey for every time in times, with the Vector3 at values[3*i],
+// but the keys of the property are rebuilt only once. Rotations are given as euler angles.
+void upsAnimInsertVectorKeys(AnimProperty& prop, const std::vector<float>& times, const std::vector<float>& values)
+{
+	int count = (int)std::min(times.size(), values.size() / 3);
+	if (count <= 0)
+		return;
+
+	std::vector<Vector3> v(count);
+	for (int a=0;a<count;a++)
+		v[a] = Vector3(values[a*3], values[a*3+1], values[a*3+2]);
+
+	switch(prop.controller->GetType()) {
+	case AnimController::ANIMKEY_Vector3:
+		prop.InsertKeys(&times[0], &v[0], count);
+		break;
+	case AnimController::ANIMKEY_Quat: {
+		std::vector<Quaternion> q(count);
+		for (int a=0;a<count;a++) {
+			Rotator rot;
+			rot.SetEuler(v[a]);
+			q[a] = rot.GetQuat();
+		}
+		prop.InsertKeys(&times[0], &q[0], count);
+		break; }
+	}
+}
+
+// Like calling upsAnimInsertFloatKey for every time in times, with the value at the same index
+void upsAnimInsertFloatKeys(AnimProperty& prop, const std::vector<float>& times, const std::vector<float>& values)
+{
+	int count = (int)std::min(times.size(), values.size());
+	if (count > 0 && prop.controller->GetType() == AnimController::ANIMKEY_Float)
+		prop.InsertKeys(&times[0], &values[0], count);
+}
+
+// Evaluates numFrames frames of the animation of root and all its children. Each frame has the
+// values of all float, vector3 and rotation properties, in the order of GetObjectList() and the
+// animInfo.properties of each object. A rotation quaternion is 4 values. Returns the values per frame.
+int upsAnimBake(MdlObject *root, float startTime, float frameTime, int numFrames, std::vector<float>& out)
+{
+	AnimEvaluator eval;
+	eval.Build(root);
+	eval.Bake(startTime, frameTime, numFrames, out);
+	return eval.NumValues();
+}
+
 
 
 
@@ -16882,6 +16930,30 @@ fail:
 }
 
 
+static int _wrap_CalculateObjectNormals(lua_State* L) {
+  int SWIG_arg = -1;
+  std::vector<MdlObject * > *arg1 = 0 ;
+  float arg2 ;
+  
+  if(!lua_isuserdata(L,1)) SWIG_fail_arg(1);
+  if(!lua_isnumber(L,2)) SWIG_fail_arg(2);
+  
+  if (!SWIG_IsOK(SWIG_ConvertPtr(L,1,(void**)&arg1,SWIGTYPE_p_std__vectorTMdlObject_p_t,0))){
+    SWIG_fail_ptr("CalculateObjectNormals",1,SWIGTYPE_p_std__vectorTMdlObject_p_t);
+  }
+  
+  arg2 = (float)lua_tonumber(L, 2);
+  CalculateObjectNormals((std::vector<MdlObject * > const &)*arg1,arg2);
+  SWIG_arg=0;
+  
+  return SWIG_arg;
+  
+fail:
+  lua_error(L);
+  return SWIG_arg;
+}
+
+
 static int _wrap_new_AnimProperty__SWIG_0(lua_State* L) {
   int SWIG_arg = -1;
   AnimProperty *result = 0 ;
@@ -23274,6 +23346,114 @@ fail:
 }
 
 
+static int _wrap_upsAnimInsertVectorKeys(lua_State* L) {
+  int SWIG_arg = -1;
+  AnimProperty *arg1 = 0 ;
+  std::vector<float > *arg2 = 0 ;
+  std::vector<float > *arg3 = 0 ;
+  
+  if(!lua_isuserdata(L,1)) SWIG_fail_arg(1);
+  if(!lua_isuserdata(L,2)) SWIG_fail_arg(2);
+  if(!lua_isuserdata(L,3)) SWIG_fail_arg(3);
+  
+  if (!SWIG_IsOK(SWIG_ConvertPtr(L,1,(void**)&arg1,SWIGTYPE_p_AnimProperty,0))){
+    SWIG_fail_ptr("upsAnimInsertVectorKeys",1,SWIGTYPE_p_AnimProperty);
+  }
+  
+  
+  if (!SWIG_IsOK(SWIG_ConvertPtr(L,2,(void**)&arg2,SWIGTYPE_p_std__vectorTfloat_t,0))){
+    SWIG_fail_ptr("upsAnimInsertVectorKeys",2,SWIGTYPE_p_std__vectorTfloat_t);
+  }
+  
+  
+  if (!SWIG_IsOK(SWIG_ConvertPtr(L,3,(void**)&arg3,SWIGTYPE_p_std__vectorTfloat_t,0))){
+    SWIG_fail_ptr("upsAnimInsertVectorKeys",3,SWIGTYPE_p_std__vectorTfloat_t);
+  }
+  
+  upsAnimInsertVectorKeys(*arg1,(std::vector<float > const &)*arg2,(std::vector<float > const &)*arg3);
+  SWIG_arg=0;
+  
+  return SWIG_arg;
+  
+fail:
+  lua_error(L);
+  return SWIG_arg;
+}
+
+
+static int _wrap_upsAnimInsertFloatKeys(lua_State* L) {
+  int SWIG_arg = -1;
+  AnimProperty *arg1 = 0 ;
+  std::vector<float > *arg2 = 0 ;
+  std::vector<float > *arg3 = 0 ;
+  
+  if(!lua_isuserdata(L,1)) SWIG_fail_arg(1);
+  if(!lua_isuserdata(L,2)) SWIG_fail_arg(2);
+  if(!lua_isuserdata(L,3)) SWIG_fail_arg(3);
+  
+  if (!SWIG_IsOK(SWIG_ConvertPtr(L,1,(void**)&arg1,SWIGTYPE_p_AnimProperty,0))){
+    SWIG_fail_ptr("upsAnimInsertFloatKeys",1,SWIGTYPE_p_AnimProperty);
+  }
+  
+  
+  if (!SWIG_IsOK(SWIG_ConvertPtr(L,2,(void**)&arg2,SWIGTYPE_p_std__vectorTfloat_t,0))){
+    SWIG_fail_ptr("upsAnimInsertFloatKeys",2,SWIGTYPE_p_std__vectorTfloat_t);
+  }
+  
+  
+  if (!SWIG_IsOK(SWIG_ConvertPtr(L,3,(void**)&arg3,SWIGTYPE_p_std__vectorTfloat_t,0))){
+    SWIG_fail_ptr("upsAnimInsertFloatKeys",3,SWIGTYPE_p_std__vectorTfloat_t);
+  }
+  
+  upsAnimInsertFloatKeys(*arg1,(std::vector<float > const &)*arg2,(std::vector<float > const &)*arg3);
+  SWIG_arg=0;
+  
+  return SWIG_arg;
+  
+fail:
+  lua_error(L);
+  return SWIG_arg;
+}
+
+
+static int _wrap_upsAnimBake(lua_State* L) {
+  int SWIG_arg = -1;
+  MdlObject *arg1 = (MdlObject *) 0 ;
+  float arg2 ;
+  float arg3 ;
+  int arg4 ;
+  std::vector<float > *arg5 = 0 ;
+  int result;
+  
+  if(!lua_isuserdata(L,1)) SWIG_fail_arg(1);
+  if(!lua_isnumber(L,2)) SWIG_fail_arg(2);
+  if(!lua_isnumber(L,3)) SWIG_fail_arg(3);
+  if(!lua_isnumber(L,4)) SWIG_fail_arg(4);
+  if(!lua_isuserdata(L,5)) SWIG_fail_arg(5);
+  
+  if (!SWIG_IsOK(SWIG_ConvertPtr(L,1,(void**)&arg1,SWIGTYPE_p_MdlObject,0))){
+    SWIG_fail_ptr("upsAnimBake",1,SWIGTYPE_p_MdlObject);
+  }
+  
+  arg2 = (float)lua_tonumber(L, 2);
+  arg3 = (float)lua_tonumber(L, 3);
+  arg4 = (int)lua_tonumber(L, 4);
+  
+  if (!SWIG_IsOK(SWIG_ConvertPtr(L,5,(void**)&arg5,SWIGTYPE_p_std__vectorTfloat_t,0))){
+    SWIG_fail_ptr("upsAnimBake",5,SWIGTYPE_p_std__vectorTfloat_t);
+  }
+  
+  result = (int)upsAnimBake(arg1,arg2,arg3,arg4,*arg5);
+  SWIG_arg=0;
+  lua_pushnumber(L, (lua_Number) result); SWIG_arg++;
+  return SWIG_arg;
+  
+fail:
+  lua_error(L);
+  return SWIG_arg;
+}
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -23687,6 +23867,7 @@ static const struct luaL_reg swig_commands[] = {
     { "LoadWavefrontObject", _wrap_LoadWavefrontObject},
     { "SaveWavefrontObject", _wrap_SaveWavefrontObject},
     { "GenerateUniqueVectors", _wrap_GenerateUniqueVectors},
+    { "CalculateObjectNormals", _wrap_CalculateObjectNormals},
     { "new_AnimProperty",_wrap_new_AnimProperty},
     { "delete_AnimProperty", _wrap_delete_AnimProperty},
     { "AnimProperty_GetKeyIndex",_wrap_AnimProperty_GetKeyIndex},
@@ -23890,6 +24071,9 @@ static const struct luaL_reg swig_commands[] = {
     { "upsAnimInsertVectorKey", _wrap_upsAnimInsertVectorKey},
     { "upsAnimInsertRotatorKey", _wrap_upsAnimInsertRotatorKey},
     { "upsAnimInsertFloatKey", _wrap_upsAnimInsertFloatKey},
+    { "upsAnimInsertVectorKeys", _wrap_upsAnimInsertVectorKeys},
+    { "upsAnimInsertFloatKeys", _wrap_upsAnimInsertFloatKeys},
+    { "upsAnimBake", _wrap_upsAnimBake},
     {0,0}
 };
 